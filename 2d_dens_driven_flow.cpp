@@ -1,6 +1,18 @@
 #include "inmost.h"
-
-//    !!!!!!! Currently NOT suited for parallel run
+#include "profiling.h"
+#include "solver_options.h"
+#include "solution_writer.h"
+#include "mesh_cache.h"
+#include "cpr.h"
+#include "fv_tpfa.h"
+#include "tensor_tag.h"
+#include "memory_report.h"
+#include "reordering.h"
+#include <sstream>
+
+//    Can be run in parallel: mesh is partitioned at load,
+//    residuals are assembled for owned cells only
+//    and a layer of ghost cells is updated after each Newton iteration.
 //
 //
 //    The purpose of this code
@@ -27,15 +39,6 @@
 using namespace INMOST;
 using namespace std;
 
-enum{
-    T_ASSEMBLE = 0,
-    T_SOLVE,
-    T_PRECOND,
-    T_IO,
-    T_INIT,
-    T_UPDATE
-};
-
 const string tagNameTensorK  = "HYDRAULIC_CONDUCTIVITY";
 const string tagNameTensorD  = "DIFFUSION_TENSOR";
 const string tagNameBCFlow   = "BC_FLOW";
@@ -44,10 +47,14 @@ const string tagNameHead     = "Water_Head";
 const string tagNameConc     = "Conc";
 const string tagNameHeadPrev = "Water_Head_Prev";
 const string tagNameConcPrev = "Conc_Prev";
+const string tagNameHeadOld  = "Water_Head_Prev2";
+const string tagNameConcOld  = "Conc_Prev2";
 const string tagNameWatFlux  = "Water_Flux";
+const string tagNameDens     = "Density";
 
-const double dt              = 1e-3;
-const int    nt              = 25;
+const double dt0             = 1e-3; // initial time step
+const double dtOut0          = 1e-3; // interval between solution outputs
+const int    nt              = 25;   // number of outputs
 const double volConcExp      = 1e3;
 const double phi             = 0.4;
 const double sstor           = 1e-6;
@@ -63,166 +70,6 @@ class Process;
 class Process_ConfinedFlow;
 class Process_Advection;
 class Process_Diffusion;
-class FV_Diffusion;
-class FV_Diffusion_TPFA;
-
-// =====================================================
-
-class FV_Diffusion
-{
-protected:
-    Mesh *m;
-    Tag tagD;  // Diffusion tensor tag
-    Tag tagBC; // Boundary condition
-public:
-    FV_Diffusion(Mesh *mm, string nameD, string nameBC)
-    {
-        if(mm == nullptr){
-            cout << "Bad mesh pointer" << endl;
-            exit(1);
-        }
-        m = mm;
-        if(m->HaveTag(nameD)){
-            tagD = m->GetTag(nameD);
-        }
-        else{
-            cout << "Bad tensor name tag" << endl;
-            exit(1);
-        }
-        if(m->HaveTag(nameBC)){
-            tagBC = m->GetTag(nameBC);
-        }
-        else{
-            cout << "Bad BC name tag" << endl;
-            exit(1);
-        }
-    }
-    virtual ~FV_Diffusion(){}
-    virtual void build() = 0;
-    virtual variable getDgradU(const Face &f, dynamic_variable &U) = 0;
-    virtual double   getDgradZ(const Face &f) = 0;
-};
-
-
-class FV_Diffusion_TPFA : public FV_Diffusion
-{
-protected:
-    Tag tagT; // TPFA transmissibility coeff
-public:
-    void build();
-    variable getDgradU(const Face &f, dynamic_variable &U);
-    double   getDgradZ(const Face &f);
-    FV_Diffusion_TPFA(Mesh *mm, string s1, string s2) : FV_Diffusion(mm,s1,s2) {}
-    ~FV_Diffusion_TPFA() {}
-};
-
-void FV_Diffusion_TPFA::build()
-{
-    tagT = m->CreateTag("TPFA_trans", DATA_REAL, FACE, NONE, 1);
-    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
-        Face f = iface->getAsFace();
-        double xf[2];
-        f.Barycenter(xf);
-
-        if(f.Boundary()){            // Here 'p' and 'm' refer to '+' and '-'
-            Cell cp = f.BackCell();
-            double xp[2];
-            cp.Barycenter(xp);
-
-            rMatrix Dp(2,2), ne(2,1), lp(2,1);
-            // initialize diffusion tensors
-            Dp(0,0) = cp.RealArray(tagD)[0];
-            Dp(0,1) = cp.RealArray(tagD)[2];
-            Dp(1,0) = cp.RealArray(tagD)[2];
-            Dp(1,1) = cp.RealArray(tagD)[1];
-
-            // Get unit normal for face
-            f.UnitNormal(ne.data());
-
-            // Compute l's
-            lp(0,0) = xf[0] - xp[0];
-            lp(1,0) = xf[1] - xp[1];
-            lp /= (xf[0] - xp[0])*(xf[0] - xp[0]) + (xf[1] - xp[1])*(xf[1] - xp[1]);
-
-            double coef = (Dp*lp).DotProduct(ne);
-            f.Real(tagT) = coef;
-        }
-        else{ // internal face
-            // Here 'p' and 'm' refer to '+' and '-'
-            Cell cp = f.BackCell(), cm = f.FrontCell();
-            double xp[2], xm[2];
-            cp.Barycenter(xp);
-            cm.Barycenter(xm);
-
-            rMatrix Dp(2,2), Dm(2,2), ne(2,1), lp(2,1), lm(2,1);
-            // initialize diffusion tensors
-            Dp(0,0) = cp.RealArray(tagD)[0];
-            Dp(0,1) = cp.RealArray(tagD)[2];
-            Dp(1,0) = cp.RealArray(tagD)[2];
-            Dp(1,1) = cp.RealArray(tagD)[1];
-            Dm(0,0) = cm.RealArray(tagD)[0];
-            Dm(0,1) = cm.RealArray(tagD)[2];
-            Dm(1,0) = cm.RealArray(tagD)[2];
-            Dm(1,1) = cm.RealArray(tagD)[1];
-
-            // Get unit normal for face
-            f.UnitNormal(ne.data());
-
-            // Compute l's
-            lp(0,0) = xf[0] - xp[0];
-            lp(1,0) = xf[1] - xp[1];
-            lp /= (xf[0] - xp[0])*(xf[0] - xp[0]) + (xf[1] - xp[1])*(xf[1] - xp[1]);
-            lm(0,0) = xf[0] - xm[0];
-            lm(1,0) = xf[1] - xm[1];
-            lm /= (xf[0] - xm[0])*(xf[0] - xm[0]) + (xf[1] - xm[1])*(xf[1] - xm[1]);
-
-            double coef = (Dp*lp).DotProduct(ne) * (Dm*lm).DotProduct(ne);
-            coef /= ((Dp*lp).DotProduct(ne) - (Dm*lm).DotProduct(ne));
-            f.Real(tagT) = -coef;
-            //printf("face %d: T = %e\n", f.LocalID(), coef);
-        }
-    }
-}
-
-variable FV_Diffusion_TPFA::getDgradU(const Face &f, dynamic_variable &U)
-{
-    variable res;
-    if(f.Boundary()){
-        // Check if Neumann, then flux is known
-        if(f.RealArray(tagBC)[0] > 0.)
-            return -f.RealArray(tagBC)[1]; // minus because we know flux whihj is -DgradU
-
-        // Dirichlet
-        Cell cp = f.BackCell();
-        res = f.Real(tagT) * (f.RealArray(tagBC)[1] - U(cp));
-        //cout << "Dir face" << endl;
-    }
-    else{
-        Cell cp = f.BackCell(), cm = f.FrontCell();
-        res = f.Real(tagT) * (U(cm) - U(cp));
-    }
-    return res;
-}
-
-double FV_Diffusion_TPFA::getDgradZ(const Face &f)
-{
-    double res;
-    if(f.Boundary()){
-        Cell cp = f.BackCell();
-        double xf[2], xp[2];
-        f.Barycenter(xf);
-        cp.Barycenter(xp);
-        res = f.Real(tagT) * (xf[1] - xp[1]);
-    }
-    else{
-        Cell cp = f.BackCell(), cm = f.FrontCell();
-        double xm[2], xp[2];
-        cm.Barycenter(xm);
-        cp.Barycenter(xp);
-        res = f.Real(tagT) * (xm[1] - xp[1]);
-    }
-    return res;
-}
 
 // =====================================================
 
@@ -231,11 +78,13 @@ class Process
 protected:
     Mesh *m;
     bool steady;
+    double dt;
 public:
-    Process(Mesh *mm, vector<dynamic_variable> &dvars){ m = mm; }
+    Process(Mesh *mm, vector<dynamic_variable> &dvars){ m = mm; dt = dt0; }
     virtual ~Process(){}
     virtual void fillResidual(Residual &R) = 0;
     void setSteady(bool b) { steady = b; }
+    void setTimeStep(double tau) { dt = tau; }
 };
 
 class Process_ConfinedFlow : public Process
@@ -244,6 +93,8 @@ private:
     FV_Diffusion_TPFA tpfa;
     dynamic_variable varH, varC;
     Tag oldH, oldC;
+    Tag waterFlux; // Darcy flux through face, computed in fillResidual
+    bool fluxDerivatives; // flux is kept with derivatives, otherwise only its value
 public:
     Process_ConfinedFlow(Mesh *mm, vector<dynamic_variable> &dvars);
     ~Process_ConfinedFlow(){}
@@ -259,6 +110,8 @@ Process_ConfinedFlow::Process_ConfinedFlow(Mesh *mm, vector<dynamic_variable> &d
     varC = dvars[1];
     oldH = m->GetTag(tagNameHeadPrev);
     oldC = m->GetTag(tagNameConcPrev);
+    waterFlux = m->GetTag(tagNameWatFlux);
+    fluxDerivatives = waterFlux.GetDataType() == DATA_VARIABLE;
 }
 
 void Process_ConfinedFlow::fillResidual(Residual &R)
@@ -266,7 +119,15 @@ void Process_ConfinedFlow::fillResidual(Residual &R)
     for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
         Face f = iface->getAsFace();
         Cell cp = f.BackCell(), cm = f.FrontCell();
+        bool ownP = cp.GetStatus() != Element::Ghost;
+        bool ownM = cm.isValid() && cm.GetStatus() != Element::Ghost;
+        if(!ownP && !ownM)
+            continue;
         variable q = -1. * tpfa.getDgradU(f, varH);
+        if(fluxDerivatives)
+            f.Variable(waterFlux) = q;
+        else
+            f.Real(waterFlux) = q.GetValue();
 
         variable dens;
         if(cm.isValid())// && false)
@@ -278,12 +139,15 @@ void Process_ConfinedFlow::fillResidual(Residual &R)
 
         q *= dens;
 
-        R[varH.Index(cp)] -= q;
-        if(cm.isValid())
+        if(ownP)
+            R[varH.Index(cp)] -= q;
+        if(ownM)
             R[varH.Index(cm)] += q;
     }
     for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
         Cell cell = icell->getAsCell();
+        if(cell.GetStatus() == Element::Ghost)
+            continue;
         if(!steady){
             variable val = (varH(cell) - cell.Real(oldH))/dt * cell.Volume();
             val *= sstor;
@@ -297,9 +161,13 @@ void Process_ConfinedFlow::fillResidual(Residual &R)
 //        cout << "Adding dH/dt" << endl;
 }
 
+// Darcy flux from the last call of fillResidual,
+// oriented from back to front cell
 variable Process_ConfinedFlow::getFlux(const Face &f)
 {
-    return -1. * tpfa.getDgradU(f, varH);
+    if(!fluxDerivatives)
+        return f.Real(waterFlux);
+    return f.Variable(waterFlux);
 //    rMatrix U(1,2), ne(2,1);
 //    U(0,0) = 100;
 //    U(0,1) = 200;
@@ -314,13 +182,14 @@ class Process_Advection : public Process
 private:
     dynamic_variable varC;
     Tag oldC;
-    Tag waterFlux;
     Process_ConfinedFlow *flow;
+    bool implicitFlux; // keep derivatives of Darcy flux w.r.t. head
 public:
     Process_Advection(Mesh *, vector<dynamic_variable> &);
     ~Process_Advection(){}
     void fillResidual(Residual &R);
     void setFlow(Process_ConfinedFlow *p) { flow = p; }
+    void setImplicitFlux(bool b) { implicitFlux = b; }
 };
 
 Process_Advection::Process_Advection(Mesh *mm, vector<dynamic_variable> &dvars)
@@ -328,46 +197,47 @@ Process_Advection::Process_Advection(Mesh *mm, vector<dynamic_variable> &dvars)
 {
     varC = dvars[0];
     steady = true;
+    implicitFlux = true;
     oldC = m->GetTag(tagNameConcPrev);
 }
 
+// Darcy fluxes are taken from flow process, so its residual
+// should be filled first at the current iterate.
+// In sequential scheme head is not an unknown of transport system,
+// and only values of fluxes are used.
 void Process_Advection::fillResidual(Residual &R)
 {
-    for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
-        Cell cell = icell->getAsCell();
-        if(!steady){
-            double V = cell.Volume();
-            R[varC.Index(cell)] -= (varC(cell) - cell.Real(oldC))/dt * V;
-        }
-
-        auto faces = cell.getFaces();
-        for(auto iface = faces.begin(); iface != faces.end(); iface++){
-            Face f = iface->getAsFace();
-            variable flux = flow->getFlux(f);
-            Cell cp = f.BackCell(), cm = f.FrontCell();
-            if(cm.isValid()){
-                if(flux.GetValue() > 0.)
-                    flux *= varC(cp);
-                else
-                    flux *= varC(cm);
-                if(cell == cm)
-                    flux *= -1;
-//                if(cell == cm){
-//                    if(flux.GetValue() > 0.)
-//                        flux *= -varC(cm);
-//                    else
-//                        flux *= -varC(cp);
-//                }
-//                else{
-//                    if(flux.GetValue() > 0.)
-//                        flux *= varC(cp);
-//                    else
-//                        flux *= varC(cm);
-//                }
-            }
-            else
+    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
+        Face f = iface->getAsFace();
+        Cell cp = f.BackCell(), cm = f.FrontCell();
+        bool ownP = cp.GetStatus() != Element::Ghost;
+        bool ownM = cm.isValid() && cm.GetStatus() != Element::Ghost;
+        if(!ownP && !ownM)
+            continue;
+        variable flux;
+        if(implicitFlux)
+            flux = flow->getFlux(f);
+        else
+            flux = flow->getFlux(f).GetValue();
+        if(cm.isValid()){
+            if(flux.GetValue() > 0.)
                 flux *= varC(cp);
-            R[varC.Index(cell)] -= flux;
+            else
+                flux *= varC(cm);
+        }
+        else
+            flux *= varC(cp);
+        if(ownP)
+            R[varC.Index(cp)] -= flux;
+        if(ownM)
+            R[varC.Index(cm)] += flux;
+    }
+    if(!steady){
+        for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
+            Cell cell = icell->getAsCell();
+            if(cell.GetStatus() == Element::Ghost)
+                continue;
+            R[varC.Index(cell)] -= (varC(cell) - cell.Real(oldC))/dt * cell.Volume();
         }
     }
 //    if(!steady)
@@ -399,28 +269,26 @@ Process_Diffusion::Process_Diffusion(Mesh *mm, vector<dynamic_variable> &dvars)
 
 void Process_Diffusion::fillResidual(Residual &R)
 {
-//    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
-//        Face f = iface->getAsFace();
-//        Cell cp = f.BackCell(), cm = f.FrontCell();
-//        variable q = -1. * tpfa.getDgradU(f, varC);
-
-//        R[varC.Index(cp)] -= q;
-//        if(cm.isValid())
-//            R[varC.Index(cm)] += q;
-//    }
-    for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
-        Cell cell = icell->getAsCell();
-        if(!steady){
-            double V = cell.Volume();
-            R[varC.Index(cell)] -= (varC(cell) - cell.Real(oldС))/dt * V;
-        }
+    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
+        Face f = iface->getAsFace();
+        Cell cp = f.BackCell(), cm = f.FrontCell();
+        bool ownP = cp.GetStatus() != Element::Ghost;
+        bool ownM = cm.isValid() && cm.GetStatus() != Element::Ghost;
+        if(!ownP && !ownM)
+            continue;
+        variable q = -1. * tpfa.getDgradU(f, varC);
 
-        auto faces = cell.getFaces();
-        for(auto iface = faces.begin(); iface != faces.end(); iface++){
-            variable flux = -1. * tpfa.getDgradU(iface->getAsFace(), varC);
-            if(cell == iface->FrontCell())
-                flux *= -1.;
-            R[varC.Index(cell)] -= flux;
+        if(ownP)
+            R[varC.Index(cp)] -= q;
+        if(ownM)
+            R[varC.Index(cm)] += q;
+    }
+    if(!steady){
+        for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
+            Cell cell = icell->getAsCell();
+            if(cell.GetStatus() == Element::Ghost)
+                continue;
+            R[varC.Index(cell)] -= (varC(cell) - cell.Real(oldС))/dt * cell.Volume();
         }
     }
 //    if(!steady)
@@ -429,6 +297,193 @@ void Process_Diffusion::fillResidual(Residual &R)
 
 // =====================================================
 
+// Policy of preconditioner reuse between Newton iterations and time steps.
+// Jacobian sparsity does not change and its values drift slowly,
+// so the preconditioner is rebuilt only when one of the criteria is met:
+// - it was used for rebuildEvery linear solves (disabled if <= 0),
+// - last linear solve took more than maxLinIt iterations (disabled if <= 0),
+// - Newton residual reduction |r_k|/|r_k-1| is above stallRatio (disabled if <= 0).
+// Default policy rebuilds preconditioner for every linear solve.
+class PrecondReuse
+{
+private:
+    int    rebuildEvery;
+    int    maxLinIt;
+    double stallRatio;
+    bool   valid;      // solver holds preconditioner of current system
+    int    numUses;    // linear solves since last rebuild
+    int    lastLinIt;  // iterations of last linear solve
+    int    numBuilds;  // total number of rebuilds
+public:
+    PrecondReuse() : rebuildEvery(1), maxLinIt(0), stallRatio(0.),
+        valid(false), numUses(0), lastLinIt(0), numBuilds(0) {}
+    void setRebuildEvery(int n)   { rebuildEvery = n; }
+    void setMaxLinIt(int n)       { maxLinIt = n; }
+    void setStallRatio(double r)  { stallRatio = r; }
+    void invalidate()             { valid = false; }
+    int  getNumBuilds() const     { return numBuilds; }
+    bool needRebuild(double norm, double normPrev) const;
+    void update(bool rebuilt, int linIt);
+};
+
+bool PrecondReuse::needRebuild(double norm, double normPrev) const
+{
+    if(!valid)
+        return true;
+    if(rebuildEvery > 0 && numUses >= rebuildEvery)
+        return true;
+    if(maxLinIt > 0 && lastLinIt > maxLinIt)
+        return true;
+    if(stallRatio > 0. && normPrev > 0. && norm > stallRatio * normPrev)
+        return true;
+    return false;
+}
+
+void PrecondReuse::update(bool rebuilt, int linIt)
+{
+    if(rebuilt){
+        numBuilds++;
+        numUses = 0;
+    }
+    valid = true;
+    numUses++;
+    lastLinIt = linIt;
+}
+
+// =====================================================
+
+// Relative tolerance of linear solves in Newton iterations.
+// By default every system is solved to fixed tolerance rtol (1e-12).
+// In inexact mode it is Eisenstat-Walker forcing term (choice 2):
+//   eta_k = gamma * (|r_k| / |r_k-1|)^alpha,
+// not below gamma * eta_k-1^alpha when that is above 0.1 (no sudden drop),
+// at most etaMax, which is also used at the first iteration,
+// and not below 0.5 * target / |r_k|: there is no need to solve the last
+// system more accurately than Newton convergence criterion needs.
+class LinearTolerance
+{
+private:
+    bool   inexact;
+    double rtol, etaMax, gamma, alpha;
+    double etaPrev;
+public:
+    LinearTolerance() : inexact(false), rtol(1e-12), etaMax(0.1), gamma(0.9), alpha(2.), etaPrev(0.) {}
+    void setInexact(bool b)      { inexact = b; }
+    void setMaxForcing(double e) { etaMax = e; }
+    // Tolerance for Newton iteration with residual norm, normPrev = 0 at first iteration
+    double forcing(double norm, double normPrev, double target);
+};
+
+double LinearTolerance::forcing(double norm, double normPrev, double target)
+{
+    if(!inexact)
+        return rtol;
+    double eta = etaMax;
+    if(normPrev > 0.){
+        eta = gamma * pow(norm / normPrev, alpha);
+        double safe = gamma * pow(etaPrev, alpha);
+        if(safe > 0.1)
+            eta = max(eta, safe);
+        eta = min(eta, etaMax);
+    }
+    eta = max(eta, min(etaMax, 0.5 * target / norm));
+    eta = max(eta, rtol);
+    etaPrev = eta;
+    return eta;
+}
+
+// =====================================================
+
+// Time step controller.
+// With fixed stepping every step has length dt0 and Newton failure stops the run.
+// In adaptive mode dt is multiplied by 'grow' after steps converged
+// in at most itGrow iterations and by 'cut' after steps which needed more than itCut;
+// failed step (no convergence in itMax iterations) is repeated
+// from previous time level with dt multiplied by 'cut'.
+// Steps are shortened to hit output times, which are multiples of dtOut.
+// For SIM iterations are the splitting iterations.
+class TimeStepControl
+{
+private:
+    bool   adaptive;
+    double dtMin, dtMax, dtOut;
+    int    itGrow, itCut, itMax;
+    double grow, cut;
+public:
+    TimeStepControl() : adaptive(false), dtMin(1e-3*dt0), dtMax(100.*dt0), dtOut(dtOut0),
+        itGrow(4), itCut(10), itMax(20), grow(1.5), cut(0.5) {}
+    void setAdaptive(bool b)        { adaptive = b; }
+    void setMinStep(double t)       { dtMin = t; }
+    void setMaxStep(double t)       { dtMax = t; }
+    void setOutputInterval(double t){ dtOut = t; }
+    bool   isAdaptive() const       { return adaptive; }
+    double getOutputInterval() const{ return dtOut; }
+    int    getMaxIts() const        { return adaptive ? itMax : 100; }
+    double next(double dt, int its) const;
+    bool   reject(double &dt) const;
+};
+
+// Length of next step after a step of length dt converged in 'its' iterations
+double TimeStepControl::next(double dt, int its) const
+{
+    if(!adaptive)
+        return dt;
+    if(its <= itGrow)
+        dt *= grow;
+    else if(its > itCut)
+        dt *= cut;
+    return min(dtMax, max(dtMin, dt));
+}
+
+// Reduce dt after failed step, returns false if step can not be repeated
+bool TimeStepControl::reject(double &dt) const
+{
+    if(!adaptive || dt <= dtMin)
+        return false;
+    dt = max(dtMin, dt*cut);
+    return true;
+}
+
+// Solution output schedule.
+// By default solution is written at output times (multiples of dtOut),
+// with everySteps > 0 after every n-th time step instead.
+// Asynchronous output writes only selected cell fields by SolutionWriter,
+// synchronous one saves the whole mesh with all tags by Mesh::Save.
+class OutputControl
+{
+private:
+    int everySteps;
+    bool async;
+    vector<string> fields;
+public:
+    OutputControl() : everySteps(0), async(true)
+    {
+        fields.push_back(tagNameHead);
+        fields.push_back(tagNameConc);
+        fields.push_back(tagNameDens);
+    }
+    void setEverySteps(int n) { everySteps = n; }
+    void setAsync(bool b)     { async = b; }
+    void setFields(const string &list); // comma-separated tag names
+    bool isAsync() const      { return async; }
+    const vector<string> &getFields() const { return fields; }
+    // Whether to write after time step 'step', isOutTime if it ended at output time
+    bool isOutput(int step, bool isOutTime) const
+    {
+        return everySteps > 0 ? step % everySteps == 0 : isOutTime;
+    }
+};
+
+void OutputControl::setFields(const string &list)
+{
+    fields.clear();
+    stringstream ss(list);
+    string name;
+    while(getline(ss, name, ','))
+        if(!name.empty())
+            fields.push_back(name);
+}
+
 // =====================================================
 
 class Problem
@@ -447,8 +502,24 @@ private:
     Tag tagConcPrev;
     Tag tagWatFlux;
 
-    double times[10];
-    double ttt; // global timer
+    PrecondReuse precReuse; // preconditioner reuse policy
+    SolverOptions solverOpt;     // linear solver for coupled and transport systems
+    SolverOptions flowSolverOpt; // linear solver for flow system in SIM and head stage of CPR
+    bool useCPR;                 // CPR preconditioner for coupled system in FIM
+    LinearTolerance linTol;      // tolerance of linear solves in Newton iterations
+    bool extrapolate;            // initial Newton guess extrapolated from two previous steps
+    Tag tagHeadOld;              // solution before previous time level, for extrapolation
+    Tag tagConcOld;
+    bool fluxDerivatives;        // Darcy fluxes are stored with derivatives (FIM), otherwise values only
+    bool compactTensors;         // constant tensors are stored once on the mesh, see tensor_tag.h
+    MemoryReport mem;            // memory used by tags, topology, Jacobian and solver
+    int reorder;                 // ordering of cells and their unknowns, see reordering.h
+    TimeStepControl tsc;    // time step controller
+    OutputControl outc;     // solution output schedule
+    SolutionWriter *writer; // background writer of solution, created at first output
+
+    Profiler prof; // run-time statistics
+    int rank; // for parallel runs
 
 public:
     Problem(string meshName);
@@ -460,37 +531,80 @@ public:
     void testDiffusion();
     void runSimulationFIM();
     void runSimulationSIM();
-    void saveSolution(string path); // save mesh with solution
+    template<typename LinearSolver>
+    bool solveLinear(LinearSolver &S, Residual &R, Sparse::Vector &sol, PrecondReuse &pr,
+                     UnknownPermutation &perm, double norm, double normPrev, double rtol, int &linit);
+    vector<HandleType> orderCells(); // local cells in the order of reordering method
+    void orderUnknowns(Automatizator &a, vector<dynamic_variable> &vars, UnknownPermutation &perm);
+    void storeState();              // copy current solution to previous time level
+    void restoreState(Tag tagDens); // return to previous time level after failed step
+    void shiftState();              // keep previous time level after converged step
+    void extrapolateState(double ratio, Tag tagDens); // initial guess from two previous levels
+    double residualNorm(Residual &R); // 2-norm of residual over all processors
+    void setPrecondReuse(const PrecondReuse &pr) { precReuse = pr; }
+    void setSolver(const SolverOptions &o, const SolverOptions &flow) { solverOpt = o; flowSolverOpt = flow; }
+    void setCPR(bool b) { useCPR = b; }
+    void setLinearTolerance(const LinearTolerance &lt) { linTol = lt; }
+    void setExtrapolation(bool b) { extrapolate = b; }
+    void setFluxDerivatives(bool b) { fluxDerivatives = b; }
+    void setCompactTensors(bool b) { compactTensors = b; }
+    void setMemoryReport(bool b) { mem.enable(b); }
+    void setReorder(int r) { reorder = r; }
+    void setTimeStepControl(const TimeStepControl &c) { tsc = c; }
+    void setOutputControl(const OutputControl &c) { outc = c; }
+    void saveSolution(string prefix); // save mesh with solution
+    void saveMesh(string path) { saveMeshCache(m, path); } // save prepared mesh to .pmf
 };
 
 Problem::Problem(string meshName)
 {
-    ttt = Timer();
-    for(int i = 0; i < 10; i++)
-        times[i] = 0.;
+    writer = NULL;
+    useCPR = false;
+    extrapolate = false;
+    fluxDerivatives = true;
+    compactTensors = false;
+    reorder = REORDER_NONE;
+    m.SetCommunicator(INMOST_MPI_COMM_WORLD);
+    rank = m.GetProcessorRank();
 
     double t = Timer();
-    m.Load(meshName);
-    cout << "Number of cells: " << m.NumberOfCells() << endl;
-//    cout << "Number of faces: " << m.NumberOfFaces() << endl;
-//    cout << "Number of edges: " << m.NumberOfEdges() << endl;
-//    cout << "Number of nodes: " << m.NumberOfNodes() << endl;
-    m.AssignGlobalID(CELL|FACE|NODE);
-    times[T_IO] += Timer() - t;
+    // Cache made for this number of processors is already partitioned
+    bool cached = loadMesh(m, meshName);
+    if(rank == 0 && !m.isParallelFileFormat(meshName)){
+        cout << "Number of cells: " << m.NumberOfCells() << endl;
+//        cout << "Number of faces: " << m.NumberOfFaces() << endl;
+//        cout << "Number of edges: " << m.NumberOfEdges() << endl;
+//        cout << "Number of nodes: " << m.NumberOfNodes() << endl;
+    }
+
+    if(!cached){
+        if(m.GetProcessorsNumber() > 1){
+            Partitioner part(&m);
+            part.SetMethod(Partitioner::INNER_KMEANS, Partitioner::Partition);
+            part.Evaluate();
+            m.Redistribute();
+            m.AssignGlobalID(CELL|FACE|NODE);
+            // TPFA needs a layer of cells across each face
+            m.ExchangeGhost(1, FACE);
+        }
+        else
+            m.AssignGlobalID(CELL|FACE|NODE);
+    }
+    prof.add(T_IO, Timer() - t);
 }
 
 Problem::~Problem()
 {
-    printf("\n+=========================\n");
-    printf("| T_assemble = %lf\n", times[T_ASSEMBLE]);
-    printf("| T_precond  = %lf\n", times[T_PRECOND]);
-    printf("| T_solve    = %lf\n", times[T_SOLVE]);
-    printf("| T_IO       = %lf\n", times[T_IO]);
-    printf("| T_update   = %lf\n", times[T_UPDATE]);
-    printf("| T_init     = %lf\n", times[T_INIT]);
-    printf("+-------------------------\n");
-    printf("| T_total    = %lf\n", Timer() - ttt);
-    printf("+=========================\n");
+    // Wait for the last output to be written
+    double t = Timer();
+    delete writer;
+    prof.add(T_IO, Timer() - t);
+    if(mem.isEnabled()){
+        mem.addTags(m);
+        mem.addTopology(m);
+        mem.report(m, prof);
+    }
+    prof.report(m, "stats");
 }
 
 void Problem::initProblem()
@@ -501,19 +615,19 @@ void Problem::initProblem()
     tagConc = m.CreateTag(tagNameConc, DATA_REAL, CELL, NONE, 1);
     tagHeadPrev = m.CreateTag(tagNameHeadPrev, DATA_REAL, CELL, NONE, 1);
     tagConcPrev = m.CreateTag(tagNameConcPrev, DATA_REAL, CELL, NONE, 1);
-    tagWatFlux  = m.CreateTag(tagNameWatFlux, DATA_VARIABLE, FACE, NONE, 2);
+    if(extrapolate){
+        tagHeadOld = m.CreateTag(tagNameHeadOld, DATA_REAL, CELL, NONE, 1);
+        tagConcOld = m.CreateTag(tagNameConcOld, DATA_REAL, CELL, NONE, 1);
+    }
+    // Derivatives of fluxes are needed only when head is an unknown of transport
+    tagWatFlux  = m.CreateTag(tagNameWatFlux, fluxDerivatives ? DATA_VARIABLE : DATA_REAL, FACE, NONE, 1);
 
     // Create scalar tensor tag
-    tagK = m.CreateTag(tagNameTensorK, DATA_REAL, CELL, NONE, 3);
-    tagD = m.CreateTag(tagNameTensorD, DATA_REAL, CELL, NONE, 3);
-    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-        icell->RealArray(tagK)[0] = 1.0;
-        icell->RealArray(tagK)[1] = 1.0;
-        icell->RealArray(tagK)[2] = 0.0;
-        icell->RealArray(tagD)[0] = D;
-        icell->RealArray(tagD)[1] = D;
-        icell->RealArray(tagD)[2] = 0.0;
-    }
+    tagK = createTensorTag(m, tagNameTensorK, 3, compactTensors);
+    tagD = createTensorTag(m, tagNameTensorD, 3, compactTensors);
+    double K0[3] = {1.0, 1.0, 0.0}, D0[3] = {D, D, 0.0};
+    setDefaultTensor(m, tagK, K0);
+    setDefaultTensor(m, tagD, D0);
 
     // Create BC tag
     // BC go in form [type, val], where type = -1 (Dir) or 1 (Neum)
@@ -537,27 +651,183 @@ void Problem::initProblem()
         }
     }
 
-    times[T_INIT] += Timer() - t;
-    m.Save("init.vtk");
+    prof.add(T_INIT, Timer() - t);
 }
 
 void Problem::assembleGlobalSystem()
 {
     double t = Timer();
-    times[T_ASSEMBLE] += Timer() - t;
+    prof.add(T_ASSEMBLE, Timer() - t);
 }
 
 void Problem::solveSystem()
 {
     double t = Timer();
-    times[T_UPDATE] += Timer() - t;
+    prof.add(T_UPDATE, Timer() - t);
+}
+
+// Only time of taking snapshot (and waiting for previous output) is counted
+// for asynchronous output
+void Problem::saveSolution(string prefix)
+{
+    double t = Timer();
+    if(outc.isAsync()){
+        if(writer == NULL)
+            writer = new SolutionWriter(m, outc.getFields());
+        writer->write(m, prefix);
+        prof.add(T_IO, Timer() - t);
+        return;
+    }
+    string extension;
+    if(m.GetProcessorsNumber() > 1)
+        extension = ".pvtk";
+    else
+        extension = ".vtk";
+    m.Save(prefix + extension);
+    prof.add(T_IO, Timer() - t);
+}
+
+double Problem::residualNorm(Residual &R)
+{
+    Sparse::Vector &r = R.GetResidual();
+    double norm = 0.;
+    for(INMOST_DATA_ENUM_TYPE k = R.GetFirstIndex(); k < R.GetLastIndex(); k++)
+        norm += r[k]*r[k];
+    return sqrt(m.Integrate(norm));
+}
+
+void Problem::storeState()
+{
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        c.Real(tagHeadPrev) = c.Real(tagHead);
+        c.Real(tagConcPrev) = c.Real(tagConc);
+    }
+}
+
+void Problem::restoreState(Tag tagDens)
+{
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        c.Real(tagHead) = c.Real(tagHeadPrev);
+        c.Real(tagConc) = c.Real(tagConcPrev);
+        c.Real(tagDens) = density(c.Real(tagConc)).GetValue();
+    }
+}
+
+void Problem::shiftState()
+{
+    if(!extrapolate)
+        return;
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        c.Real(tagHeadOld) = c.Real(tagHeadPrev);
+        c.Real(tagConcOld) = c.Real(tagConcPrev);
+    }
+}
+
+// Linear extrapolation in time, ratio is length of new step over length of
+// previous one. Concentration is kept in [0,1]. Ghost cells are
+// extrapolated from their own (exchanged) values, so no exchange is needed
+void Problem::extrapolateState(double ratio, Tag tagDens)
+{
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        c.Real(tagHead) = c.Real(tagHeadPrev) + ratio * (c.Real(tagHeadPrev) - c.Real(tagHeadOld));
+        double C = c.Real(tagConcPrev) + ratio * (c.Real(tagConcPrev) - c.Real(tagConcOld));
+        c.Real(tagConc) = min(1., max(0., C));
+        c.Real(tagDens) = density(c.Real(tagConc)).GetValue();
+    }
 }
 
-void Problem::saveSolution(string path)
+// Set Jacobian to solver and solve Newton correction system,
+// preconditioner is either rebuilt or reused according to policy 'pr'.
+// If solve with reused preconditioner fails, it is rebuilt and solve is repeated.
+// S is INMOST::Solver or CPRSolver, rtol is relative tolerance of this solve.
+// Unknowns are given to S in the order of 'perm', empty one keeps the order of R.
+template<typename LinearSolver>
+bool Problem::solveLinear(LinearSolver &S, Residual &R, Sparse::Vector &sol, PrecondReuse &pr,
+                          UnknownPermutation &perm, double norm, double normPrev, double rtol, int &linit)
 {
+    ostringstream tol;
+    tol << rtol;
+    S.SetParameter("relative_tolerance", tol.str());
+
+    bool rebuild = pr.needRebuild(norm, normPrev);
+    double rss = mem.isEnabled() ? MemoryReport::residentMemory() : 0.;
     double t = Timer();
-    m.Save(path);
-    times[T_IO] += Timer() - t;
+    if(rebuild)
+        perm.setMatrix(S, R.GetJacobian());
+    else
+        perm.setMatrix(S, R.GetJacobian(), false, true);
+    prof.add(T_PRECOND, Timer() - t);
+    if(!perm.empty() && pr.getNumBuilds() == 0){
+        double bw0 = m.AggregateMax(static_cast<double>(matrixBandwidth(R.GetJacobian())));
+        double bw = m.AggregateMax(static_cast<double>(matrixBandwidth(perm.getMatrix())));
+        if(rank == 0) cout << "Matrix bandwidth: " << bw0 << " -> " << bw << " after reordering" << endl;
+    }
+    if(mem.isEnabled()){
+        mem.setMax("jacobian", MemoryReport::matrixBytes(R.GetJacobian()));
+        mem.setMax("solver", MemoryReport::residentMemory() - rss);
+    }
+
+    t = Timer();
+    bool solved = perm.solve(S, R.GetResidual(), sol);
+    prof.add(T_SOLVE, Timer() - t);
+    linit += S.Iterations();
+    prof.count("linear_iterations", S.Iterations());
+    if(!solved && !rebuild){
+        rebuild = true;
+        t = Timer();
+        perm.setMatrix(S, R.GetJacobian());
+        prof.add(T_PRECOND, Timer() - t);
+        t = Timer();
+        solved = perm.solve(S, R.GetResidual(), sol);
+        prof.add(T_SOLVE, Timer() - t);
+        linit += S.Iterations();
+        prof.count("linear_iterations", S.Iterations());
+    }
+    if(!solved){
+        pr.invalidate();
+        return false;
+    }
+    if(rebuild)
+        prof.count("precond_rebuilds");
+    pr.update(rebuild, S.Iterations());
+    return true;
+}
+
+vector<HandleType> Problem::orderCells()
+{
+    vector<HandleType> order;
+    reorderElements(m, CELL, reorder, order);
+    if(order.empty())
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            order.push_back(icell->GetHandle());
+    return order;
+}
+
+// Unknowns of 'vars' enumerated by 'a' are renumbered cell by cell in cell order,
+// unknowns of a cell stay together
+void Problem::orderUnknowns(Automatizator &a, vector<dynamic_variable> &vars, UnknownPermutation &perm)
+{
+    if(reorder == REORDER_NONE)
+        return;
+    vector<HandleType> order = orderCells();
+    vector<INMOST_DATA_ENUM_TYPE> unknowns;
+    for(size_t k = 0; k < order.size(); k++){
+        Cell c(&m, order[k]);
+        if(c.GetStatus() == Element::Ghost)
+            continue;
+        for(size_t v = 0; v < vars.size(); v++)
+            unknowns.push_back(vars[v].Index(c));
+    }
+    perm.build(a.GetFirstIndex(), a.GetLastIndex(), unknowns);
+    if(m.GetProcessorsNumber() > 1)
+        for(size_t v = 0; v < vars.size(); v++){
+            dynamic_variable &var = vars[v];
+            perm.exchange(m, CELL, [&var](const Element &e) { return var.Index(e); });
+        }
 }
 
 void Problem::runSimulationFIM()
@@ -585,13 +855,43 @@ void Problem::runSimulationFIM()
     pDiff.setSteady(true);
     pAdv.setSteady(false);
     pAdv.setFlow(&pFlow);
+    pAdv.setImplicitFlux(true);
 
-    Solver S("inner_ilu2");
+    Solver S(solverOpt.type, solverOpt.prefix);
     S.SetParameter("relative_tolerance", "1e-12");
     S.SetParameter("absolute_tolerance", "1e-15");
     Sparse::Vector sol("sol", aut.GetFirstIndex(), aut.GetLastIndex());
+    PrecondReuse pr = precReuse;
+    LinearTolerance lt = linTol;
+
+    // CPR: head stage with flow solver, block ILU(0) on the coupled system.
+    // Its block rows follow the cell order, INMOST solvers get permuted unknowns
+    UnknownPermutation perm;
+    CPRSolver *cpr = NULL;
+    if(useCPR){
+        if(m.GetProcessorsNumber() > 1){
+            if(rank == 0) cout << "CPR preconditioner works on one processor only" << endl;
+            exit(1);
+        }
+        vector<INMOST_DATA_ENUM_TYPE> cellH, cellC;
+        vector<HandleType> order = orderCells();
+        for(size_t k = 0; k < order.size(); k++){
+            Cell c(&m, order[k]);
+            cellH.push_back(varH.Index(c));
+            cellC.push_back(varC.Index(c));
+        }
+        cpr = new CPRSolver(cellH, cellC, flowSolverOpt.type, flowSolverOpt.prefix);
+        cpr->SetParameter("relative_tolerance", "1e-12");
+        cpr->SetParameter("absolute_tolerance", "1e-15");
+    }
+    else
+        orderUnknowns(aut, varsFlow, perm);
 
-    Tag tagDens = m.CreateTag("Density", DATA_REAL, CELL, NONE, 1);
+    Tag tagDens = m.CreateTag(tagNameDens, DATA_REAL, CELL, NONE, 1);
+    vector<Tag> tagsExch;
+    tagsExch.push_back(tagHead);
+    tagsExch.push_back(tagConc);
+    tagsExch.push_back(tagDens);
 
     for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
         Cell c = icell->getAsCell();
@@ -610,82 +910,111 @@ void Problem::runSimulationFIM()
         c.Real(tagConcPrev) = c.Real(tagConc);
         c.Real(tagDens)     = density(c.Real(tagConc)).GetValue();
     }
-    times[T_INIT] += Timer() - t;
-
-    t = Timer();
-    m.Save("sol0.vtk");
-    times[T_IO] += Timer() - t;
-
-    int newtit = 0;
-    for(int it = 0; it < nt; it++){
-        cout << endl << "===== TIME STEP " << it << ", T = " << it*dt << " =====" << endl;
+    prof.add(T_INIT, Timer() - t);
+
+    saveSolution("sol0");
+
+    int newtit = 0, nsteps = 0, nrej = 0, iout = 0, nfile = 0;
+    const double dtOut = tsc.getOutputInterval();
+    double T = 0.0, dt = dt0, dtLast = 0.0;
+    while(iout < nt){
+        // Shorten step to hit next output time
+        double tNext = (iout+1)*dtOut, dtStep = dt;
+        bool isOut = (T + dtStep > tNext - 1e-9*dtOut);
+        if(isOut)
+            dtStep = tNext - T;
+        if(rank == 0) cout << endl << "===== TIME STEP " << nsteps << ", T = " << T << ", dt = " << dtStep << " =====" << endl;
+        pFlow.setTimeStep(dtStep);
+        pDiff.setTimeStep(dtStep);
+        pAdv.setTimeStep(dtStep);
         // Save old values
-        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-            Cell c = icell->getAsCell();
-            c.Real(tagHeadPrev) = c.Real(tagHead);
-            c.Real(tagConcPrev) = c.Real(tagConc);
-        }
+        storeState();
+        if(extrapolate && nsteps > 0)
+            extrapolateState(dtStep / dtLast, tagDens);
 
         // Newton loop
         bool converged = false;
-        double norm2, norm2_0 = 0.0;
-        for(int nit = 0; nit < 100; nit++){
+        double norm2, norm2_0 = 0.0, norm2_prev = 0.0;
+        int nit;
+        for(nit = 0; nit < tsc.getMaxIts(); nit++){
             // Assemble residual
-            t = Timer();
-            R.Clear();
-            pFlow.fillResidual(R);
-            pDiff.fillResidual(R);
-            pAdv.fillResidual(R);
-            times[T_ASSEMBLE] += Timer() - t;
+            {
+                Profiler::Scope sa(prof, T_ASSEMBLE);
+                R.Clear();
+                { Profiler::Scope s(prof, "flow");      pFlow.fillResidual(R); }
+                { Profiler::Scope s(prof, "diffusion"); pDiff.fillResidual(R); }
+                { Profiler::Scope s(prof, "advection"); pAdv.fillResidual(R);  }
+            }
 
-            norm2 = R.Norm();
+            norm2 = residualNorm(R);
             if(nit == 0)
                 norm2_0 = norm2;
-            cout << "it " << nit << ": |r|_2 = " << norm2 << endl;
+            if(rank == 0) cout << "it " << nit << ": |r|_2 = " << norm2 << endl;
 
             if(norm2 < 1e-6 || norm2 < 1e-5*norm2_0){
                 converged = true;
                 break;
             }
 
-            t = Timer();
-            S.SetMatrix(R.GetJacobian());
             newtit++;
-            times[T_PRECOND] += Timer() - t;
+            prof.count("newton_iterations");
             //R.GetJacobian().Save("J" + to_string(it+1) + ".mtx");
-            t = Timer();
-            bool solved = S.Solve(R.GetResidual(), sol);
-            times[T_SOLVE] += Timer() - t;
+            double rtol = lt.forcing(norm2, norm2_prev, max(1e-6, 1e-5*norm2_0));
+            bool solved = cpr ? solveLinear(*cpr, R, sol, pr, perm, norm2, norm2_prev, rtol, linit)
+                              : solveLinear(S, R, sol, pr, perm, norm2, norm2_prev, rtol, linit);
             if(!solved){
-                cout << "Linear solver failed: " << S.GetReason() << endl;
-                cout << "Residual: " << S.Residual() << endl;
-                exit(1);
+                if(rank == 0) cout << "Linear solver failed: " << (cpr ? cpr->GetReason() : S.GetReason()) << endl;
+                if(rank == 0) cout << "Residual: " << (cpr ? cpr->Residual() : S.Residual()) << endl;
+                break;
             }
+            if(cpr)
+                prof.count("cpr_head_iterations", cpr->PressureIterations());
             //cout << "Linear solver iterations: " << S.Iterations() << endl;
-            linit += S.Iterations();
+            norm2_prev = norm2;
 
+            t = Timer();
             double w = 1;//0.125;
             for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
                 Cell c = icell->getAsCell();
+                if(c.GetStatus() == Element::Ghost)
+                    continue;
                 c.Real(tagHead) -= w*sol[varH.Index(c)];
                 c.Real(tagConc) -= w*sol[varC.Index(c)];
                 c.Real(tagDens)  = density(c.Real(tagConc)).GetValue();
             }
+            m.ExchangeData(tagsExch, CELL);
+            prof.add(T_UPDATE, Timer() - t);
         }
         if(!converged){
-            cout << "Newton failed" << endl;
-            exit(1);
+            if(rank == 0) cout << "Newton failed" << endl;
+            if(!tsc.reject(dt))
+                exit(1);
+            if(rank == 0) cout << "Repeating time step with dt = " << dt << endl;
+            restoreState(tagDens);
+            pr.invalidate();
+            nrej++;
+            prof.count("rejected_steps");
+            continue;
         }
-
-        string name = "sol" + to_string(it+1) + ".vtk";
-        t = Timer();
-        m.Save(name);
-        times[T_IO] += Timer() - t;
+        nsteps++;
+        shiftState();
+        dtLast = dtStep;
+        T = isOut ? tNext : T + dtStep;
+        prof.endStep(T);
+        dt = tsc.next(dt, nit);
+
+        if(isOut)
+            iout++;
+        if(outc.isOutput(nsteps, isOut))
+            saveSolution("sol" + to_string(++nfile));
     }
     //cout << "Total Newton iterations: " << newtit << endl;
     //cout << "Total linear iterations: " << linit << endl;
-    printf("Total Newton    iterations: %d (av. %d per t.st.)\n", newtit, newtit/nt);
-    printf("Total linear    iterations: %d (av. %d per Newt.it.)\n", linit, linit/newtit);
+    if(rank == 0) printf("Total time      steps:      %d (%d rejected)\n", nsteps, nrej);
+    if(rank == 0) printf("Total Newton    iterations: %d (av. %d per t.st.)\n", newtit, newtit/nsteps);
+    if(rank == 0) printf("Total linear    iterations: %d (av. %d per Newt.it.)\n", linit, linit/newtit);
+    if(rank == 0) printf("Total precond.  rebuilds:   %d\n", pr.getNumBuilds());
+    delete cpr;
 }
 
 void Problem::runSimulationSIM()
@@ -694,25 +1023,28 @@ void Problem::runSimulationSIM()
 
     double t = Timer();
 
-    Automatizator::MakeCurrent(&aut);
-    auto indH = aut.RegisterTag(tagHead, CELL);
-    auto indC = aut.RegisterTag(tagConc, CELL);
-    dynamic_variable varH(aut, indH);
-    dynamic_variable varC(aut, indC);
-    aut.DeactivateEntry(indC);
-    aut.EnumerateEntries();
-    printf("Indices: %d %d\n", aut.GetFirstIndex(), aut.GetLastIndex());
-    Residual RFlow("RFlow", aut.GetFirstIndex(), aut.GetLastIndex());
-
-    aut.ActivateEntry(indC);
-    aut.DeactivateEntry(indH);
-    aut.EnumerateEntries();
-    Residual RTran("RTran", aut.GetFirstIndex(), aut.GetLastIndex());
-
+    // Flow and transport have their own Automatizators: unknowns of the other
+    // subproblem are deactivated and enter as known values. Both are enumerated
+    // once, so switching between subproblems only makes another one current
+    Automatizator autFlow("flow"), autTran("transport");
+    auto indH = autFlow.RegisterTag(tagHead, CELL);
+    auto indCF = autFlow.RegisterTag(tagConc, CELL);
+    autFlow.DeactivateEntry(indCF);
+    autFlow.EnumerateEntries();
+    dynamic_variable varH(autFlow, indH);
+    dynamic_variable varCF(autFlow, indCF);
+    Residual RFlow("RFlow", autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+    Sparse::Vector solFlow("solFlow", autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+
+    auto indC = autTran.RegisterTag(tagConc, CELL);
+    autTran.EnumerateEntries();
+    dynamic_variable varC(autTran, indC);
+    Residual RTran("RTran", autTran.GetFirstIndex(), autTran.GetLastIndex());
+    Sparse::Vector solTran("solTran", autTran.GetFirstIndex(), autTran.GetLastIndex());
 
     vector<dynamic_variable> varsFlow, varsTran;
     varsFlow.push_back(varH);
-    varsFlow.push_back(varC);
+    varsFlow.push_back(varCF);
     varsTran.push_back(varC);
     Process_ConfinedFlow pFlow(&m, varsFlow);
     Process_Diffusion    pDiff(&m, varsTran);
@@ -721,13 +1053,27 @@ void Problem::runSimulationSIM()
     pDiff.setSteady(true);
     pAdv.setSteady(false);
     pAdv.setFlow(&pFlow);
-
-    Solver S("inner_ilu2");
-    S.SetParameter("relative_tolerance", "1e-12");
-    S.SetParameter("absolute_tolerance", "1e-15");
-    Sparse::Vector sol("sol", aut.GetFirstIndex(), aut.GetLastIndex());
-
-    Tag tagDens = m.CreateTag("Density", DATA_REAL, CELL, NONE, 1);
+    pAdv.setImplicitFlux(false);
+
+    // Flow and transport have their own solvers, so preconditioner
+    // of one system is kept while the other one is solved
+    Solver SFlow(flowSolverOpt.type, flowSolverOpt.prefix);
+    SFlow.SetParameter("relative_tolerance", "1e-12");
+    SFlow.SetParameter("absolute_tolerance", "1e-15");
+    Solver STran(solverOpt.type, solverOpt.prefix);
+    STran.SetParameter("relative_tolerance", "1e-12");
+    STran.SetParameter("absolute_tolerance", "1e-15");
+    PrecondReuse prFlow = precReuse, prTran = precReuse;
+    LinearTolerance ltFlow = linTol, ltTran = linTol;
+    vector<dynamic_variable> unknFlow(1, varH);
+    UnknownPermutation permFlow, permTran;
+    orderUnknowns(autFlow, unknFlow, permFlow);
+    orderUnknowns(autTran, varsTran, permTran);
+
+    Tag tagDens = m.CreateTag(tagNameDens, DATA_REAL, CELL, NONE, 1);
+    vector<Tag> tagsExch; // transport unknowns
+    tagsExch.push_back(tagConc);
+    tagsExch.push_back(tagDens);
 
     for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
         Cell c = icell->getAsCell();
@@ -746,138 +1092,148 @@ void Problem::runSimulationSIM()
         c.Real(tagConcPrev) = c.Real(tagConc);
         c.Real(tagDens)     = density(c.Real(tagConc)).GetValue();
     }
-    times[T_INIT] += Timer() - t;
+    prof.add(T_INIT, Timer() - t);
 
-    t = Timer();
-    m.Save("sol0.vtk");
-    times[T_IO] += Timer() - t;
+    saveSolution("sol0");
 
-    int newtit = 0, nspl = 0;
+    int newtit = 0, nspl = 0, nsteps = 0, nrej = 0, iout = 0, nfile = 0;
     const double tol_split = 1e-4;
-    for(int it = 0; it < nt; it++){
-        cout << endl << "===== TIME STEP " << it << ", T = " << it*dt << " =====" << endl;
+    const double dtOut = tsc.getOutputInterval();
+    double T = 0.0, dt = dt0, dtLast = 0.0;
+    while(iout < nt){
+        // Shorten step to hit next output time
+        double tNext = (iout+1)*dtOut, dtStep = dt;
+        bool isOut = (T + dtStep > tNext - 1e-9*dtOut);
+        if(isOut)
+            dtStep = tNext - T;
+        if(rank == 0) cout << endl << "===== TIME STEP " << nsteps << ", T = " << T << ", dt = " << dtStep << " =====" << endl;
+        pFlow.setTimeStep(dtStep);
+        pDiff.setTimeStep(dtStep);
+        pAdv.setTimeStep(dtStep);
         // Save old values
-        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-            Cell c = icell->getAsCell();
-            c.Real(tagHeadPrev) = c.Real(tagHead);
-            c.Real(tagConcPrev) = c.Real(tagConc);
-        }
+        storeState();
+        if(extrapolate && nsteps > 0)
+            extrapolateState(dtStep / dtLast, tagDens);
 
         bool converged_outer = false;
         bool smallNormF, smallNormT;
         smallNormF = smallNormT = false;
-        for(int ispl = 0; ispl < 200; ispl++){
+        int ispl;
+        for(ispl = 0; ispl < (tsc.isAdaptive() ? tsc.getMaxIts() : 200); ispl++){
             nspl++;
-            cout << endl << "*** splitting step " << ispl << " ***" << endl;
+            prof.count("splitting_iterations");
+            if(rank == 0) cout << endl << "*** splitting step " << ispl << " ***" << endl;
             // Newton loop for flow
-            cout << "flow:" << endl;
-            aut.ActivateEntry(indH);
-            aut.DeactivateEntry(indC);
-            aut.EnumerateEntries();
+            if(rank == 0) cout << "flow:" << endl;
+            Automatizator::MakeCurrent(&autFlow);
             bool converged = false;
-            double norm2, norm2_0 = 0.0;
-            for(int nit = 0; nit < 100; nit++){
+            double norm2, norm2_0 = 0.0, norm2_prev = 0.0;
+            for(int nit = 0; nit < tsc.getMaxIts(); nit++){
                 // Assemble residual
-                t = Timer();
-                RFlow.Clear();
-                pFlow.fillResidual(RFlow);
-                times[T_ASSEMBLE] += Timer() - t;
+                {
+                    Profiler::Scope sa(prof, T_ASSEMBLE);
+                    RFlow.Clear();
+                    { Profiler::Scope s(prof, "flow");      pFlow.fillResidual(RFlow); }
+                }
 
-                norm2 = RFlow.Norm();
+                norm2 = residualNorm(RFlow);
                 if(nit == 0){
                     norm2_0 = norm2;
                     if(norm2_0 < tol_split)
                         smallNormF = true;
                 }
-                cout << " it " << nit << ": |r|_2 = " << norm2 << endl;
+                if(rank == 0) cout << " it " << nit << ": |r|_2 = " << norm2 << endl;
 
                 if(norm2 < 1e-6 || norm2 < 1e-4*norm2_0){
                     converged = true;
                     break;
                 }
 
-                t = Timer();
-                S.SetMatrix(RFlow.GetJacobian());
                 newtit++;
-                times[T_PRECOND] += Timer() - t;
+                prof.count("newton_iterations");
                 //R.GetJacobian().Save("J" + to_string(it+1) + ".mtx");
-                t = Timer();
-                bool solved = S.Solve(RFlow.GetResidual(), sol);
-                times[T_SOLVE] += Timer() - t;
+                double rtol = ltFlow.forcing(norm2, norm2_prev, max(1e-6, 1e-4*norm2_0));
+                bool solved = solveLinear(SFlow, RFlow, solFlow, prFlow, permFlow, norm2, norm2_prev, rtol, linit);
                 if(!solved){
-                    cout << "Linear solver failed: " << S.GetReason() << endl;
-                    cout << "Residual: " << S.Residual() << endl;
-                    exit(1);
+                    if(rank == 0) cout << "Linear solver failed: " << SFlow.GetReason() << endl;
+                    if(rank == 0) cout << "Residual: " << SFlow.Residual() << endl;
+                    break;
                 }
                 //cout << "Linear solver iterations: " << S.Iterations() << endl;
-                linit += S.Iterations();
+                norm2_prev = norm2;
 
+                t = Timer();
                 double w = 1;//0.125;
                 for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
                     Cell c = icell->getAsCell();
-                    c.Real(tagHead) -= w*sol[varH.Index(c)];
+                    if(c.GetStatus() == Element::Ghost)
+                        continue;
+                    c.Real(tagHead) -= w*solFlow[varH.Index(c)];
                 }
+                m.ExchangeData(tagHead, CELL);
+                prof.add(T_UPDATE, Timer() - t);
             }
             if(!converged){
-                cout << "Newton for flow failed" << endl;
-                exit(1);
+                if(rank == 0) cout << "Newton for flow failed" << endl;
+                break;
             }
 
 
             // Newton loop for transport
-            cout << "transport:" << endl;
+            if(rank == 0) cout << "transport:" << endl;
             converged = false;
-            norm2 = norm2_0 = 0.0;
-            aut.DeactivateEntry(indH);
-            aut.ActivateEntry(indC);
-            aut.EnumerateEntries();
-            for(int nit = 0; nit < 100; nit++){
+            norm2 = norm2_0 = norm2_prev = 0.0;
+            Automatizator::MakeCurrent(&autTran);
+            for(int nit = 0; nit < tsc.getMaxIts(); nit++){
                 // Assemble residual
-                t = Timer();
-                RTran.Clear();
-                pDiff.fillResidual(RTran);
-                pAdv.fillResidual(RTran);
-                times[T_ASSEMBLE] += Timer() - t;
+                {
+                    Profiler::Scope sa(prof, T_ASSEMBLE);
+                    RTran.Clear();
+                    { Profiler::Scope s(prof, "diffusion"); pDiff.fillResidual(RTran); }
+                    { Profiler::Scope s(prof, "advection"); pAdv.fillResidual(RTran);  }
+                }
 
-                norm2 = RTran.Norm();
+                norm2 = residualNorm(RTran);
                 if(nit == 0){
                     norm2_0 = norm2;
                     if(norm2_0 < tol_split)
                         smallNormT = true;
                 }
-                cout << " it " << nit << ": |r|_2 = " << norm2 << endl;
+                if(rank == 0) cout << " it " << nit << ": |r|_2 = " << norm2 << endl;
 
                 if(norm2 < 1e-6 || norm2 < 1e-4*norm2_0){
                     converged = true;
                     break;
                 }
 
-                t = Timer();
-                S.SetMatrix(RTran.GetJacobian());
                 newtit++;
-                times[T_PRECOND] += Timer() - t;
+                prof.count("newton_iterations");
                 //R.GetJacobian().Save("J" + to_string(it+1) + ".mtx");
-                t = Timer();
-                bool solved = S.Solve(RTran.GetResidual(), sol);
-                times[T_SOLVE] += Timer() - t;
+                double rtol = ltTran.forcing(norm2, norm2_prev, max(1e-6, 1e-4*norm2_0));
+                bool solved = solveLinear(STran, RTran, solTran, prTran, permTran, norm2, norm2_prev, rtol, linit);
                 if(!solved){
-                    cout << "Linear solver failed: " << S.GetReason() << endl;
-                    cout << "Residual: " << S.Residual() << endl;
-                    exit(1);
+                    if(rank == 0) cout << "Linear solver failed: " << STran.GetReason() << endl;
+                    if(rank == 0) cout << "Residual: " << STran.Residual() << endl;
+                    break;
                 }
                 //cout << "Linear solver iterations: " << S.Iterations() << endl;
-                linit += S.Iterations();
+                norm2_prev = norm2;
 
+                t = Timer();
                 double w = 1;//0.125;
                 for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
                     Cell c = icell->getAsCell();
-                    c.Real(tagConc) -= w*sol[varC.Index(c)];
+                    if(c.GetStatus() == Element::Ghost)
+                        continue;
+                    c.Real(tagConc) -= w*solTran[varC.Index(c)];
                     c.Real(tagDens)  = density(c.Real(tagConc)).GetValue();
                 }
+                m.ExchangeData(tagsExch, CELL);
+                prof.add(T_UPDATE, Timer() - t);
             }
             if(!converged){
-                cout << "Newton for transport failed" << endl;
-                exit(1);
+                if(rank == 0) cout << "Newton for transport failed" << endl;
+                break;
             }
 
 
@@ -887,20 +1243,37 @@ void Problem::runSimulationSIM()
             }
         }
         if(!converged_outer){
-            cout << "splitting failed!" << endl;
-            exit(1);
+            if(rank == 0) cout << "splitting failed!" << endl;
+            if(!tsc.reject(dt))
+                exit(1);
+            if(rank == 0) cout << "Repeating time step with dt = " << dt << endl;
+            restoreState(tagDens);
+            prFlow.invalidate();
+            prTran.invalidate();
+            nrej++;
+            prof.count("rejected_steps");
+            continue;
         }
-
-        string name = "sol" + to_string(it+1) + ".vtk";
-        t = Timer();
-        m.Save(name);
-        times[T_IO] += Timer() - t;
+        nsteps++;
+        shiftState();
+        dtLast = dtStep;
+        T = isOut ? tNext : T + dtStep;
+        prof.endStep(T);
+        dt = tsc.next(dt, ispl+1);
+
+        if(isOut)
+            iout++;
+        if(outc.isOutput(nsteps, isOut))
+            saveSolution("sol" + to_string(++nfile));
     }
 //    cout << "Total Newton iterations: " << newtit << endl;
 //    cout << "Total linear iterations: " << linit << endl;
-    printf("Total splitting iterations: %d (av. %d per t.st.)\n", nspl, nspl/nt);
-    printf("Total Newton    iterations: %d (av. %d per t.st., %d per spl.it.)\n", newtit, newtit/nt, newtit/nspl);
-    printf("Total linear    iterations: %d (av. %d per Newt.it.)\n", linit, linit/newtit);
+    if(rank == 0) printf("Total time      steps:      %d (%d rejected)\n", nsteps, nrej);
+    if(rank == 0) printf("Total splitting iterations: %d (av. %d per t.st.)\n", nspl, nspl/nsteps);
+    if(rank == 0) printf("Total Newton    iterations: %d (av. %d per t.st., %d per spl.it.)\n", newtit, newtit/nsteps, newtit/nspl);
+    if(rank == 0) printf("Total linear    iterations: %d (av. %d per Newt.it.)\n", linit, linit/newtit);
+    if(rank == 0) printf("Total precond.  rebuilds:   %d (flow %d, transport %d)\n",
+                         prFlow.getNumBuilds() + prTran.getNumBuilds(), prFlow.getNumBuilds(), prTran.getNumBuilds());
 }
 
 
@@ -945,7 +1318,7 @@ void Problem::testDiffusion()
     pDiff.fillResidual(R);
 
     Sparse::Vector sol("sol",aut.GetFirstIndex(), aut.GetLastIndex());
-    Solver S("inner_ilu2");
+    Solver S(solverOpt.type, solverOpt.prefix);
     S.SetMatrix(R.GetJacobian());
     bool solved = S.Solve(R.GetResidual(), sol);
     if(!solved){
@@ -971,23 +1344,151 @@ void Problem::testDiffusion()
 
 int main(int argc, char *argv[])
 {
-    if(argc != 3){
-        cout << "Usage: 2d_dens_driven_flow <mesh_file> <method (fim or sim)>" << endl;
+    if(argc < 3){
+        cout << "Usage: 2d_dens_driven_flow <mesh_file> <method (fim or sim)> [options]" << endl;
+        cout << "Options:" << endl;
+        cout << "  -prec_every <n>    rebuild preconditioner every n linear solves (default 1)" << endl;
+        cout << "  -prec_maxit <n>    rebuild preconditioner if linear iterations exceed n" << endl;
+        cout << "  -prec_stall <r>    rebuild preconditioner if |r_k|/|r_k-1| exceeds r" << endl;
+        cout << "  -adapt             adaptive time step with rejection of failed steps" << endl;
+        cout << "  -dt_min <t>        minimal time step in adaptive mode" << endl;
+        cout << "  -dt_max <t>        maximal time step in adaptive mode" << endl;
+        cout << "  -dt_out <t>        interval between solution outputs (default " << dtOut0 << ")" << endl;
+        cout << "  -out_steps <n>     write solution every n time steps instead of output times" << endl;
+        cout << "  -out_fields <list> comma-separated cell tags to write (default "
+             << tagNameHead << "," << tagNameConc << "," << tagNameDens << ")" << endl;
+        cout << "  -out_sync          save whole mesh with Mesh::Save instead of background output" << endl;
+        cout << "  -mesh_save <file>  save partitioned mesh to .pmf cache and exit" << endl;
+        cout << "  -solver <type>     INMOST linear solver (default inner_ilu2), see solver_options.h" << endl;
+        cout << "  -flow_solver <type> linear solver for flow system in SIM and head stage of CPR (default same as -solver)" << endl;
+        cout << "  -flow_solver_prefix <p> database section of flow solver (default same as -solver_prefix)" << endl;
+        cout << "  -cpr               CPR preconditioner for coupled system in FIM (one processor)" << endl;
+        cout << "  -inexact           Eisenstat-Walker tolerances of linear solves in Newton iterations" << endl;
+        cout << "  -eta_max <eta>     maximal relative tolerance in inexact mode (default 0.1)" << endl;
+        cout << "  -extrapolate       initial Newton guess extrapolated from two previous time steps" << endl;
+        cout << "  -compact_tensors   store constant tensors once on the mesh instead of every cell" << endl;
+        cout << "  -mem_report        print memory used by tags, topology, Jacobian and solver" << endl;
+        cout << "  -reorder <method>  renumber cells and unknowns: rcm, sfc or none (default)" << endl;
+        cout << "  -solver_db <file>  XML database with solver parameters" << endl;
         return 1;
     }
     string method(argv[2]);
     if(method != "fim" && method != "sim"){
-        cout << "Usage: 2d_dens_driven_flow <mesh_file> <method (fim or sim)>" << endl;
+        cout << "Usage: 2d_dens_driven_flow <mesh_file> <method (fim or sim)> [options]" << endl;
         return 1;
     }
 
-    Problem P(argv[1]);
-    P.initProblem();
-    //P.testDiffusion();
+    PrecondReuse pr;
+    TimeStepControl tsc;
+    OutputControl outc;
+    SolverOptions solverOpt("inner_ilu2"), flowSolverOpt("");
+    string meshSave;
+    bool useCPR = false, extrapolate = false, compactTensors = false, memReport = false;
+    int reorder = REORDER_NONE;
+    LinearTolerance lt;
+    for(int i = 3; i < argc; i++){
+        string opt(argv[i]);
+        if(opt == "-adapt"){
+            tsc.setAdaptive(true);
+            continue;
+        }
+        if(opt == "-out_sync"){
+            outc.setAsync(false);
+            continue;
+        }
+        if(opt == "-cpr"){
+            useCPR = true;
+            continue;
+        }
+        if(opt == "-inexact"){
+            lt.setInexact(true);
+            continue;
+        }
+        if(opt == "-extrapolate"){
+            extrapolate = true;
+            continue;
+        }
+        if(opt == "-compact_tensors"){
+            compactTensors = true;
+            continue;
+        }
+        if(opt == "-mem_report"){
+            memReport = true;
+            continue;
+        }
+        if(solverOpt.parse(i, argc, argv) || flowSolverOpt.parse(i, argc, argv, "-flow_solver"))
+            continue;
+        if(i+1 == argc){
+            cout << "Missing value for option " << opt << endl;
+            return 1;
+        }
+        if(opt == "-prec_every")
+            pr.setRebuildEvery(atoi(argv[++i]));
+        else if(opt == "-prec_maxit")
+            pr.setMaxLinIt(atoi(argv[++i]));
+        else if(opt == "-prec_stall")
+            pr.setStallRatio(atof(argv[++i]));
+        else if(opt == "-dt_min")
+            tsc.setMinStep(atof(argv[++i]));
+        else if(opt == "-dt_max")
+            tsc.setMaxStep(atof(argv[++i]));
+        else if(opt == "-dt_out")
+            tsc.setOutputInterval(atof(argv[++i]));
+        else if(opt == "-out_steps")
+            outc.setEverySteps(atoi(argv[++i]));
+        else if(opt == "-out_fields")
+            outc.setFields(argv[++i]);
+        else if(opt == "-eta_max")
+            lt.setMaxForcing(atof(argv[++i]));
+        else if(opt == "-mesh_save")
+            meshSave = argv[++i];
+        else if(opt == "-reorder")
+            reorder = parseReorderMethod(argv[++i]);
+        else{
+            cout << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+
+    // Options of flow solver not given explicitly are those of -solver
+    flowSolverOpt.inherit(solverOpt);
+
+    Solver::Initialize(&argc, &argv, solverOpt.database.c_str());
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    Problem *P = new Problem(argv[1]);
+    if(!meshSave.empty()){
+        // Preprocessing only: later runs load the prepared mesh
+        P->saveMesh(meshSave);
+        delete P;
+        Partitioner::Finalize();
+        Solver::Finalize();
+        Mesh::Finalize();
+        return 0;
+    }
+    P->setPrecondReuse(pr);
+    P->setTimeStepControl(tsc);
+    P->setOutputControl(outc);
+    P->setSolver(solverOpt, flowSolverOpt);
+    P->setCPR(useCPR && method == "fim");
+    P->setLinearTolerance(lt);
+    P->setExtrapolation(extrapolate);
+    P->setFluxDerivatives(method == "fim");
+    P->setCompactTensors(compactTensors);
+    P->setMemoryReport(memReport);
+    P->setReorder(reorder);
+    P->initProblem();
+    //P->testDiffusion();
     if(method == "fim")
-        P.runSimulationFIM();
+        P->runSimulationFIM();
     else if(method == "sim")
-        P.runSimulationSIM();
+        P->runSimulationSIM();
+    delete P;
+
+    Partitioner::Finalize();
+    Solver::Finalize();
+    Mesh::Finalize();
 
     return 0;
 }
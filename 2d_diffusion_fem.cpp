@@ -1,4 +1,11 @@
 #include "inmost.h"
+#include "coloring.h"
+#include "fixed_matrix.h"
+#include "profiling.h"
+#include "solver_options.h"
+#include "shape_cache.h"
+#include "matrix_free.h"
+#include "reordering.h"
 
 //    !!!!!!! Currently NOT suited for parallel run
 //
@@ -31,14 +38,22 @@ typedef struct{
     Sparse::Vector b;
 } LinearSystem;
 
-enum{
-    T_ASSEMBLE = 0,
-    T_SOLVE,
-    T_PRECOND,
-    T_IO,
-    T_INIT,
-    T_UPDATE
-};
+// Geometry of linear triangles stored as structure of arrays,
+// indexed by cell local ID, so that repeated assembly
+// does not query mesh topology
+typedef struct{
+    vector<int>    nodes;  // local IDs of cell nodes, 3 per cell
+    vector<double> detBk;  // |det Bk| per cell
+    vector<double> invBk;  // inverse of Bk per cell, 4 entries row-wise
+} GeomCache;
+
+// Sparsity pattern of the global matrix: rows of A are filled
+// with zero entries once, and each cell stores positions
+// of its local entries within these rows
+typedef struct{
+    bool built;
+    vector<int> pos;       // 9 per cell: position of column j in row of node i
+} CSRPattern;
 
 const string tagNameTensor = "DIFFUSION_TENSOR";
 const string tagNameBC     = "BOUNDARY_CONDITION";
@@ -57,16 +72,19 @@ const double Dxy = 0.25;
 
 const double M_PI = 3.1415926535898;
 
-double exactSolution(double *x)
+// a is frequency of solution, it is changed for cases of a sweep
+double exactSolution(double *x, double a = M_PI)
 {
-    return sin(M_PI*x[0]) * sin(M_PI*x[1]);
+    return sin(a*x[0]) * sin(a*x[1]);
 }
 
-double exactSolutionRHS(double *x)
+double exactSolutionRHS(double *x, double a = M_PI)
 {
-    return M_PI*M_PI * ((Dxx+Dyy) * exactSolution(x) - 2*Dxy*cos(M_PI*x[0])*cos(M_PI*x[1]));
+    return a*a * ((Dxx+Dyy) * exactSolution(x, a) - 2*Dxy*cos(a*x[0])*cos(a*x[1]));
 }
 
+fMatrix<3,3> referenceStiffMatrix(const fMatrix<2,2> &Ck, double detBk);
+
 class Problem
 {
 private:
@@ -82,28 +100,79 @@ private:
 
     LinearSystem linSys;
 
+    bool useGeomCache;    // use precomputed cell geometry in assembly
+    GeomCache geom;
+    bool useCSR;          // assemble into precomputed sparsity pattern
+    CSRPattern pattern;
+
     unsigned numDirNodes;
     unsigned size;        // size of resulting system = #nodes-#Dir.nodes
 
-    double times[10];
-    double ttt; // global timer
+    bool useColoring;     // assemble cells concurrently by colors
+    vector< vector<HandleType> > colors; // cells grouped by color
+
+    int reorder;          // ordering of cells and unknowns, see reordering.h
+    vector<HandleType> cellOrder; // cells in assembly order
+    vector<unsigned> rowOfNode;   // row of global system by node LocalID
+
+    bool useShapeCache;   // reuse stiffness matrices of cells of the same shape
+    ShapeCache shapes;
+
+    bool useMatrixFree;   // apply matrix by cells instead of storing it
+    vector<double> mfRHS; // right-hand side by row of node, zero for Dirichlet nodes
+    vector<double> mfDiag; // diagonal of matrix for Jacobi preconditioner
+
+    SolverOptions solverOpt; // type and parameters of linear solver
+
+    double freq;          // frequency of exact solution of current case
+    bool rhsOnly;         // assemble only right-hand side, matrix is kept
+
+    Profiler prof; // run-time statistics
 
 public:
     Problem(string meshName);
     ~Problem();
     void initProblem(); // create tags and set parameters
+    void setGeomCache(bool b) { useGeomCache = b; }
+    void buildGeomCache(); // precompute cell geometry
+    void setCSR(bool b) { useCSR = b; }
+    void buildPattern();   // precompute sparsity pattern of global matrix
     void assembleGlobalSystem(); // assemble global linear system
-    rMatrix computeStiffMatrix(Cell &);
-    rMatrix integrateRHS(Cell &);
+    void assembleCell(Cell &);    // add contribution of one cell
+    void getCellNodes(Cell &, Node *);
+    fMatrix<3,3> localStiffMatrix(Cell &, const Node *); // uses geometry and shape caches
+    void setColoring(bool b) { useColoring = b; }
+    void setSolver(const SolverOptions &o) { solverOpt = o; }
+    void setShapeCache(bool b) { useShapeCache = b; }
+    void setMatrixFree(bool b) { useMatrixFree = b; }
+    void setReorder(int r) { reorder = r; }
+    unsigned nodeRow(const Node &n) const { return rowOfNode[n.LocalID()]; }
+    void multiplyCell(Cell &, const vector<double> &, vector<double> &);
+    void multiply(const vector<double> &x, vector<double> &y); // y = A*x by cells
+    double dot(const vector<double> &a, const vector<double> &b);
+    fMatrix<3,3> computeStiffMatrix(Cell &);
+    fMatrix<3,3> computeStiffMatrix(int k); // uses geometry cache
+    fMatrix<3,1> integrateRHS(Cell &);
+    fMatrix<3,1> integrateRHS(int k);       // uses geometry cache
+    void setCase(int k); // source and boundary data of case k of a sweep
     void solveSystem();
+    bool solveRHS(Solver &S); // solve with matrix already given to S
+    void solveSweep(int n);   // solve n cases with the same matrix
+    void solveMatrixFree();
     void saveSolution(string path); // save mesh with solution
 };
 
 Problem::Problem(string meshName)
 {
-    ttt = Timer();
-    for(int i = 0; i < 10; i++)
-        times[i] = 0.;
+    useColoring = false;
+    reorder = REORDER_NONE;
+    useShapeCache = false;
+    useMatrixFree = false;
+    useGeomCache = false;
+    useCSR = false;
+    pattern.built = false;
+    freq = M_PI;
+    rhsOnly = false;
 
     double t = Timer();
     m.Load(meshName);
@@ -112,21 +181,12 @@ Problem::Problem(string meshName)
     cout << "Number of edges: " << m.NumberOfEdges() << endl;
     cout << "Number of nodes: " << m.NumberOfNodes() << endl;
     m.AssignGlobalID(NODE);
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 Problem::~Problem()
 {
-    printf("\n+=========================\n");
-    printf("| T_assemble = %lf\n", times[T_ASSEMBLE]);
-    printf("| T_precond  = %lf\n", times[T_PRECOND]);
-    printf("| T_solve    = %lf\n", times[T_SOLVE]);
-    printf("| T_IO       = %lf\n", times[T_IO]);
-    printf("| T_update   = %lf\n", times[T_UPDATE]);
-    printf("| T_init     = %lf\n", times[T_INIT]);
-    printf("+-------------------------\n");
-    printf("| T_total    = %lf\n", Timer() - ttt);
-    printf("+=========================\n");
+    prof.report(m, "stats");
 }
 
 void Problem::initProblem()
@@ -153,11 +213,50 @@ void Problem::initProblem()
     }
     m.ExchangeData(tagD, CELL);
 
-    // Set boundary conditions
     // Mark and count Dirichlet nodes
-    // Compute RHS and exact solution
     numDirNodes = 0;
     mrkDirNode = m.CreateMarker();
+    for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++){
+        if(inode->GetStatus() == Element::Ghost)
+            continue;
+        if(!inode->Boundary())
+            continue;
+
+        inode->SetMarker(mrkDirNode);
+        numDirNodes++;
+    }
+    cout << "Number of Dirichlet nodes: " << numDirNodes << endl;
+
+    // Set boundary conditions
+    // Compute RHS and exact solution
+    setCase(0);
+
+    // Order of cell loops and numbering of rows,
+    // by default the order of mesh storage
+    reorderElements(m, CELL, reorder, cellOrder);
+    if(cellOrder.empty())
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            cellOrder.push_back(icell->GetHandle());
+    vector<HandleType> nodeOrder;
+    reorderElements(m, NODE, reorder, nodeOrder);
+    rowOfNode.assign(m.NodeLastLocalID(), 0);
+    if(nodeOrder.empty())
+        for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++)
+            rowOfNode[inode->LocalID()] = static_cast<unsigned>(inode->LocalID());
+    else
+        for(unsigned k = 0; k < nodeOrder.size(); k++)
+            rowOfNode[Node(&m, nodeOrder[k]).LocalID()] = k;
+
+    if(useGeomCache)
+        buildGeomCache();
+    prof.add(T_INIT, Timer() - t);
+}
+
+// Case k of a sweep has exact solution with frequency (1+k/2)*pi,
+// so that both source term and boundary data change from case to case
+void Problem::setCase(int k)
+{
+    freq = M_PI * (1. + 0.5*k);
     for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++){
         if(inode->GetStatus() == Element::Ghost)
             continue;
@@ -165,96 +264,313 @@ void Problem::initProblem()
         double x[2];
         node.Barycenter(x);
 
-        node.Real(tagRHS) = exactSolutionRHS(x);
-        node.Real(tagSolEx) = exactSolution(x);
+        node.Real(tagRHS) = exactSolutionRHS(x, freq);
+        node.Real(tagSolEx) = exactSolution(x, freq);
 
-        if(!node.Boundary())
+        if(!node.GetMarker(mrkDirNode))
             continue;
 
-        node.SetMarker(mrkDirNode);
-        numDirNodes++;
-        node.Real(tagBC)  = exactSolution(x);
-        node.Real(tagSol) = exactSolution(x);
+        node.Real(tagBC)  = exactSolution(x, freq);
+        node.Real(tagSol) = exactSolution(x, freq);
     }
-    cout << "Number of Dirichlet nodes: " << numDirNodes << endl;
-    times[T_INIT] += Timer() - t;
 }
 
-void Problem::assembleGlobalSystem()
+void Problem::buildGeomCache()
+{
+    int ncells = m.CellLastLocalID();
+    geom.nodes.assign(3*ncells, -1);
+    geom.detBk.assign(ncells, 0.);
+    geom.invBk.assign(4*ncells, 0.);
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        if(icell->GetStatus() == Element::Ghost)
+            continue;
+        int k = icell->LocalID();
+        ElementArray<Node> nodes = icell->getNodes();
+
+        double x0[2], x1[2], x2[2];
+        nodes[0].Barycenter(x0);
+        nodes[1].Barycenter(x1);
+        nodes[2].Barycenter(x2);
+
+        double Bk[4];
+        Bk[0] = x1[0] - x0[0]; //x2 - x1;
+        Bk[1] = x2[0] - x0[0]; //x3 - x1;
+        Bk[2] = x1[1] - x0[1]; //y2 - y1;
+        Bk[3] = x2[1] - x0[1]; //y3 - y1;
+        double detBk = Bk[0]*Bk[3] - Bk[1]*Bk[2];
+
+        for(int i = 0; i < 3; i++)
+            geom.nodes[3*k+i] = nodes[i].LocalID();
+        geom.detBk[k] = fabs(detBk);
+        geom.invBk[4*k+0] =  Bk[3] / detBk;
+        geom.invBk[4*k+1] = -Bk[1] / detBk;
+        geom.invBk[4*k+2] = -Bk[2] / detBk;
+        geom.invBk[4*k+3] =  Bk[0] / detBk;
+    }
+}
+
+void Problem::buildPattern()
 {
-    double t = Timer();
     Sparse::Matrix &A = linSys.A;
     Sparse::Vector &b = linSys.b;
     size = static_cast<unsigned>(m.NumberOfNodes())+1;
     A.SetInterval(0, size);
     b.SetInterval(0, size);
+
+    // First pass: row of each node with unknown
+    // contains all nodes of its adjacent cells
+    vector<unsigned> cols;
+    for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++){
+        if(inode->GetMarker(mrkDirNode))
+            continue;
+        cols.clear();
+        ElementArray<Cell> cells = inode->getCells();
+        for(auto icell = cells.begin(); icell != cells.end(); icell++){
+            if(icell->GetStatus() == Element::Ghost)
+                continue;
+            ElementArray<Node> nodes = icell->getNodes();
+            for(auto jnode = nodes.begin(); jnode != nodes.end(); jnode++)
+                cols.push_back(nodeRow(*jnode));
+        }
+        sort(cols.begin(), cols.end());
+        cols.erase(unique(cols.begin(), cols.end()), cols.end());
+        Sparse::Row &row = A[nodeRow(inode->getAsNode())];
+        row.Clear();
+        for(unsigned k = 0; k < cols.size(); k++)
+            row.Push(cols[k], 0.);
+    }
+
+    // Second pass: positions of local matrix entries in rows
+    pattern.pos.assign(9*m.CellLastLocalID(), -1);
     for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
         if(icell->GetStatus() == Element::Ghost)
             continue;
-        Cell cell = icell->getAsCell();
-
         ElementArray<Node> nodes = icell->getNodes();
-        rMatrix stiffMatrix = computeStiffMatrix(cell);
+        int *pos = &pattern.pos[9*icell->LocalID()];
+        for(int i = 0; i < 3; i++){
+            if(nodes[i].GetMarker(mrkDirNode))
+                continue;
+            Sparse::Row &row = A[nodeRow(nodes[i])];
+            for(int j = 0; j < 3; j++){
+                unsigned col = nodeRow(nodes[j]);
+                unsigned lo = 0, hi = row.Size();
+                while(lo < hi){
+                    unsigned mid = (lo + hi) / 2;
+                    if(row.GetIndex(mid) < col)
+                        lo = mid + 1;
+                    else
+                        hi = mid;
+                }
+                assert(lo < row.Size() && row.GetIndex(lo) == col);
+                pos[3*i+j] = static_cast<int>(lo);
+            }
+        }
+    }
+    pattern.built = true;
+}
+
+void Problem::assembleGlobalSystem()
+{
+    double t = Timer();
+    Sparse::Matrix &A = linSys.A;
+    Sparse::Vector &b = linSys.b;
+    if(rhsOnly){
+        // Matrix of previous assembly is kept
+        fill(b.Begin(), b.End(), 0.);
+    }
+    else if(useMatrixFree){
+        // Only right-hand side and diagonal are assembled
+        mfRHS.assign(m.NodeLastLocalID(), 0.);
+        mfDiag.assign(m.NodeLastLocalID(), 0.);
+    }
+    else if(useCSR){
+        // Pattern is built once, later assemblies only reset values
+        if(!pattern.built)
+            buildPattern();
+        for(unsigned i = 0; i < size; i++){
+            Sparse::Row &row = A[i];
+            for(unsigned k = 0; k < row.Size(); k++)
+                row.GetValue(k) = 0.;
+        }
+        fill(b.Begin(), b.End(), 0.);
+    }
+    else{
+        size = static_cast<unsigned>(m.NumberOfNodes())+1;
+        A.SetInterval(0, size);
+        b.SetInterval(0, size);
+    }
+    if(useColoring){
+        // Cells of one color share no nodes and are assembled concurrently
+        if(colors.empty())
+            colorCells(m, NODE, colors, &cellOrder);
+        for(unsigned c = 0; c < colors.size(); c++){
+#if defined(USE_OMP)
+#pragma omp parallel for
+#endif
+            for(int k = 0; k < static_cast<int>(colors[c].size()); k++){
+                Cell cell(&m, colors[c][k]);
+                if(cell.GetStatus() != Element::Ghost)
+                    assembleCell(cell);
+            }
+        }
+    }
+    else{
+        for(size_t k = 0; k < cellOrder.size(); k++){
+            Cell cell(&m, cellOrder[k]);
+            if(cell.GetStatus() != Element::Ghost)
+                assembleCell(cell);
+        }
+    }
+    prof.add(T_ASSEMBLE, Timer() - t);
+    if(useShapeCache){
+        cout << "Shape cache: " << shapes.numShapes() << " shapes, "
+             << shapes.numHits() << " hits, " << shapes.numMisses() << " misses" << endl;
+        prof.setValue("shapes", shapes.numShapes());
+    }
+}
+
+// Add contribution of one cell to global system
+void Problem::assembleCell(Cell &cell)
+{
+    Sparse::Matrix &A = linSys.A;
+    Sparse::Vector &b = linSys.b;
+
+    Node nodes[3];
+    getCellNodes(cell, nodes);
+    fMatrix<3,3> stiffMatrix = localStiffMatrix(cell, nodes);
+    fMatrix<3,1> bRHS = useGeomCache ? integrateRHS(cell.LocalID()) : integrateRHS(cell);
+
+    if(useMatrixFree){
+        for(int i = 0; i < 3; i++){
+            if(nodes[i].GetMarker(mrkDirNode))
+                continue;
+            unsigned ind = nodeRow(nodes[i]);
+            for(int j = 0; j < 3; j++)
+                if(nodes[j].GetMarker(mrkDirNode))
+                    mfRHS[ind] -= nodes[j].Real(tagBC) * stiffMatrix(j,i);
+            mfRHS[ind] += bRHS(i,0);
+            mfDiag[ind] += stiffMatrix(i,i);
+        }
+        return;
+    }
 
 //        cout << "stiffness matrix for cell " << cell.LocalID() << ":" << endl;
 //        stiffMatrix.Print();
 //        cout << endl << endl;
 
-        rMatrix bRHS = integrateRHS(cell);
-        bRHS *= 1;
-
-        unsigned ind0 = static_cast<unsigned>(nodes[0].LocalID());
-        unsigned ind1 = static_cast<unsigned>(nodes[1].LocalID());
-        unsigned ind2 = static_cast<unsigned>(nodes[2].LocalID());
-        if(nodes[0].GetMarker(mrkDirNode)){
-            // There's no row corresponding to nodes[0]
-            double bcVal = nodes[0].Real(tagBC);
-            if(!nodes[1].GetMarker(mrkDirNode))
-                b[ind1] -= bcVal * stiffMatrix(1,0);
-            if(!nodes[2].GetMarker(mrkDirNode))
-                b[ind2] -= bcVal * stiffMatrix(2,0);
+    unsigned ind[3];
+    for(int i = 0; i < 3; i++)
+        ind[i] = nodeRow(nodes[i]);
+    const int *pos = useCSR ? &pattern.pos[9*cell.LocalID()] : NULL;
+    for(int i = 0; i < 3; i++){
+        if(nodes[i].GetMarker(mrkDirNode)){
+            // There's no row corresponding to nodes[i]
+            double bcVal = nodes[i].Real(tagBC);
+            for(int j = 0; j < 3; j++)
+                if(j != i && !nodes[j].GetMarker(mrkDirNode))
+                    b[ind[j]] -= bcVal * stiffMatrix(j,i);
         }
         else{
-            A[ind0][ind0] += stiffMatrix(0,0);
-            A[ind0][ind1] += stiffMatrix(1,0);
-            A[ind0][ind2] += stiffMatrix(2,0);
-            b[ind0] += bRHS(0,0);
+            if(useCSR && !rhsOnly){
+                Sparse::Row &row = A[ind[i]];
+                for(int j = 0; j < 3; j++)
+                    row.GetValue(pos[3*i+j]) += stiffMatrix(j,i);
+            }
+            else if(!rhsOnly){
+                for(int j = 0; j < 3; j++)
+                    A[ind[i]][ind[j]] += stiffMatrix(j,i);
+            }
+            b[ind[i]] += bRHS(i,0);
         }
+    }
+}
 
-        if(nodes[1].GetMarker(mrkDirNode)){
-            // Dirichlet node
-            double bcVal = nodes[1].Real(tagBC);
-            if(!nodes[0].GetMarker(mrkDirNode))
-                b[ind0] -= bcVal * stiffMatrix(0,1);
-            if(!nodes[2].GetMarker(mrkDirNode))
-                b[ind2] -= bcVal * stiffMatrix(2,1);
-        }
-        else{
-            A[ind1][ind0] += stiffMatrix(0,1);
-            A[ind1][ind1] += stiffMatrix(1,1);
-            A[ind1][ind2] += stiffMatrix(2,1);
-            b[ind1] += bRHS(1,0);
-        }
+void Problem::getCellNodes(Cell &cell, Node *nodes)
+{
+    if(useGeomCache){
+        int k = cell.LocalID();
+        for(int i = 0; i < 3; i++)
+            nodes[i] = m.NodeByLocalID(geom.nodes[3*k+i]);
+    }
+    else{
+        ElementArray<Node> cnodes = cell.getNodes();
+        for(int i = 0; i < 3; i++)
+            nodes[i] = cnodes[i];
+    }
+}
+
+// Right-hand side depends on cell position, stiffness matrix only on its shape
+fMatrix<3,3> Problem::localStiffMatrix(Cell &cell, const Node *nodes)
+{
+    fMatrix<3,3> stiffMatrix;
+    ShapeCache::Key key;
+    if(useShapeCache){
+        shapes.makeKey(nodes, 3, 2, cell.RealArray(tagD).data(), 3, key);
+        if(shapes.find(key, stiffMatrix.data(), 9))
+            return stiffMatrix;
+    }
+    stiffMatrix = useGeomCache ? computeStiffMatrix(cell.LocalID()) : computeStiffMatrix(cell);
+    if(useShapeCache)
+        shapes.insert(key, stiffMatrix.data(), 9);
+    return stiffMatrix;
+}
+
+// y += A*x for rows of nodes of the cell
+void Problem::multiplyCell(Cell &cell, const vector<double> &x, vector<double> &y)
+{
+    Node nodes[3];
+    getCellNodes(cell, nodes);
+    fMatrix<3,3> stiffMatrix = localStiffMatrix(cell, nodes);
+    unsigned ind[3];
+    bool dir[3];
+    for(int i = 0; i < 3; i++){
+        ind[i] = nodeRow(nodes[i]);
+        dir[i] = nodes[i].GetMarker(mrkDirNode);
+    }
+    for(int i = 0; i < 3; i++){
+        if(dir[i])
+            continue;
+        double s = 0.;
+        for(int j = 0; j < 3; j++)
+            if(!dir[j])
+                s += stiffMatrix(j,i) * x[ind[j]];
+        y[ind[i]] += s;
+    }
+}
 
-        if(nodes[2].GetMarker(mrkDirNode)){
-            // Dirichlet node
-            double bcVal = nodes[2].Real(tagBC);
-            if(!nodes[1].GetMarker(mrkDirNode))
-                b[ind1] -= bcVal * stiffMatrix(1,2);
-            if(!nodes[0].GetMarker(mrkDirNode))
-                b[ind0] -= bcVal * stiffMatrix(0,2);
+void Problem::multiply(const vector<double> &x, vector<double> &y)
+{
+    fill(y.begin(), y.end(), 0.);
+    if(useColoring){
+        for(unsigned c = 0; c < colors.size(); c++){
+#if defined(USE_OMP)
+#pragma omp parallel for
+#endif
+            for(int k = 0; k < static_cast<int>(colors[c].size()); k++){
+                Cell cell(&m, colors[c][k]);
+                if(cell.GetStatus() != Element::Ghost)
+                    multiplyCell(cell, x, y);
+            }
         }
-        else{
-            A[ind2][ind0] += stiffMatrix(0,2);
-            A[ind2][ind1] += stiffMatrix(1,2);
-            A[ind2][ind2] += stiffMatrix(2,2);
-            b[ind2] += bRHS(2,0);
+    }
+    else{
+        for(size_t k = 0; k < cellOrder.size(); k++){
+            Cell cell(&m, cellOrder[k]);
+            if(cell.GetStatus() != Element::Ghost)
+                multiplyCell(cell, x, y);
         }
     }
-    times[T_ASSEMBLE] += Timer() - t;
 }
 
-rMatrix Problem::computeStiffMatrix(Cell &cell)
+double Problem::dot(const vector<double> &a, const vector<double> &b)
+{
+    double s = 0.;
+    for(size_t i = 0; i < a.size(); i++)
+        s += a[i] * b[i];
+    return s;
+}
+
+fMatrix<3,3> Problem::computeStiffMatrix(Cell &cell)
 {
     ElementArray<Node> nodes = cell.getNodes();
 
@@ -263,24 +579,50 @@ rMatrix Problem::computeStiffMatrix(Cell &cell)
     nodes[1].Barycenter(x1);
     nodes[2].Barycenter(x2);
 
-    rMatrix Dk(2,2); // Diffusion tensor
+    fMatrix<2,2> Dk; // Diffusion tensor
     Dk(0,0) = cell.RealArray(tagD)[0];
     Dk(1,1) = cell.RealArray(tagD)[1];
     Dk(1,0) = cell.RealArray(tagD)[2];
     Dk(0,1) = cell.RealArray(tagD)[2];
 
-    rMatrix Bk(2,2);
+    fMatrix<2,2> Bk;
     Bk(0,0) = x1[0] - x0[0]; //x2 - x1;
     Bk(0,1) = x2[0] - x0[0]; //x3 - x1;
     Bk(1,0) = x1[1] - x0[1]; //y2 - y1;
     Bk(1,1) = x2[1] - x0[1]; //y3 - y1;
 
-    rMatrix Ck = Bk.Invert() * Dk * Bk.Invert().Transpose();
+    fMatrix<2,2> invBk = Bk.Invert();
+    fMatrix<2,2> Ck = invBk * Dk * invBk.Transpose();
     //Ck = Dk * Ck;
 
-    double detBk = Bk(0,0)*Bk(1,1) - Bk(0,1)*Bk(1,0);
+    return referenceStiffMatrix(Ck, det(Bk));
+}
+
+fMatrix<3,3> Problem::computeStiffMatrix(int k)
+{
+    Storage::real_array Dt = m.CellByLocalID(k).RealArray(tagD);
+    fMatrix<2,2> Dk; // Diffusion tensor
+    Dk(0,0) = Dt[0];
+    Dk(1,1) = Dt[1];
+    Dk(1,0) = Dt[2];
+    Dk(0,1) = Dt[2];
+
+    fMatrix<2,2> invBk;
+    invBk(0,0) = geom.invBk[4*k+0];
+    invBk(0,1) = geom.invBk[4*k+1];
+    invBk(1,0) = geom.invBk[4*k+2];
+    invBk(1,1) = geom.invBk[4*k+3];
+
+    fMatrix<2,2> Ck = invBk * Dk * invBk.Transpose();
+
+    return referenceStiffMatrix(Ck, geom.detBk[k]);
+}
 
-    rMatrix Kee(3,3), Knn(3,3), Ken(3,3);
+// Stiffness matrix of P1 triangle assembled from
+// reference element matrices, Ck = Bk^-1 * Dk * Bk^-T
+fMatrix<3,3> referenceStiffMatrix(const fMatrix<2,2> &Ck, double detBk)
+{
+    fMatrix<3,3> Kee, Knn, Ken;
     Kee.Zero();
     Knn.Zero();
     Ken.Zero();
@@ -296,16 +638,15 @@ rMatrix Problem::computeStiffMatrix(Cell &cell)
     Knn *= 0.5;
     Ken *= 0.5;
 
-    rMatrix M(3,3);
-    M = Ck(0,0)*Kee + Ck(1,1)*Knn + Ck(0,1)*(Ken + Ken.Transpose());
+    fMatrix<3,3> M = Ck(0,0)*Kee + Ck(1,1)*Knn + Ck(0,1)*(Ken + Ken.Transpose());
     M *= fabs(detBk);
 
     return M;
 }
 
-rMatrix Problem::integrateRHS(Cell &cell)
+fMatrix<3,1> Problem::integrateRHS(Cell &cell)
 {
-    rMatrix res(3,1);
+    fMatrix<3,1> res;
 
     ElementArray<Node> nodes = cell.getNodes();
 
@@ -314,42 +655,93 @@ rMatrix Problem::integrateRHS(Cell &cell)
     nodes[1].Barycenter(x1);
     nodes[2].Barycenter(x2);
 
-    rMatrix Bk(2,2);
+    fMatrix<2,2> Bk;
     Bk(0,0) = x1[0] - x0[0]; //x2 - x1;
     Bk(0,1) = x2[0] - x0[0]; //x3 - x1;
     Bk(1,0) = x1[1] - x0[1]; //y2 - y1;
     Bk(1,1) = x2[1] - x0[1]; //y3 - y1;
 
-    rMatrix Ck = Bk.Invert() * Bk.Invert().Transpose();
+    double detBk = det(Bk);
 
-    double detBk = Bk(0,0)*Bk(1,1) - Bk(0,1)*Bk(1,0);
-
-    res.Zero();
-    res(0,0) += exactSolutionRHS(x0) + exactSolutionRHS(x1) + exactSolutionRHS(x2);
+    res(0,0) = exactSolutionRHS(x0, freq) + exactSolutionRHS(x1, freq) + exactSolutionRHS(x2, freq);
     res(1,0) = res(0,0);
     res(2,0) = res(0,0);
 
     return res * fabs(detBk) / 18.;
 }
 
+fMatrix<3,1> Problem::integrateRHS(int k)
+{
+    fMatrix<3,1> res;
+
+    res(0,0) = 0.;
+    for(int i = 0; i < 3; i++)
+        res(0,0) += m.NodeByLocalID(geom.nodes[3*k+i]).Real(tagRHS);
+    res(1,0) = res(0,0);
+    res(2,0) = res(0,0);
+
+    return res * geom.detBk[k] / 18.;
+}
+
+void Problem::solveMatrixFree()
+{
+    vector<double> sol(mfRHS.size(), 0.);
+    int iters;
+    double resid;
+    double t = Timer();
+    bool solved = solveMatrixFreeCG(*this, mfDiag, mfRHS, sol, 1e-10, 1e-13, 10000, iters, resid);
+    prof.add(T_SOLVE, Timer() - t);
+    if(!solved){
+        cout << "Linear solver failed: no convergence in " << iters << " iterations" << endl;
+        cout << "Residual: " << resid << endl;
+        exit(1);
+    }
+    cout << "Linear solver iterations: " << iters << endl;
+    prof.count("linear_iterations", iters);
+
+    t = Timer();
+    double Cnorm = 0.0;
+    for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++){
+        if(inode->GetMarker(mrkDirNode))
+            continue;
+
+        inode->Real(tagSol) = sol[nodeRow(inode->getAsNode())];
+        Cnorm = max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
+    }
+    cout << "|err|_C = " << Cnorm << endl;
+    prof.setValue("err_C", Cnorm);
+    prof.add(T_UPDATE, Timer() - t);
+}
+
 void Problem::solveSystem()
 {
-    Solver S("inner_ilu2");
+    if(useMatrixFree){
+        solveMatrixFree();
+        return;
+    }
+    Solver S(solverOpt.type, solverOpt.prefix);
     double t = Timer();
     S.SetMatrix(linSys.A);
-    times[T_PRECOND] += Timer() - t;
+    prof.add(T_PRECOND, Timer() - t);
+    if(!solveRHS(S))
+        exit(1);
+}
+
+bool Problem::solveRHS(Solver &S)
+{
     Sparse::Vector sol;
     cout << "size = " << size << endl;
     sol.SetInterval(0, size);
-    t = Timer();
+    double t = Timer();
     bool solved = S.Solve(linSys.b, sol);
-    times[T_SOLVE] += Timer() - t;
+    prof.add(T_SOLVE, Timer() - t);
     if(!solved){
         cout << "Linear solver failed: " << S.GetReason() << endl;
         cout << "Residual: " << S.Residual() << endl;
-        exit(1);
+        return false;
     }
     cout << "Linear solver iterations: " << S.Iterations() << endl;
+    prof.count("linear_iterations", S.Iterations());
 
     t = Timer();
     double Cnorm = 0.0;
@@ -357,33 +749,117 @@ void Problem::solveSystem()
         if(inode->GetMarker(mrkDirNode))
             continue;
 
-        inode->Real(tagSol) = sol[static_cast<unsigned>(inode->GlobalID())];
+        inode->Real(tagSol) = sol[nodeRow(inode->getAsNode())];
         Cnorm = max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
     }
     cout << "|err|_C = " << Cnorm << endl;
-    times[T_UPDATE] += Timer() - t;
+    prof.setValue("err_C", Cnorm);
+    prof.add(T_UPDATE, Timer() - t);
+    return true;
+}
+
+// Matrix is assembled and preconditioner is built once,
+// for every next case only right-hand side is assembled.
+// Solution of case k is kept in tag SOLUTION_<k>
+void Problem::solveSweep(int n)
+{
+    if(useMatrixFree){
+        cout << "Sweep needs assembled matrix, -matfree is not supported" << endl;
+        exit(1);
+    }
+    assembleGlobalSystem();
+    Solver S(solverOpt.type, solverOpt.prefix);
+    double t = Timer();
+    S.SetMatrix(linSys.A);
+    prof.add(T_PRECOND, Timer() - t);
+    for(int k = 0; k < n; k++){
+        if(k > 0){
+            setCase(k);
+            rhsOnly = true;
+            assembleGlobalSystem();
+            rhsOnly = false;
+        }
+        cout << "Case " << k << ", frequency " << freq << ":" << endl;
+        if(!solveRHS(S))
+            exit(1);
+        prof.count("sweep_cases");
+        Tag tagCase = m.CreateTag(tagNameSol + "_" + to_string(k), DATA_REAL, NODE, NONE, 1);
+        double Cnorm = 0.0;
+        for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++){
+            inode->Real(tagCase) = inode->Real(tagSol);
+            Cnorm = max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
+        }
+        prof.setValue("err_C_" + to_string(k), Cnorm);
+    }
 }
 
 void Problem::saveSolution(string path)
 {
     double t = Timer();
+    deleteColoring(m);
     m.Save(path);
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2){
-        cout << "Usage: 2d_poisson_fem <mesh_file>" << endl;
+    if(argc < 2){
+        cout << "Usage: 2d_diffusion_fem <mesh_file> [-cache] [-csr] [-colored] [-shape_cache] [-matfree] [-reorder rcm|sfc] [-sweep <n>] [-solver <type>] [-solver_db <file>]" << endl;
         return 1;
     }
 
-    Problem P(argv[1]);
-    P.initProblem();
-    P.assembleGlobalSystem();
-    P.solveSystem();
-    P.saveSolution("res.vtk");
+    bool geomCache = false, csr = false, colored = false, shapeCache = false, matfree = false;
+    int reorder = REORDER_NONE;
+    SolverOptions solverOpt("inner_ilu2");
+    int sweep = 0;
+    for(int i = 2; i < argc; i++){
+        string opt(argv[i]);
+        if(opt == "-cache")
+            geomCache = true;
+        else if(opt == "-csr")
+            csr = true;
+        else if(opt == "-colored")
+            colored = true;
+        else if(opt == "-shape_cache")
+            shapeCache = true;
+        else if(opt == "-matfree")
+            matfree = true;
+        else if(opt == "-reorder" && i+1 < argc)
+            reorder = parseReorderMethod(argv[++i]);
+        else if(opt == "-sweep" && i+1 < argc)
+            sweep = atoi(argv[++i]);
+        else if(!solverOpt.parse(i, argc, argv)){
+            cout << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    Solver::Initialize(&argc, &argv, solverOpt.database.c_str());
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    Problem *P = new Problem(argv[1]);
+    P->setGeomCache(geomCache);
+    P->setCSR(csr);
+    P->setColoring(colored);
+    P->setShapeCache(shapeCache);
+    P->setMatrixFree(matfree);
+    P->setReorder(reorder);
+    P->setSolver(solverOpt);
+    P->initProblem();
+    if(sweep > 0)
+        P->solveSweep(sweep);
+    else{
+        P->assembleGlobalSystem();
+        P->solveSystem();
+    }
+    P->saveSolution("res.vtk");
+
+    delete P;
+
+    Partitioner::Finalize();
+    Solver::Finalize();
+    Mesh::Finalize();
 
     return 0;
 }
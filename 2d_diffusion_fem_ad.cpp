@@ -1,4 +1,10 @@
 #include "inmost.h"
+#include "coloring.h"
+#include "fixed_matrix.h"
+#include "profiling.h"
+#include "solver_options.h"
+#include "linear_residual.h"
+#include "reordering.h"
 
 //    !!!!!!! Currently NOT suited for parallel run
 //
@@ -26,15 +32,6 @@
 using namespace INMOST;
 using namespace std;
 
-enum{
-    T_ASSEMBLE = 0,
-    T_SOLVE,
-    T_PRECOND,
-    T_IO,
-    T_INIT,
-    T_UPDATE
-};
-
 const string tagNameTensor = "DIFFUSION_TENSOR";
 const string tagNameBC     = "BOUNDARY_CONDITION";
 const string tagNameRHS    = "RHS";
@@ -81,25 +78,40 @@ private:
 
     unsigned numDirNodes;
 
-    double times[10];
-    double ttt; // global timer
+    bool useColoring;     // assemble cells concurrently by colors
+    vector< vector<HandleType> > colors; // cells grouped by color
+
+    int reorder;          // ordering of cell loops, see reordering.h
+    vector<HandleType> cellOrder; // cells in assembly order
+    UnknownPermutation perm;      // unknowns in element order, empty without reordering
+
+    bool useNumeric;      // assemble linear residual without AD expressions
+
+    SolverOptions solverOpt; // type and parameters of linear solver
+
+    Profiler prof; // run-time statistics
 
 public:
     Problem(string meshName);
     ~Problem();
     void initProblem(); // create tags and set parameters
     void assembleGlobalSystem(); // assemble global linear system
-    rMatrix computeStiffMatrix(Cell &);
-    rMatrix integrateRHS(Cell &);
+    void assembleCell(Cell &);    // add contribution of one cell
+    void setColoring(bool b) { useColoring = b; }
+    void setReorder(int r) { reorder = r; }
+    void setSolver(const SolverOptions &o) { solverOpt = o; }
+    void setNumeric(bool b) { useNumeric = b; }
+    fMatrix<3,3> computeStiffMatrix(Cell &);
+    fMatrix<3,1> integrateRHS(Cell &);
     void solveSystem();
     void saveSolution(string path); // save mesh with solution
 };
 
 Problem::Problem(string meshName)
 {
-    ttt = Timer();
-    for(int i = 0; i < 10; i++)
-        times[i] = 0.;
+    useColoring = false;
+    reorder = REORDER_NONE;
+    useNumeric = false;
 
     double t = Timer();
     m.Load(meshName);
@@ -108,21 +120,12 @@ Problem::Problem(string meshName)
     cout << "Number of edges: " << m.NumberOfEdges() << endl;
     cout << "Number of nodes: " << m.NumberOfNodes() << endl;
     m.AssignGlobalID(NODE);
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 Problem::~Problem()
 {
-    printf("\n+=========================\n");
-    printf("| T_assemble = %lf\n", times[T_ASSEMBLE]);
-    printf("| T_precond  = %lf\n", times[T_PRECOND]);
-    printf("| T_solve    = %lf\n", times[T_SOLVE]);
-    printf("| T_IO       = %lf\n", times[T_IO]);
-    printf("| T_update   = %lf\n", times[T_UPDATE]);
-    printf("| T_init     = %lf\n", times[T_INIT]);
-    printf("+-------------------------\n");
-    printf("| T_total    = %lf\n", Timer() - ttt);
-    printf("+=========================\n");
+    prof.report(m, "stats");
 }
 
 void Problem::initProblem()
@@ -181,75 +184,112 @@ void Problem::initProblem()
         node.Real(tagSol) = exactSolution(x);
     }
     cout << "Number of Dirichlet nodes: " << numDirNodes << endl;
-    times[T_INIT] += Timer() - t;
+
+    // Cell loops follow the cell order, unknowns enumerated by Automatizator
+    // are renumbered for the solver
+    reorderElements(m, CELL, reorder, cellOrder);
+    if(cellOrder.empty())
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            cellOrder.push_back(icell->GetHandle());
+    if(reorder != REORDER_NONE){
+        vector<HandleType> nodeOrder;
+        reorderElements(m, NODE, reorder, nodeOrder);
+        vector<INMOST_DATA_ENUM_TYPE> unknowns;
+        for(size_t k = 0; k < nodeOrder.size(); k++)
+            unknowns.push_back(var.Index(Node(&m, nodeOrder[k])));
+        perm.build(aut.GetFirstIndex(), aut.GetLastIndex(), unknowns);
+    }
+    prof.add(T_INIT, Timer() - t);
 }
 
 void Problem::assembleGlobalSystem()
 {
     double t = Timer();
-    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-        if(icell->GetStatus() == Element::Ghost)
-            continue;
-        Cell cell = icell->getAsCell();
-
-        ElementArray<Node> nodes = icell->getNodes();
-        rMatrix stiffMatrix = computeStiffMatrix(cell);
-
-        rMatrix bRHS = integrateRHS(cell);
-        bRHS *= 1;
-
-        unsigned ind0 = static_cast<unsigned>(nodes[0].LocalID());
-        unsigned ind1 = static_cast<unsigned>(nodes[1].LocalID());
-        unsigned ind2 = static_cast<unsigned>(nodes[2].LocalID());
-        if(nodes[0].GetMarker(mrkDirNode)){
-            // There's no row corresponding to nodes[0]
-            double bcVal = nodes[0].Real(tagBC);
-            if(!nodes[1].GetMarker(mrkDirNode))
-                R[var.Index(nodes[1])] += bcVal * stiffMatrix(1,0);
-            if(!nodes[2].GetMarker(mrkDirNode))
-                R[var.Index(nodes[2])] += bcVal * stiffMatrix(2,0);
+    if(useColoring){
+        // Cells of one color share no nodes and are assembled concurrently
+        if(colors.empty())
+            colorCells(m, NODE, colors, &cellOrder);
+        for(unsigned c = 0; c < colors.size(); c++){
+#if defined(USE_OMP)
+#pragma omp parallel for
+#endif
+            for(int k = 0; k < static_cast<int>(colors[c].size()); k++){
+                Cell cell(&m, colors[c][k]);
+                if(cell.GetStatus() != Element::Ghost)
+                    assembleCell(cell);
+            }
         }
-        else{
-            R[var.Index(nodes[0])] += stiffMatrix(0,0) * var(nodes[0]);
-            R[var.Index(nodes[0])] += stiffMatrix(1,0) * var(nodes[1]);
-            R[var.Index(nodes[0])] += stiffMatrix(2,0) * var(nodes[2]);
-            R[var.Index(nodes[0])] -= bRHS(0,0);
+    }
+    else{
+        for(size_t k = 0; k < cellOrder.size(); k++){
+            Cell cell(&m, cellOrder[k]);
+            if(cell.GetStatus() != Element::Ghost)
+                assembleCell(cell);
         }
+    }
+    prof.add(T_ASSEMBLE, Timer() - t);
+}
 
-        if(nodes[1].GetMarker(mrkDirNode)){
-            // Dirichlet node
-            double bcVal = nodes[1].Real(tagBC);
-            if(!nodes[0].GetMarker(mrkDirNode))
-                R[var.Index(nodes[0])] += bcVal * stiffMatrix(0,1);
-            if(!nodes[2].GetMarker(mrkDirNode))
-                R[var.Index(nodes[2])] += bcVal * stiffMatrix(2,1);
-        }
-        else{
-            R[var.Index(nodes[1])] += stiffMatrix(0,1) * var(nodes[0]);
-            R[var.Index(nodes[1])] += stiffMatrix(1,1) * var(nodes[1]);
-            R[var.Index(nodes[1])] += stiffMatrix(2,1) * var(nodes[2]);
-            R[var.Index(nodes[1])] -= bRHS(1,0);
-        }
+// Add contribution of one cell to global system
+void Problem::assembleCell(Cell &cell)
+{
+    LinearResidual LR(R, useNumeric);
+    ElementArray<Node> nodes = cell.getNodes();
+    fMatrix<3,3> stiffMatrix = computeStiffMatrix(cell);
+
+    fMatrix<3,1> bRHS = integrateRHS(cell);
+    bRHS *= 1;
+
+    unsigned ind0 = static_cast<unsigned>(nodes[0].LocalID());
+    unsigned ind1 = static_cast<unsigned>(nodes[1].LocalID());
+    unsigned ind2 = static_cast<unsigned>(nodes[2].LocalID());
+    if(nodes[0].GetMarker(mrkDirNode)){
+        // There's no row corresponding to nodes[0]
+        double bcVal = nodes[0].Real(tagBC);
+        if(!nodes[1].GetMarker(mrkDirNode))
+            LR.add(var.Index(nodes[1]), bcVal * stiffMatrix(1,0));
+        if(!nodes[2].GetMarker(mrkDirNode))
+            LR.add(var.Index(nodes[2]), bcVal * stiffMatrix(2,0));
+    }
+    else{
+        LR.add(var.Index(nodes[0]), stiffMatrix(0,0), var, nodes[0]);
+        LR.add(var.Index(nodes[0]), stiffMatrix(1,0), var, nodes[1]);
+        LR.add(var.Index(nodes[0]), stiffMatrix(2,0), var, nodes[2]);
+        LR.add(var.Index(nodes[0]), -bRHS(0,0));
+    }
 
-        if(nodes[2].GetMarker(mrkDirNode)){
-            // Dirichlet node
-            double bcVal = nodes[2].Real(tagBC);
-            if(!nodes[1].GetMarker(mrkDirNode))
-                R[var.Index(nodes[1])] += bcVal * stiffMatrix(1,2);
-            if(!nodes[0].GetMarker(mrkDirNode))
-                R[var.Index(nodes[0])] += bcVal * stiffMatrix(0,2);
-        }
-        else{
-            R[var.Index(nodes[2])] += stiffMatrix(0,2) * var(nodes[0]);
-            R[var.Index(nodes[2])] += stiffMatrix(1,2) * var(nodes[1]);
-            R[var.Index(nodes[2])] += stiffMatrix(2,2) * var(nodes[2]);
-            R[var.Index(nodes[2])] -= bRHS(2,0);
-        }
+    if(nodes[1].GetMarker(mrkDirNode)){
+        // Dirichlet node
+        double bcVal = nodes[1].Real(tagBC);
+        if(!nodes[0].GetMarker(mrkDirNode))
+            LR.add(var.Index(nodes[0]), bcVal * stiffMatrix(0,1));
+        if(!nodes[2].GetMarker(mrkDirNode))
+            LR.add(var.Index(nodes[2]), bcVal * stiffMatrix(2,1));
+    }
+    else{
+        LR.add(var.Index(nodes[1]), stiffMatrix(0,1), var, nodes[0]);
+        LR.add(var.Index(nodes[1]), stiffMatrix(1,1), var, nodes[1]);
+        LR.add(var.Index(nodes[1]), stiffMatrix(2,1), var, nodes[2]);
+        LR.add(var.Index(nodes[1]), -bRHS(1,0));
+    }
+
+    if(nodes[2].GetMarker(mrkDirNode)){
+        // Dirichlet node
+        double bcVal = nodes[2].Real(tagBC);
+        if(!nodes[1].GetMarker(mrkDirNode))
+            LR.add(var.Index(nodes[1]), bcVal * stiffMatrix(1,2));
+        if(!nodes[0].GetMarker(mrkDirNode))
+            LR.add(var.Index(nodes[0]), bcVal * stiffMatrix(0,2));
+    }
+    else{
+        LR.add(var.Index(nodes[2]), stiffMatrix(0,2), var, nodes[0]);
+        LR.add(var.Index(nodes[2]), stiffMatrix(1,2), var, nodes[1]);
+        LR.add(var.Index(nodes[2]), stiffMatrix(2,2), var, nodes[2]);
+        LR.add(var.Index(nodes[2]), -bRHS(2,0));
     }
-    times[T_ASSEMBLE] += Timer() - t;
 }
 
-rMatrix Problem::computeStiffMatrix(Cell &cell)
+fMatrix<3,3> Problem::computeStiffMatrix(Cell &cell)
 {
     ElementArray<Node> nodes = cell.getNodes();
 
@@ -258,24 +298,25 @@ rMatrix Problem::computeStiffMatrix(Cell &cell)
     nodes[1].Barycenter(x1);
     nodes[2].Barycenter(x2);
 
-    rMatrix Dk(2,2); // Diffusion tensor
+    fMatrix<2,2> Dk; // Diffusion tensor
     Dk(0,0) = cell.RealArray(tagD)[0];
     Dk(1,1) = cell.RealArray(tagD)[1];
     Dk(1,0) = cell.RealArray(tagD)[2];
     Dk(0,1) = cell.RealArray(tagD)[2];
 
-    rMatrix Bk(2,2);
+    fMatrix<2,2> Bk;
     Bk(0,0) = x1[0] - x0[0]; //x2 - x1;
     Bk(0,1) = x2[0] - x0[0]; //x3 - x1;
     Bk(1,0) = x1[1] - x0[1]; //y2 - y1;
     Bk(1,1) = x2[1] - x0[1]; //y3 - y1;
 
-    rMatrix Ck = Bk.Invert() * Dk * Bk.Invert().Transpose();
+    fMatrix<2,2> invBk = Bk.Invert();
+    fMatrix<2,2> Ck = invBk * Dk * invBk.Transpose();
     //Ck = Dk * Ck;
 
     double detBk = Bk(0,0)*Bk(1,1) - Bk(0,1)*Bk(1,0);
 
-    rMatrix Kee(3,3), Knn(3,3), Ken(3,3);
+    fMatrix<3,3> Kee, Knn, Ken;
     Kee.Zero();
     Knn.Zero();
     Ken.Zero();
@@ -291,16 +332,15 @@ rMatrix Problem::computeStiffMatrix(Cell &cell)
     Knn *= 0.5;
     Ken *= 0.5;
 
-    rMatrix M(3,3);
-    M = Ck(0,0)*Kee + Ck(1,1)*Knn + Ck(0,1)*(Ken + Ken.Transpose());
+    fMatrix<3,3> M = Ck(0,0)*Kee + Ck(1,1)*Knn + Ck(0,1)*(Ken + Ken.Transpose());
     M *= fabs(detBk);
 
     return M;
 }
 
-rMatrix Problem::integrateRHS(Cell &cell)
+fMatrix<3,1> Problem::integrateRHS(Cell &cell)
 {
-    rMatrix res(3,1);
+    fMatrix<3,1> res;
 
     ElementArray<Node> nodes = cell.getNodes();
 
@@ -309,14 +349,12 @@ rMatrix Problem::integrateRHS(Cell &cell)
     nodes[1].Barycenter(x1);
     nodes[2].Barycenter(x2);
 
-    rMatrix Bk(2,2);
+    fMatrix<2,2> Bk;
     Bk(0,0) = x1[0] - x0[0]; //x2 - x1;
     Bk(0,1) = x2[0] - x0[0]; //x3 - x1;
     Bk(1,0) = x1[1] - x0[1]; //y2 - y1;
     Bk(1,1) = x2[1] - x0[1]; //y3 - y1;
 
-    rMatrix Ck = Bk.Invert() * Bk.Invert().Transpose();
-
     double detBk = Bk(0,0)*Bk(1,1) - Bk(0,1)*Bk(1,0);
 
     res.Zero();
@@ -329,21 +367,25 @@ rMatrix Problem::integrateRHS(Cell &cell)
 
 void Problem::solveSystem()
 {
-    Solver S("inner_ilu2");
+    Solver S(solverOpt.type, solverOpt.prefix);
     double t = Timer();
-    S.SetMatrix(R.GetJacobian());
-    times[T_PRECOND] += Timer() - t;
+    perm.setMatrix(S, R.GetJacobian());
+    if(!perm.empty())
+        cout << "Matrix bandwidth: " << matrixBandwidth(R.GetJacobian()) << " -> "
+             << matrixBandwidth(perm.getMatrix()) << " after reordering" << endl;
+    prof.add(T_PRECOND, Timer() - t);
     Sparse::Vector sol;
     sol.SetInterval(aut.GetFirstIndex(), aut.GetLastIndex());
     t = Timer();
-    bool solved = S.Solve(R.GetResidual(), sol);
-    times[T_SOLVE] += Timer() - t;
+    bool solved = perm.solve(S, R.GetResidual(), sol);
+    prof.add(T_SOLVE, Timer() - t);
     if(!solved){
         cout << "Linear solver failed: " << S.GetReason() << endl;
         cout << "Residual: " << S.Residual() << endl;
         exit(1);
     }
     cout << "Linear solver iterations: " << S.Iterations() << endl;
+    prof.count("linear_iterations", S.Iterations());
 
     t = Timer();
     double Cnorm = 0.0;
@@ -355,29 +397,61 @@ void Problem::solveSystem()
         Cnorm = max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
     }
     cout << "|err|_C = " << Cnorm << endl;
-    times[T_UPDATE] += Timer() - t;
+    prof.setValue("err_C", Cnorm);
+    prof.add(T_UPDATE, Timer() - t);
 }
 
 void Problem::saveSolution(string path)
 {
     double t = Timer();
+    deleteColoring(m);
     m.Save(path);
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2){
-        cout << "Usage: 2d_poisson_fem <mesh_file>" << endl;
+    if(argc < 2){
+        cout << "Usage: 2d_diffusion_fem_ad <mesh_file> [-colored] [-reorder rcm|sfc] [-numeric] [-solver <type>] [-solver_db <file>]" << endl;
         return 1;
     }
 
-    Problem P(argv[1]);
-    P.initProblem();
-    P.assembleGlobalSystem();
-    P.solveSystem();
-    P.saveSolution("res.vtk");
+    bool colored = false, numeric = false;
+    int reorder = REORDER_NONE;
+    SolverOptions solverOpt("inner_ilu2");
+    for(int i = 2; i < argc; i++){
+        string opt(argv[i]);
+        if(opt == "-colored")
+            colored = true;
+        else if(opt == "-reorder" && i+1 < argc)
+            reorder = parseReorderMethod(argv[++i]);
+        else if(opt == "-numeric")
+            numeric = true;
+        else if(!solverOpt.parse(i, argc, argv)){
+            cout << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    Solver::Initialize(&argc, &argv, solverOpt.database.c_str());
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    Problem *P = new Problem(argv[1]);
+    P->setColoring(colored);
+    P->setReorder(reorder);
+    P->setNumeric(numeric);
+    P->setSolver(solverOpt);
+    P->initProblem();
+    P->assembleGlobalSystem();
+    P->solveSystem();
+    P->saveSolution("res.vtk");
+
+    delete P;
+
+    Partitioner::Finalize();
+    Solver::Finalize();
+    Mesh::Finalize();
 
     return 0;
 }
@@ -1,4 +1,9 @@
 #include "inmost.h"
+#include "coloring.h"
+#include "profiling.h"
+#include "solver_options.h"
+#include "linear_residual.h"
+#include "reordering.h"
 
 //    !!!!!!! Currently NOT suited for parallel run
 //
@@ -26,21 +31,13 @@
 using namespace INMOST;
 using namespace std;
 
-enum{
-    T_ASSEMBLE = 0,
-    T_SOLVE,
-    T_PRECOND,
-    T_IO,
-    T_INIT,
-    T_UPDATE
-};
-
 const string tagNameTensor = "DIFFUSION_TENSOR";
 const string tagNameBC     = "BOUNDARY_CONDITION";
 const string tagNameRHS    = "RHS";
 const string tagNameSol    = "SOLUTION";
 const string tagNameSolEx  = "SOLUTION_EXACT";
 const string tagNameFlux   = "FLUX";
+const string tagNameLambda = "FACE_PRESSURE";
 
 
 // Corresponds to tensor
@@ -83,6 +80,7 @@ private:
     Tag tagSolEx; // Exact solution
     Tag tagRHS;   // RHS function f
     Tag tagFlux;  // Flux
+    Tag tagLam;   // Face pressure, unknown of hybridized system
 
     MarkerType mrkDirNode;  // Dirichlet node marker
 
@@ -90,18 +88,41 @@ private:
     Residual R;            // Residual to assemble
     dynamic_variable varP; // Variable containing solution
     dynamic_variable varU; // Variable containing flux
+    dynamic_variable varL; // Variable containing face pressure (hybridized system)
 
     unsigned numDirNodes;
 
-    double times[10];
-    double ttt; // global timer
+    bool useColoring;     // assemble cells concurrently by colors
+    vector< vector<HandleType> > colors; // cells grouped by color
+
+    int reorder;          // ordering of cell loops, see reordering.h
+    vector<HandleType> cellOrder; // cells in assembly order
+    UnknownPermutation perm;      // unknowns in element order, empty without reordering
+
+    bool useNumeric;      // assemble linear residual without AD expressions
+
+    bool useHybrid;       // eliminate fluxes and cell pressures, solve for face pressures
+    MarkerType mrkBndFace; // boundary faces, face pressures there are given
+
+    SolverOptions solverOpt; // type and parameters of linear solver
+
+    Profiler prof; // run-time statistics
 
 public:
     Problem(string meshName);
     ~Problem();
     void initProblem(); // create tags and set parameters
     void assembleGlobalSystem(); // assemble global linear system
+    void assembleCell(Cell &);    // add contribution of one cell
+    void setColoring(bool b) { useColoring = b; }
+    void setReorder(int r) { reorder = r; }
+    void setSolver(const SolverOptions &o) { solverOpt = o; }
+    void setNumeric(bool b) { useNumeric = b; }
+    void setHybrid(bool b) { useHybrid = b; }
     void assembleLocalSystem(Cell &, rMatrix &);
+    void hybridLocalSystem(Cell &, rMatrix &Q, rMatrix &q, double &beta);
+    void assembleCellHybrid(Cell &);
+    void recoverCell(Cell &); // cell pressure and fluxes from face pressures
     rMatrix integrateRHS(Cell &);
     void solveSystem();
     void saveSolution(string path); // save mesh with solution
@@ -109,9 +130,10 @@ public:
 
 Problem::Problem(string meshName)
 {
-    ttt = Timer();
-    for(int i = 0; i < 10; i++)
-        times[i] = 0.;
+    useColoring = false;
+    reorder = REORDER_NONE;
+    useNumeric = false;
+    useHybrid = false;
 
     double t = Timer();
     m.Load(meshName);
@@ -120,21 +142,12 @@ Problem::Problem(string meshName)
     cout << "Number of edges: " << m.NumberOfEdges() << endl;
     cout << "Number of nodes: " << m.NumberOfNodes() << endl;
     m.AssignGlobalID(NODE);
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 Problem::~Problem()
 {
-    printf("\n+=========================\n");
-    printf("| T_assemble = %lf\n", times[T_ASSEMBLE]);
-    printf("| T_precond  = %lf\n", times[T_PRECOND]);
-    printf("| T_solve    = %lf\n", times[T_SOLVE]);
-    printf("| T_IO       = %lf\n", times[T_IO]);
-    printf("| T_update   = %lf\n", times[T_UPDATE]);
-    printf("| T_init     = %lf\n", times[T_INIT]);
-    printf("+-------------------------\n");
-    printf("| T_total    = %lf\n", Timer() - ttt);
-    printf("+=========================\n");
+    prof.report(m, "stats");
 }
 
 void Problem::initProblem()
@@ -152,11 +165,21 @@ void Problem::initProblem()
 
     Automatizator::MakeCurrent(&aut);
 
-    INMOST_DATA_ENUM_TYPE indP = 0, indU = 0;
-    indP = aut.RegisterTag(tagSol, CELL);
-    indU = aut.RegisterTag(tagFlux, FACE);
-    varP = dynamic_variable(aut, indP);
-    varU = dynamic_variable(aut, indU);
+    if(useHybrid){
+        // Unknowns are face pressures of interior faces only
+        tagLam = m.CreateTag(tagNameLambda, DATA_REAL, FACE, NONE, 1);
+        mrkBndFace = m.CreateMarker();
+        m.MarkBoundaryFaces(mrkBndFace);
+        INMOST_DATA_ENUM_TYPE indL = aut.RegisterTag(tagLam, FACE, mrkBndFace, true);
+        varL = dynamic_variable(aut, indL);
+    }
+    else{
+        INMOST_DATA_ENUM_TYPE indP = 0, indU = 0;
+        indP = aut.RegisterTag(tagSol, CELL);
+        indU = aut.RegisterTag(tagFlux, FACE);
+        varP = dynamic_variable(aut, indP);
+        varU = dynamic_variable(aut, indU);
+    }
     aut.EnumerateEntries();
     R = Residual("mfd_diffusion", aut.GetFirstIndex(), aut.GetLastIndex());
 
@@ -179,34 +202,91 @@ void Problem::initProblem()
     // Set boundary conditions
     // Compute RHS and exact solution
 
-    times[T_INIT] += Timer() - t;
+    // Cell loops follow the cell order, unknowns enumerated by Automatizator
+    // are renumbered for the solver
+    reorderElements(m, CELL, reorder, cellOrder);
+    if(cellOrder.empty())
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            cellOrder.push_back(icell->GetHandle());
+    if(reorder != REORDER_NONE){
+        // Unknowns of a cell and its faces are numbered together
+        vector<INMOST_DATA_ENUM_TYPE> unknowns;
+        for(size_t k = 0; k < cellOrder.size(); k++){
+            Cell cell(&m, cellOrder[k]);
+            if(!useHybrid)
+                unknowns.push_back(varP.Index(cell));
+            ElementArray<Face> faces = cell.getFaces();
+            for(unsigned i = 0; i < faces.size(); i++){
+                if(!useHybrid)
+                    unknowns.push_back(varU.Index(faces[i]));
+                else if(!faces[i].GetMarker(mrkBndFace))
+                    unknowns.push_back(varL.Index(faces[i]));
+            }
+        }
+        perm.build(aut.GetFirstIndex(), aut.GetLastIndex(), unknowns);
+    }
+    prof.add(T_INIT, Timer() - t);
 }
 
 void Problem::assembleGlobalSystem()
 {
     double t = Timer();
-    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-        if(icell->GetStatus() == Element::Ghost)
-            continue;
-        Cell cell = icell->getAsCell();
-        auto faces = cell.getFaces();
-        unsigned nf = static_cast<unsigned>(faces.size());
+    if(useColoring){
+        // Cells of one color share no faces and are assembled concurrently
+        if(colors.empty())
+            colorCells(m, FACE, colors, &cellOrder);
+        for(unsigned c = 0; c < colors.size(); c++){
+#if defined(USE_OMP)
+#pragma omp parallel for
+#endif
+            for(int k = 0; k < static_cast<int>(colors[c].size()); k++){
+                Cell cell(&m, colors[c][k]);
+                if(cell.GetStatus() != Element::Ghost)
+                    assembleCell(cell);
+            }
+        }
+    }
+    else{
+        for(size_t k = 0; k < cellOrder.size(); k++){
+            Cell cell(&m, cellOrder[k]);
+            if(cell.GetStatus() != Element::Ghost)
+                assembleCell(cell);
+        }
+    }
 
-        // nf x nf matrix defining flux inner product
-        rMatrix MF;
-        assembleLocalSystem(cell, MF);
+    for(auto iface = m.BeginFace(); iface != m.EndFace(); iface++){
+        Face f = iface->getAsFace();
+        //R[varU.Index(f)] += varU(f);// - exactFlux(f);
+    }
+    prof.add(T_ASSEMBLE, Timer() - t);
+}
+
+// Add contribution of one cell to global system
+void Problem::assembleCell(Cell &cell)
+{
+    if(useHybrid){
+        assembleCellHybrid(cell);
+        return;
+    }
+    LinearResidual LR(R, useNumeric);
+    auto faces = cell.getFaces();
+    unsigned nf = static_cast<unsigned>(faces.size());
+
+    // nf x nf matrix defining flux inner product
+    rMatrix MF;
+    assembleLocalSystem(cell, MF);
 //        MF.Zero();
 //        for(unsigned i = 0; i < nf; i++)
 //            MF(i,i) = cell.Volume();
 
-        // Equations for flux: div_h u_h = 0 - assigned to cells
-        int x = 0;
-        for(auto f = faces.begin(); f != faces.end(); f++){
-            double a = cell == f->FrontCell() ? -1. : 1.;
-            a *= f->Area() / cell.Volume();
-            R[varP.Index(cell)] += a * varU(f->getAsFace());
-            x++;
-        }
+    // Equations for flux: div_h u_h = 0 - assigned to cells
+    int x = 0;
+    for(auto f = faces.begin(); f != faces.end(); f++){
+        double a = cell == f->FrontCell() ? -1. : 1.;
+        a *= f->Area() / cell.Volume();
+        LR.add(varP.Index(cell), a, varU, f->getAsFace());
+        x++;
+    }
 //        if(x != 4 || nf != 4){
 //            cout << "x = " << x << endl;
 //        }
@@ -214,35 +294,36 @@ void Problem::assembleGlobalSystem()
 //        cell.Barycenter(xP);
 //        R[varP.Index(cell)] = varP(cell) - exactSolution(xP);
 
-        // Equations for pressure ~grad_h * [p Lambda] = 0 - assigned to faces
-        Matrix<variable> res(nf,1);
-        bool bnd = false;
-        for(unsigned i = 0; i < nf; i++){
-            Face f = faces[i];
-            if(f.Boundary())
-                bnd = true;
-            double a = (cell == f->FrontCell() ? -1. : 1.);
-            a *= f.Area();// / cell.Volume();
-            double lam = 0.0;
-            if(f.Boundary()){
-                double x[2];
-                f.Barycenter(x);
-                lam = exactSolution(x);
-                //cout << "lam = " << lam << endl;
-            }
-            res(i,0) = a * (varP(cell) - lam);
+    // Equations for pressure ~grad_h * [p Lambda] = 0 - assigned to faces
+    // res(i,0) = sgn(i,0) * (p - lam(i,0))
+    rMatrix sgn(nf,1), lam(nf,1);
+    bool bnd = false;
+    for(unsigned i = 0; i < nf; i++){
+        Face f = faces[i];
+        if(f.Boundary())
+            bnd = true;
+        double a = (cell == f->FrontCell() ? -1. : 1.);
+        a *= f.Area();// / cell.Volume();
+        lam(i,0) = 0.0;
+        if(f.Boundary()){
+            double x[2];
+            f.Barycenter(x);
+            lam(i,0) = exactSolution(x);
+            //cout << "lam = " << lam(i,0) << endl;
         }
-        //if(!bnd)
-        //    res = -MF.Invert() * res;
-        //else
-        //    res *= cell.Volume();
+        sgn(i,0) = a;
+    }
+    //if(!bnd)
+    //    res = -MF.Invert() * res;
+    //else
+    //    res *= cell.Volume();
 
 //        res.Print();
 //        exit(1);
 
-        // res contains action of local derived
-        // gradient operator
-        // on faces
+    // res contains action of local derived
+    // gradient operator
+    // on faces
 
 //        for(unsigned i = 0; i < nf; i++){
 //            Face f = faces[i];
@@ -256,27 +337,130 @@ void Problem::assembleGlobalSystem()
 
 
 
-        // NEW formulartion
-        Matrix<variable> uc(nf,1);
-        for(unsigned i = 0; i < nf; i++){
-            Face f = faces[i];
-            uc(i,0) = varU(f);
+    // NEW formulartion: MF * u - res
+    for(unsigned i = 0; i < nf; i++){
+        Face f = faces[i];
+        INMOST_DATA_ENUM_TYPE row = varU.Index(f);
+        for(unsigned j = 0; j < nf; j++)
+            LR.add(row, MF(i,j), varU, faces[j]);
+        LR.add(row, -sgn(i,0), varP, cell);
+        LR.add(row, sgn(i,0) * lam(i,0));
+    }
+}
+
+// Hybridization: with outward fluxes u local system is
+//   M u = A (p - lam),   1^T A u = F,
+// where A = diag(|f|), lam are face pressures and F is source of the cell.
+// For Q = A M^-1 A, q = Q 1 and beta = 1^T q it gives
+//   p = (F + q^T lam) / beta,   A u = q p - Q lam,
+// so continuity of flux through face adds row of H = Q - q q^T / beta
+// from both of its cells. H is symmetric and positive semidefinite with kernel
+// of constants, which is removed by Dirichlet data on boundary faces.
+void Problem::hybridLocalSystem(Cell &cell, rMatrix &Q, rMatrix &q, double &beta)
+{
+    auto faces = cell.getFaces();
+    unsigned nf = static_cast<unsigned>(faces.size());
+
+    // MF acts on fluxes along face normals, change signs for outward fluxes
+    rMatrix MF;
+    assembleLocalSystem(cell, MF);
+    vector<double> sgn(nf);
+    for(unsigned i = 0; i < nf; i++)
+        sgn[i] = (cell == faces[i].FrontCell()) ? -1. : 1.;
+    for(unsigned i = 0; i < nf; i++)
+        for(unsigned j = 0; j < nf; j++)
+            MF(i,j) *= sgn[i] * sgn[j];
+    rMatrix W = MF.Invert();
+
+    Q.Resize(nf, nf);
+    q.Resize(nf, 1);
+    beta = 0.0;
+    for(unsigned i = 0; i < nf; i++){
+        q(i,0) = 0.0;
+        for(unsigned j = 0; j < nf; j++){
+            Q(i,j) = faces[i].Area() * W(i,j) * faces[j].Area();
+            q(i,0) += Q(i,j);
         }
-//        res.Print();
-//        exit(1);
-        uc = MF * uc - res;
-        //uc = uc - res;
-        for(unsigned i = 0; i < nf; i++){
-            Face f = faces[i];
-            R[varU.Index(f)] += uc(i,0);
+        beta += q(i,0);
+    }
+}
+
+// Rows of face pressures of interior faces of the cell
+void Problem::assembleCellHybrid(Cell &cell)
+{
+    LinearResidual LR(R, useNumeric);
+    auto faces = cell.getFaces();
+    unsigned nf = static_cast<unsigned>(faces.size());
+
+    rMatrix Q, q;
+    double beta;
+    hybridLocalSystem(cell, Q, q, beta);
+
+    double xc[2];
+    cell.Barycenter(xc);
+    double F = exactSolutionRHS(xc) * cell.Volume();
+
+    // Face pressures on boundary are given by Dirichlet data
+    rMatrix lam(nf,1);
+    for(unsigned i = 0; i < nf; i++){
+        lam(i,0) = 0.0;
+        if(faces[i].GetMarker(mrkBndFace)){
+            double x[2];
+            faces[i].Barycenter(x);
+            lam(i,0) = exactSolution(x);
         }
     }
 
-    for(auto iface = m.BeginFace(); iface != m.EndFace(); iface++){
-        Face f = iface->getAsFace();
-        //R[varU.Index(f)] += varU(f);// - exactFlux(f);
+    for(unsigned i = 0; i < nf; i++){
+        if(faces[i].GetMarker(mrkBndFace))
+            continue;
+        INMOST_DATA_ENUM_TYPE row = varL.Index(faces[i]);
+        for(unsigned j = 0; j < nf; j++){
+            double h = Q(i,j) - q(i,0) * q(j,0) / beta;
+            if(faces[j].GetMarker(mrkBndFace))
+                LR.add(row, h * lam(j,0));
+            else
+                LR.add(row, h, varL, faces[j]);
+        }
+        LR.add(row, -q(i,0) * F / beta);
+    }
+}
+
+// Cell pressure and fluxes (along face normals) from face pressures
+void Problem::recoverCell(Cell &cell)
+{
+    auto faces = cell.getFaces();
+    unsigned nf = static_cast<unsigned>(faces.size());
+
+    rMatrix Q, q;
+    double beta;
+    hybridLocalSystem(cell, Q, q, beta);
+
+    double xc[2];
+    cell.Barycenter(xc);
+    double p = exactSolutionRHS(xc) * cell.Volume();
+
+    rMatrix lam(nf,1);
+    for(unsigned i = 0; i < nf; i++){
+        if(faces[i].GetMarker(mrkBndFace)){
+            double x[2];
+            faces[i].Barycenter(x);
+            lam(i,0) = exactSolution(x);
+        }
+        else
+            lam(i,0) = faces[i].Real(tagLam);
+        p += q(i,0) * lam(i,0);
+    }
+    p /= beta;
+    cell.Real(tagSol) = p;
+
+    for(unsigned i = 0; i < nf; i++){
+        double Au = q(i,0) * p;
+        for(unsigned j = 0; j < nf; j++)
+            Au -= Q(i,j) * lam(j,0);
+        double a = (cell == faces[i].FrontCell()) ? -1. : 1.;
+        faces[i].Real(tagFlux) = a * Au / faces[i].Area();
     }
-    times[T_ASSEMBLE] += Timer() - t;
 }
 
 void Problem::assembleLocalSystem(Cell &cell, rMatrix &MF)
@@ -378,7 +562,7 @@ rMatrix Problem::integrateRHS(Cell &cell)
 
 void Problem::solveSystem()
 {
-    Solver S("inner_mptiluc");
+    Solver S(solverOpt.type, solverOpt.prefix);
     S.SetParameter("maximum_iterations", "10000");
     double t = Timer();
 
@@ -405,9 +589,12 @@ void Problem::solveSystem()
 //    oo.close();
 //    printf("Average nnz per row: %lf\n", nnz/N);
 
-    S.SetMatrix(J);
+    perm.setMatrix(S, J);
+    if(!perm.empty())
+        cout << "Matrix bandwidth: " << matrixBandwidth(J) << " -> "
+             << matrixBandwidth(perm.getMatrix()) << " after reordering" << endl;
     //R.GetResidual().Save("J.mtx");
-    times[T_PRECOND] += Timer() - t;
+    prof.add(T_PRECOND, Timer() - t);
     Sparse::Vector sol;
     sol.SetInterval(aut.GetFirstIndex(), aut.GetLastIndex());
     for(unsigned i = 0; i < sol.Size(); i++){
@@ -415,53 +602,110 @@ void Problem::solveSystem()
     }
     printf("System size is %d\n", (sol.Size()));
     t = Timer();
-    bool solved = S.Solve(R.GetResidual(), sol);
-    times[T_SOLVE] += Timer() - t;
+    bool solved = perm.solve(S, R.GetResidual(), sol);
+    prof.add(T_SOLVE, Timer() - t);
     if(!solved){
         cout << "Linear solver failed: " << S.GetReason() << endl;
         cout << "Residual: " << S.Residual() << endl;
         exit(1);
     }
     cout << "Linear solver iterations: " << S.Iterations() << endl;
+    prof.count("linear_iterations", S.Iterations());
 
     t = Timer();
+    if(useHybrid){
+        // Update face pressures, then cell pressures and fluxes independently by cells
+        for(auto iface = m.BeginFace(); iface != m.EndFace(); iface++){
+            Face f = iface->getAsFace();
+            if(!f.GetMarker(mrkBndFace))
+                f.Real(tagLam) -= sol[varL.Index(f)];
+        }
+        for(size_t k = 0; k < cellOrder.size(); k++){
+            Cell cell(&m, cellOrder[k]);
+            recoverCell(cell);
+        }
+    }
+    else{
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+            Cell c = icell->getAsCell();
+            c.Real(tagSol) -= sol[varP.Index(c)];
+        }
+        for(auto iface = m.BeginFace(); iface != m.EndFace(); iface++){
+            Face f = iface->getAsFace();
+            f.Real(tagFlux) -= sol[varU.Index(f)];
+        }
+    }
     double CnormP = 0.0, CnormQ = 0.0;
     for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
         Cell c = icell->getAsCell();
-        c.Real(tagSol) -= sol[varP.Index(c)];
         CnormP = max(CnormP, fabs(c.Real(tagSol)-c.Real(tagSolEx)));
     }
     for(auto iface = m.BeginFace(); iface != m.EndFace(); iface++){
         Face f = iface->getAsFace();
-        f.Real(tagFlux) -= sol[varU.Index(f)];
         CnormQ = max(CnormQ, fabs(f.Real(tagFlux)-exactFlux(f)));
         //printf("face %d: f = %e\n", f.LocalID(), f.Real(tagFlux));
     }
     cout << "|errP|_C = " << CnormP << endl;
     cout << "|errQ|_C = " << CnormQ << endl;
-    times[T_UPDATE] += Timer() - t;
+    prof.setValue("errP_C", CnormP);
+    prof.setValue("errQ_C", CnormQ);
+    prof.add(T_UPDATE, Timer() - t);
 }
 
 void Problem::saveSolution(string path)
 {
     double t = Timer();
+    deleteColoring(m);
     m.Save(path);
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2){
-        cout << "Usage: 2d_diffusion_mfd <mesh_file>" << endl;
+    if(argc < 2){
+        cout << "Usage: 2d_diffusion_mfd <mesh_file> [-colored] [-reorder rcm|sfc] [-numeric] [-hybrid] [-solver <type>] [-solver_db <file>]" << endl;
         return 1;
     }
 
-    Problem P(argv[1]);
-    P.initProblem();
-    P.assembleGlobalSystem();
-    P.solveSystem();
-    P.saveSolution("res.vtk");
+    bool colored = false, numeric = false, hybrid = false;
+    int reorder = REORDER_NONE;
+    SolverOptions solverOpt("inner_mptiluc");
+    for(int i = 2; i < argc; i++){
+        string opt(argv[i]);
+        if(opt == "-colored")
+            colored = true;
+        else if(opt == "-reorder" && i+1 < argc)
+            reorder = parseReorderMethod(argv[++i]);
+        else if(opt == "-numeric")
+            numeric = true;
+        else if(opt == "-hybrid")
+            hybrid = true;
+        else if(!solverOpt.parse(i, argc, argv)){
+            cout << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    Solver::Initialize(&argc, &argv, solverOpt.database.c_str());
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    Problem *P = new Problem(argv[1]);
+    P->setColoring(colored);
+    P->setReorder(reorder);
+    P->setNumeric(numeric);
+    P->setHybrid(hybrid);
+    P->setSolver(solverOpt);
+    P->initProblem();
+    P->assembleGlobalSystem();
+    P->solveSystem();
+    P->saveSolution("res.vtk");
+
+    delete P;
+
+    Partitioner::Finalize();
+    Solver::Finalize();
+    Mesh::Finalize();
 
     return 0;
 }
@@ -1,4 +1,10 @@
 #include "inmost.h"
+#include "coloring.h"
+#include "profiling.h"
+#include "solver_options.h"
+#include "linear_residual.h"
+#include "reordering.h"
+#include "shape_cache.h"
 
 //    !!!!!!! Currently NOT suited for parallel run
 //
@@ -26,15 +32,6 @@
 using namespace INMOST;
 using namespace std;
 
-enum{
-    T_ASSEMBLE = 0,
-    T_SOLVE,
-    T_PRECOND,
-    T_IO,
-    T_INIT,
-    T_UPDATE
-};
-
 const string tagNameTensor = "DIFFUSION_TENSOR";
 const string tagNameBC     = "BOUNDARY_CONDITION";
 const string tagNameRHS    = "RHS";
@@ -87,14 +84,33 @@ private:
 
     unsigned numDirNodes;
 
-    double times[10];
-    double ttt; // global timer
+    bool useColoring;     // assemble cells concurrently by colors
+    vector< vector<HandleType> > colors; // cells grouped by color
+
+    int reorder;          // ordering of cell loops, see reordering.h
+    vector<HandleType> cellOrder; // cells in assembly order
+    UnknownPermutation perm;      // unknowns in element order, empty without reordering
+
+    bool useNumeric;      // assemble linear residual without AD expressions
+
+    bool useShapeCache;   // reuse W for cells of the same shape
+    ShapeCache shapes;    // W of already met shapes
+
+    SolverOptions solverOpt; // type and parameters of linear solver
+
+    Profiler prof; // run-time statistics
 
 public:
     Problem(string meshName);
     ~Problem();
     void initProblem(); // create tags and set parameters
     void assembleGlobalSystem(); // assemble global linear system
+    void assembleCell(Cell &);    // add contribution of one cell
+    void setColoring(bool b) { useColoring = b; }
+    void setReorder(int r) { reorder = r; }
+    void setSolver(const SolverOptions &o) { solverOpt = o; }
+    void setNumeric(bool b) { useNumeric = b; }
+    void setShapeCache(bool b) { useShapeCache = b; }
     rMatrix computeW(Cell &);
     rMatrix integrateRHS(Cell &);
     void assembleLocalSystem(Cell &, rMatrix &, rMatrix &);
@@ -104,9 +120,10 @@ public:
 
 Problem::Problem(string meshName)
 {
-    ttt = Timer();
-    for(int i = 0; i < 10; i++)
-        times[i] = 0.;
+    useColoring = false;
+    reorder = REORDER_NONE;
+    useNumeric = false;
+    useShapeCache = false;
 
     rank = m.GetProcessorRank();
 
@@ -118,21 +135,12 @@ Problem::Problem(string meshName)
         cout << "Number of edges: " << m.NumberOfEdges() << endl;
         cout << "Number of nodes: " << m.NumberOfNodes() << endl;
     }
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 Problem::~Problem()
 {
-    printf("\n+=========================\n");
-    printf("| T_assemble = %lf\n", times[T_ASSEMBLE]);
-    printf("| T_precond  = %lf\n", times[T_PRECOND]);
-    printf("| T_solve    = %lf\n", times[T_SOLVE]);
-    printf("| T_IO       = %lf\n", times[T_IO]);
-    printf("| T_update   = %lf\n", times[T_UPDATE]);
-    printf("| T_init     = %lf\n", times[T_INIT]);
-    printf("+-------------------------\n");
-    printf("| T_total    = %lf\n", Timer() - ttt);
-    printf("+=========================\n");
+    prof.report(m, "stats");
 }
 
 void Problem::initProblem()
@@ -189,45 +197,90 @@ void Problem::initProblem()
     var = dynamic_variable(aut, SolTagEntryIndex);
     aut.EnumerateEntries();
     R = Residual("fem_diffusion", aut.GetFirstIndex(), aut.GetLastIndex());
-    times[T_INIT] += Timer() - t;
+
+    // Cell loops follow the cell order, unknowns enumerated by Automatizator
+    // are renumbered for the solver
+    reorderElements(m, CELL, reorder, cellOrder);
+    if(cellOrder.empty())
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            cellOrder.push_back(icell->GetHandle());
+    if(reorder != REORDER_NONE){
+        vector<HandleType> nodeOrder;
+        reorderElements(m, NODE, reorder, nodeOrder);
+        vector<INMOST_DATA_ENUM_TYPE> unknowns;
+        for(size_t k = 0; k < nodeOrder.size(); k++){
+            Node node(&m, nodeOrder[k]);
+            if(node.GetMarker(mrkUnknwn))
+                unknowns.push_back(var.Index(node));
+        }
+        perm.build(aut.GetFirstIndex(), aut.GetLastIndex(), unknowns);
+    }
+    prof.add(T_INIT, Timer() - t);
 }
 
 void Problem::assembleGlobalSystem()
 {
     double t = Timer();
-    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-        if(icell->GetStatus() == Element::Ghost)
-            continue;
-        Cell cell = icell->getAsCell();
-
-        ElementArray<Node> nodes = icell->getNodes();
-        rMatrix rhs, W;
-        assembleLocalSystem(cell, W, rhs);
-
-        auto nnodes = nodes.size();
-
-        for(unsigned i = 0; i != nnodes; i++){
-            if(nodes[i]->GetMarker(mrkDirNode)){
-                double bcVal = nodes[i].Real(tagBC);
-                for(unsigned j = 0; j != nnodes; j++)
-                    if(!nodes[j].GetMarker(mrkDirNode)){
-                        R[var.Index(nodes[j])] += bcVal * W(j,i);
-                    }
-            }
-            else{
-                // Node with unknown
-                for(unsigned j = 0; j != nnodes; j++)
-                    if(!nodes[j].GetMarker(mrkDirNode))
-                        R[var.Index(nodes[i])] += W(j,i) * var(nodes[j]);
-                R[var.Index(nodes[i])] -= rhs(i,0);
+    if(useColoring){
+        // Cells of one color share no nodes and are assembled concurrently
+        if(colors.empty())
+            colorCells(m, NODE, colors, &cellOrder);
+        for(unsigned c = 0; c < colors.size(); c++){
+#if defined(USE_OMP)
+#pragma omp parallel for
+#endif
+            for(int k = 0; k < static_cast<int>(colors[c].size()); k++){
+                Cell cell(&m, colors[c][k]);
+                if(cell.GetStatus() != Element::Ghost)
+                    assembleCell(cell);
             }
         }
     }
-    times[T_ASSEMBLE] += Timer() - t;
+    else{
+        for(size_t k = 0; k < cellOrder.size(); k++){
+            Cell cell(&m, cellOrder[k]);
+            if(cell.GetStatus() != Element::Ghost)
+                assembleCell(cell);
+        }
+    }
+    prof.add(T_ASSEMBLE, Timer() - t);
+    if(useShapeCache){
+        cout << "Shape cache: " << shapes.numShapes() << " shapes, "
+             << shapes.numHits() << " hits, " << shapes.numMisses() << " misses" << endl;
+        prof.setValue("shapes", shapes.numShapes());
+    }
+}
+
+// Add contribution of one cell to global system
+void Problem::assembleCell(Cell &cell)
+{
+    LinearResidual LR(R, useNumeric);
+    ElementArray<Node> nodes = cell.getNodes();
+    rMatrix rhs, W;
+    assembleLocalSystem(cell, W, rhs);
+
+    auto nnodes = nodes.size();
+
+    for(unsigned i = 0; i != nnodes; i++){
+        if(nodes[i]->GetMarker(mrkDirNode)){
+            double bcVal = nodes[i].Real(tagBC);
+            for(unsigned j = 0; j != nnodes; j++)
+                if(!nodes[j].GetMarker(mrkDirNode)){
+                    LR.add(var.Index(nodes[j]), bcVal * W(j,i));
+                }
+        }
+        else{
+            // Node with unknown
+            for(unsigned j = 0; j != nnodes; j++)
+                if(!nodes[j].GetMarker(mrkDirNode))
+                    LR.add(var.Index(nodes[i]), W(j,i), var, nodes[j]);
+            LR.add(var.Index(nodes[i]), -rhs(i,0));
+        }
+    }
 }
 
 
-void Problem::assembleLocalSystem(Cell &cell, rMatrix &W, rMatrix &b)
+rMatrix Problem::computeW(Cell &cell)
 {
     auto nodes = cell.getNodes();
     auto faces = cell.getFaces();
@@ -302,20 +355,47 @@ void Problem::assembleLocalSystem(Cell &cell, rMatrix &W, rMatrix &b)
     rMatrix G = B*D;
     for(unsigned i = 0; i < G.Cols(); i++)
         G(0,i) = 0;
-    W = Proj.Transpose() * G * Proj + Se;
+    rMatrix W = Proj.Transpose() * G * Proj + Se;
 
     //W.Print();
     //exit(1);
-    b = rMatrix(nn,1);
+    return W;
+}
+
+rMatrix Problem::integrateRHS(Cell &cell)
+{
+    double xc[2];
+    cell.Centroid(xc);
+    unsigned nn = static_cast<unsigned>(cell.nbAdjElements(NODE));
+    rMatrix b(nn,1);
     double rhs = exactSolutionRHS(xc) * cell.Volume() / nn;
     for(unsigned i = 0; i < nn; i++){
         b(i,0) = rhs;
     }
+    return b;
+}
+
+void Problem::assembleLocalSystem(Cell &cell, rMatrix &W, rMatrix &b)
+{
+    if(useShapeCache){
+        ElementArray<Node> nodes = cell.getNodes();
+        int nn = static_cast<int>(nodes.size());
+        ShapeCache::Key key;
+        shapes.makeKey(nodes, nn, 2, cell.RealArray(tagD).data(), 3, key);
+        W.Resize(nn, nn);
+        if(!shapes.find(key, W.data(), nn*nn)){
+            W = computeW(cell);
+            shapes.insert(key, W.data(), nn*nn);
+        }
+    }
+    else
+        W = computeW(cell);
+    b = integrateRHS(cell);
 }
 
 void Problem::solveSystem()
 {
-    Solver S("inner_mptiluc");
+    Solver S(solverOpt.type, solverOpt.prefix);
     S.SetParameter("relative_tolerance", "1e-10");
     S.SetParameter("absolute_tolerance", "1e-13");
     double t = Timer();
@@ -343,8 +423,11 @@ void Problem::solveSystem()
 //    oo.close();
 //    printf("Average nnz per row: %lf\n", nnz/N);
 
-    S.SetMatrix(J);
-    times[T_PRECOND] += Timer() - t;
+    perm.setMatrix(S, J);
+    if(!perm.empty())
+        cout << "Matrix bandwidth: " << matrixBandwidth(J) << " -> "
+             << matrixBandwidth(perm.getMatrix()) << " after reordering" << endl;
+    prof.add(T_PRECOND, Timer() - t);
     Sparse::Vector sol;
     sol.SetInterval(aut.GetFirstIndex(), aut.GetLastIndex());
     for(unsigned i = 0; i < sol.Size(); i++){
@@ -352,14 +435,15 @@ void Problem::solveSystem()
         //printf("b[%d] = %e\n", i, R.GetResidual()[i]);
     }
     t = Timer();
-    bool solved = S.Solve(R.GetResidual(), sol);
-    times[T_SOLVE] += Timer() - t;
+    bool solved = perm.solve(S, R.GetResidual(), sol);
+    prof.add(T_SOLVE, Timer() - t);
     if(!solved){
         cout << "Linear solver failed: " << S.GetReason() << endl;
         cout << "Residual: " << S.Residual() << endl;
         exit(1);
     }
     cout << "Linear solver iterations: " << S.Iterations() << endl;
+    prof.count("linear_iterations", S.Iterations());
 
     t = Timer();
     double Cnorm = 0.0;
@@ -371,29 +455,64 @@ void Problem::solveSystem()
         Cnorm = max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
     }
     cout << "|err|_C = " << Cnorm << endl;
-    times[T_UPDATE] += Timer() - t;
+    prof.setValue("err_C", Cnorm);
+    prof.add(T_UPDATE, Timer() - t);
 }
 
 void Problem::saveSolution(string path)
 {
     double t = Timer();
+    deleteColoring(m);
     m.Save(path);
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2){
-        cout << "Usage: 2d_diffusion_vem <mesh_file>" << endl;
+    if(argc < 2){
+        cout << "Usage: 2d_diffusion_vem <mesh_file> [-colored] [-reorder rcm|sfc] [-shape_cache] [-numeric] [-solver <type>] [-solver_db <file>]" << endl;
         return 1;
     }
 
-    Problem P(argv[1]);
-    P.initProblem();
-    P.assembleGlobalSystem();
-    P.solveSystem();
-    P.saveSolution("res.vtk");
+    bool colored = false, numeric = false, shapeCache = false;
+    int reorder = REORDER_NONE;
+    SolverOptions solverOpt("inner_mptiluc");
+    for(int i = 2; i < argc; i++){
+        string opt(argv[i]);
+        if(opt == "-colored")
+            colored = true;
+        else if(opt == "-reorder" && i+1 < argc)
+            reorder = parseReorderMethod(argv[++i]);
+        else if(opt == "-numeric")
+            numeric = true;
+        else if(opt == "-shape_cache")
+            shapeCache = true;
+        else if(!solverOpt.parse(i, argc, argv)){
+            cout << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    Solver::Initialize(&argc, &argv, solverOpt.database.c_str());
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    Problem *P = new Problem(argv[1]);
+    P->setColoring(colored);
+    P->setReorder(reorder);
+    P->setNumeric(numeric);
+    P->setShapeCache(shapeCache);
+    P->setSolver(solverOpt);
+    P->initProblem();
+    P->assembleGlobalSystem();
+    P->solveSystem();
+    P->saveSolution("res.vtk");
+
+    delete P;
+
+    Partitioner::Finalize();
+    Solver::Finalize();
+    Mesh::Finalize();
 
     return 0;
 }
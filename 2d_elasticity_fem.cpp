@@ -1,4 +1,11 @@
 #include "inmost.h"
+#include "coloring.h"
+#include "fixed_matrix.h"
+#include "profiling.h"
+#include "solver_options.h"
+#include "linear_residual.h"
+#include "block_sparse.h"
+#include "reordering.h"
 
 //    !!!!!!! Currently NOT suited for parallel run
 //
@@ -36,15 +43,6 @@
 using namespace INMOST;
 using namespace std;
 
-enum{
-    T_ASSEMBLE = 0,
-    T_SOLVE,
-    T_PRECOND,
-    T_IO,
-    T_INIT,
-    T_UPDATE
-};
-
 const string tagNameTensor = "ELASTIC_TENSOR";
 const string tagNameBC     = "BOUNDARY_CONDITION";
 const string tagNameRHS    = "RHS";
@@ -91,24 +89,51 @@ private:
 
     unsigned numDirNodes;
 
-    double times[10];
-    double ttt; // global timer
+    bool useColoring;     // assemble cells concurrently by colors
+    vector< vector<HandleType> > colors; // cells grouped by color
+
+    int reorder;          // ordering of cells and block rows, see reordering.h
+    vector<HandleType> cellOrder; // cells in assembly order
+    vector<HandleType> nodeOrder; // order of block rows, empty for LocalID order
+    UnknownPermutation perm;      // unknowns in node order, empty without reordering
+
+    bool useNumeric;      // assemble linear residual without AD expressions
+
+    bool useBlock;        // assemble and solve with 2x2 node blocks
+    BSRMatrix<2> blockA;
+    vector<double> blockRHS;
+    vector<int> blockRow; // block row of node by LocalID, -1 for Dirichlet nodes
+    vector<int> blockPos; // positions of 3x3 blocks of each cell in blockA
+
+    SolverOptions solverOpt; // type and parameters of linear solver
+
+    Profiler prof; // run-time statistics
 
 public:
     Problem(string meshName);
     ~Problem();
     void initProblem(); // create tags and set parameters
     void assembleGlobalSystem(); // assemble global linear system
-    void assembleLocalSystem(Cell &, rMatrix &, rMatrix &);
+    void assembleCell(Cell &);    // add contribution of one cell
+    void setColoring(bool b) { useColoring = b; }
+    void setReorder(int r) { reorder = r; }
+    void setSolver(const SolverOptions &o) { solverOpt = o; }
+    void setNumeric(bool b) { useNumeric = b; }
+    void setBlock(bool b) { useBlock = b; }
+    void buildBlockPattern();      // numbering of block rows and pattern of blockA
+    void assembleCellBlock(Cell &); // add contribution of one cell to blockA
+    void assembleLocalSystem(Cell &, fMatrix<6,6> &, fMatrix<6,1> &);
     void solveSystem();
+    void solveBlockSystem();
     void saveSolution(string path); // save mesh with solution
 };
 
 Problem::Problem(string meshName)
 {
-    ttt = Timer();
-    for(int i = 0; i < 10; i++)
-        times[i] = 0.;
+    useColoring = false;
+    reorder = REORDER_NONE;
+    useNumeric = false;
+    useBlock = false;
 
     double t = Timer();
     m.Load(meshName);
@@ -117,21 +142,12 @@ Problem::Problem(string meshName)
     cout << "Number of edges: " << m.NumberOfEdges() << endl;
     cout << "Number of nodes: " << m.NumberOfNodes() << endl;
     m.AssignGlobalID(NODE);
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 Problem::~Problem()
 {
-    printf("\n+=========================\n");
-    printf("| T_assemble = %lf\n", times[T_ASSEMBLE]);
-    printf("| T_precond  = %lf\n", times[T_PRECOND]);
-    printf("| T_solve    = %lf\n", times[T_SOLVE]);
-    printf("| T_IO       = %lf\n", times[T_IO]);
-    printf("| T_update   = %lf\n", times[T_UPDATE]);
-    printf("| T_init     = %lf\n", times[T_INIT]);
-    printf("+-------------------------\n");
-    printf("| T_total    = %lf\n", Timer() - ttt);
-    printf("+=========================\n");
+    prof.report(m, "stats");
 }
 
 void Problem::initProblem()
@@ -212,68 +228,218 @@ void Problem::initProblem()
     aut.EnumerateEntries();
     R = Residual("fem_elasticity", aut.GetFirstIndex(), aut.GetLastIndex());
 
-    times[T_INIT] += Timer() - t;
+    // Cell loops follow the cell order, block rows of BSR matrix follow
+    // node order, unknowns enumerated by Automatizator are renumbered
+    // in node order for the solver with Ux and Uy of a node adjacent
+    reorderElements(m, CELL, reorder, cellOrder);
+    if(cellOrder.empty())
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            cellOrder.push_back(icell->GetHandle());
+    reorderElements(m, NODE, reorder, nodeOrder);
+    if(!nodeOrder.empty()){
+        vector<INMOST_DATA_ENUM_TYPE> unknowns;
+        for(size_t k = 0; k < nodeOrder.size(); k++){
+            Node node(&m, nodeOrder[k]);
+            if(!node.GetMarker(mrkUnknwn))
+                continue;
+            unknowns.push_back(Ux.Index(node));
+            unknowns.push_back(Uy.Index(node));
+        }
+        perm.build(aut.GetFirstIndex(), aut.GetLastIndex(), unknowns);
+    }
+
+    prof.add(T_INIT, Timer() - t);
     m.Save("init.vtk");
 }
 
 void Problem::assembleGlobalSystem()
 {
     double t = Timer();
-    R.Clear();
+    if(useBlock){
+        if(blockPos.empty())
+            buildBlockPattern();
+        blockA.zero();
+        fill(blockRHS.begin(), blockRHS.end(), 0.);
+    }
+    else
+        R.Clear();
+    if(useColoring){
+        // Cells of one color share no nodes and are assembled concurrently
+        if(colors.empty())
+            colorCells(m, NODE, colors, &cellOrder);
+        for(unsigned c = 0; c < colors.size(); c++){
+#if defined(USE_OMP)
+#pragma omp parallel for
+#endif
+            for(int k = 0; k < static_cast<int>(colors[c].size()); k++){
+                Cell cell(&m, colors[c][k]);
+                if(cell.GetStatus() != Element::Ghost)
+                    assembleCell(cell);
+            }
+        }
+    }
+    else{
+        for(size_t k = 0; k < cellOrder.size(); k++){
+            Cell cell(&m, cellOrder[k]);
+            if(cell.GetStatus() != Element::Ghost)
+                assembleCell(cell);
+        }
+    }
+    prof.add(T_ASSEMBLE, Timer() - t);
+}
+
+void Problem::buildBlockPattern()
+{
+    // Nodes with unknowns are numbered in node order or in order of LocalID
+    blockRow.assign(m.NodeLastLocalID(), -1);
+    int nb = 0;
+    if(!nodeOrder.empty()){
+        for(size_t k = 0; k < nodeOrder.size(); k++){
+            Node node(&m, nodeOrder[k]);
+            if(node.GetMarker(mrkUnknwn))
+                blockRow[node.LocalID()] = nb++;
+        }
+    }
+    else
+        for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++)
+            if(inode->GetMarker(mrkUnknwn))
+                blockRow[inode->LocalID()] = nb++;
+
+    // Block row of a node contains all nodes with unknowns of its adjacent cells
+    vector< vector<int> > cols(nb);
     for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
         if(icell->GetStatus() == Element::Ghost)
             continue;
-        Cell cell = icell->getAsCell();
-
-        //printf("cell %d, vol = %e\n", cell.LocalID(), cell.Volume());
-
         ElementArray<Node> nodes = icell->getNodes();
-        rMatrix W(6,6);
-        rMatrix rhs(6,1);
-        assembleLocalSystem(cell, W, rhs);
+        for(int i = 0; i < 3; i++){
+            int bi = blockRow[nodes[i].LocalID()];
+            if(bi < 0)
+                continue;
+            for(int j = 0; j < 3; j++){
+                int bj = blockRow[nodes[j].LocalID()];
+                if(bj >= 0)
+                    cols[bi].push_back(bj);
+            }
+        }
+    }
+    for(int i = 0; i < nb; i++){
+        sort(cols[i].begin(), cols[i].end());
+        cols[i].erase(unique(cols[i].begin(), cols[i].end()), cols[i].end());
+    }
+    blockA.setPattern(cols);
+    blockRHS.assign(2*nb, 0.);
 
-        if(!W.isSymmetric()){
-            printf("Nonsymm W\n");
-            exit(1);
+    blockPos.assign(9*m.CellLastLocalID(), -1);
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        if(icell->GetStatus() == Element::Ghost)
+            continue;
+        ElementArray<Node> nodes = icell->getNodes();
+        int *pos = &blockPos[9*icell->LocalID()];
+        for(int i = 0; i < 3; i++){
+            int bi = blockRow[nodes[i].LocalID()];
+            for(int j = 0; j < 3; j++){
+                int bj = blockRow[nodes[j].LocalID()];
+                if(bi >= 0 && bj >= 0)
+                    pos[3*i+j] = blockA.find(bi, bj);
+            }
         }
+    }
+    cout << "Block matrix: " << nb << " block rows, " << blockA.numBlocks()
+         << " blocks, " << blockA.memory()/1024 << " kB" << endl;
+}
 
-        if(nodes[0].GetMarker(mrkDirNode)){
-            // There's no row corresponding to nodes[0]
-
-            // Displacements in boundary node nodes[0]
-            double bcValX = nodes[0].RealArray(tagBC)[0];
-            double bcValY = nodes[0].RealArray(tagBC)[1];
-            // If nodes[1] is not Dirichlet node,
-            // add corresponding part to its equations
-            if(!nodes[1].GetMarker(mrkDirNode)){
-                R[Ux.Index(nodes[1])] += bcValX * W(2,0);
-                R[Ux.Index(nodes[1])] += bcValY * W(2,1);
-                R[Uy.Index(nodes[1])] += bcValX * W(3,0);
-                R[Uy.Index(nodes[1])] += bcValY * W(3,1);
+// Add contribution of one cell to block system:
+// block (i,j) of W couples displacements of nodes i and j
+void Problem::assembleCellBlock(Cell &cell)
+{
+    ElementArray<Node> nodes = cell.getNodes();
+    fMatrix<6,6> W;
+    fMatrix<6,1> rhs;
+    assembleLocalSystem(cell, W, rhs);
+
+    const int *pos = &blockPos[9*cell.LocalID()];
+    for(int i = 0; i < 3; i++){
+        int bi = blockRow[nodes[i].LocalID()];
+        if(bi < 0)
+            continue;
+        double *b = &blockRHS[2*bi];
+        b[0] += rhs(2*i,0);
+        b[1] += rhs(2*i+1,0);
+        for(int j = 0; j < 3; j++){
+            if(nodes[j].GetMarker(mrkDirNode)){
+                // Known displacement goes to right-hand side
+                double bcValX = nodes[j].RealArray(tagBC)[0];
+                double bcValY = nodes[j].RealArray(tagBC)[1];
+                for(int r = 0; r < 2; r++)
+                    b[r] -= W(2*i+r,2*j) * bcValX + W(2*i+r,2*j+1) * bcValY;
             }
-            if(!nodes[2].GetMarker(mrkDirNode)){
-                R[Ux.Index(nodes[2])] += bcValX * W(4,0);
-                R[Ux.Index(nodes[2])] += bcValY * W(4,1);
-                R[Uy.Index(nodes[2])] += bcValX * W(5,0);
-                R[Uy.Index(nodes[2])] += bcValY * W(5,1);
+            else{
+                double *a = blockA.block(pos[3*i+j]);
+                for(int r = 0; r < 2; r++)
+                    for(int c = 0; c < 2; c++)
+                        a[2*r+c] += W(2*i+r,2*j+c);
             }
         }
-        else{
-            R[Ux.Index(nodes[0])] += W(0,0)*Ux(nodes[0]);
-            R[Ux.Index(nodes[0])] += W(0,1)*Uy(nodes[0]);
-            R[Ux.Index(nodes[0])] += W(0,2)*Ux(nodes[1]);
-            R[Ux.Index(nodes[0])] += W(0,3)*Uy(nodes[1]);
-            R[Ux.Index(nodes[0])] += W(0,4)*Ux(nodes[2]);
-            R[Ux.Index(nodes[0])] += W(0,5)*Uy(nodes[2]);
-            R[Uy.Index(nodes[0])] += W(1,0)*Ux(nodes[0]);
-            R[Uy.Index(nodes[0])] += W(1,1)*Uy(nodes[0]);
-            R[Uy.Index(nodes[0])] += W(1,2)*Ux(nodes[1]);
-            R[Uy.Index(nodes[0])] += W(1,3)*Uy(nodes[1]);
-            R[Uy.Index(nodes[0])] += W(1,4)*Ux(nodes[2]);
-            R[Uy.Index(nodes[0])] += W(1,5)*Uy(nodes[2]);
-
-            R[Ux.Index(nodes[0])] -= rhs(0,0);
-            R[Uy.Index(nodes[0])] -= rhs(1,0);
+    }
+}
+
+// Add contribution of one cell to global system
+void Problem::assembleCell(Cell &cell)
+{
+    if(useBlock){
+        assembleCellBlock(cell);
+        return;
+    }
+    LinearResidual LR(R, useNumeric);
+    //printf("cell %d, vol = %e\n", cell.LocalID(), cell.Volume());
+
+    ElementArray<Node> nodes = cell.getNodes();
+    fMatrix<6,6> W;
+    fMatrix<6,1> rhs;
+    assembleLocalSystem(cell, W, rhs);
+
+    if(!W.isSymmetric()){
+        printf("Nonsymm W\n");
+        exit(1);
+    }
+
+    if(nodes[0].GetMarker(mrkDirNode)){
+        // There's no row corresponding to nodes[0]
+
+        // Displacements in boundary node nodes[0]
+        double bcValX = nodes[0].RealArray(tagBC)[0];
+        double bcValY = nodes[0].RealArray(tagBC)[1];
+        // If nodes[1] is not Dirichlet node,
+        // add corresponding part to its equations
+        if(!nodes[1].GetMarker(mrkDirNode)){
+            LR.add(Ux.Index(nodes[1]), bcValX * W(2,0));
+            LR.add(Ux.Index(nodes[1]), bcValY * W(2,1));
+            LR.add(Uy.Index(nodes[1]), bcValX * W(3,0));
+            LR.add(Uy.Index(nodes[1]), bcValY * W(3,1));
+        }
+        if(!nodes[2].GetMarker(mrkDirNode)){
+            LR.add(Ux.Index(nodes[2]), bcValX * W(4,0));
+            LR.add(Ux.Index(nodes[2]), bcValY * W(4,1));
+            LR.add(Uy.Index(nodes[2]), bcValX * W(5,0));
+            LR.add(Uy.Index(nodes[2]), bcValY * W(5,1));
+        }
+    }
+    else{
+        LR.add(Ux.Index(nodes[0]), W(0,0), Ux, nodes[0]);
+        LR.add(Ux.Index(nodes[0]), W(0,1), Uy, nodes[0]);
+        LR.add(Ux.Index(nodes[0]), W(0,2), Ux, nodes[1]);
+        LR.add(Ux.Index(nodes[0]), W(0,3), Uy, nodes[1]);
+        LR.add(Ux.Index(nodes[0]), W(0,4), Ux, nodes[2]);
+        LR.add(Ux.Index(nodes[0]), W(0,5), Uy, nodes[2]);
+        LR.add(Uy.Index(nodes[0]), W(1,0), Ux, nodes[0]);
+        LR.add(Uy.Index(nodes[0]), W(1,1), Uy, nodes[0]);
+        LR.add(Uy.Index(nodes[0]), W(1,2), Ux, nodes[1]);
+        LR.add(Uy.Index(nodes[0]), W(1,3), Uy, nodes[1]);
+        LR.add(Uy.Index(nodes[0]), W(1,4), Ux, nodes[2]);
+        LR.add(Uy.Index(nodes[0]), W(1,5), Uy, nodes[2]);
+
+        LR.add(Ux.Index(nodes[0]), -rhs(0,0));
+        LR.add(Uy.Index(nodes[0]), -rhs(1,0));
 
 //            R[Ux.Index(nodes[0])] += W(0,0)*Ux(nodes[0]);
 //            R[Ux.Index(nodes[0])] += W(0,1)*Ux(nodes[1]);
@@ -287,42 +453,42 @@ void Problem::assembleGlobalSystem()
 //            R[Uy.Index(nodes[0])] += W(1,3)*Uy(nodes[0]);
 //            R[Uy.Index(nodes[0])] += W(1,4)*Uy(nodes[1]);
 //            R[Uy.Index(nodes[0])] += W(1,5)*Uy(nodes[2]);
-            //R[var.Index(nodes[0])] -= bRHS(0,0);
-        }
+        //R[var.Index(nodes[0])] -= bRHS(0,0);
+    }
 
-        if(nodes[1].GetMarker(mrkDirNode)){
-            // Dirichlet node
-            double bcValX = nodes[1].RealArray(tagBC)[0];
-            double bcValY = nodes[1].RealArray(tagBC)[1];
-            if(!nodes[0].GetMarker(mrkDirNode)){
-                R[Ux.Index(nodes[0])] += bcValX * W(0,2);
-                R[Ux.Index(nodes[0])] += bcValY * W(0,3);
-                R[Uy.Index(nodes[0])] += bcValX * W(1,2);
-                R[Uy.Index(nodes[0])] += bcValY * W(1,3);
-            }
-            if(!nodes[2].GetMarker(mrkDirNode)){
-                R[Ux.Index(nodes[2])] += bcValX * W(4,2);
-                R[Ux.Index(nodes[2])] += bcValY * W(4,3);
-                R[Uy.Index(nodes[2])] += bcValX * W(5,2);
-                R[Uy.Index(nodes[2])] += bcValY * W(5,3);
-            }
+    if(nodes[1].GetMarker(mrkDirNode)){
+        // Dirichlet node
+        double bcValX = nodes[1].RealArray(tagBC)[0];
+        double bcValY = nodes[1].RealArray(tagBC)[1];
+        if(!nodes[0].GetMarker(mrkDirNode)){
+            LR.add(Ux.Index(nodes[0]), bcValX * W(0,2));
+            LR.add(Ux.Index(nodes[0]), bcValY * W(0,3));
+            LR.add(Uy.Index(nodes[0]), bcValX * W(1,2));
+            LR.add(Uy.Index(nodes[0]), bcValY * W(1,3));
+        }
+        if(!nodes[2].GetMarker(mrkDirNode)){
+            LR.add(Ux.Index(nodes[2]), bcValX * W(4,2));
+            LR.add(Ux.Index(nodes[2]), bcValY * W(4,3));
+            LR.add(Uy.Index(nodes[2]), bcValX * W(5,2));
+            LR.add(Uy.Index(nodes[2]), bcValY * W(5,3));
         }
-        else{
-            R[Ux.Index(nodes[1])] += W(2,0)*Ux(nodes[0]);
-            R[Ux.Index(nodes[1])] += W(2,1)*Uy(nodes[0]);
-            R[Ux.Index(nodes[1])] += W(2,2)*Ux(nodes[1]);
-            R[Ux.Index(nodes[1])] += W(2,3)*Uy(nodes[1]);
-            R[Ux.Index(nodes[1])] += W(2,4)*Ux(nodes[2]);
-            R[Ux.Index(nodes[1])] += W(2,5)*Uy(nodes[2]);
-            R[Uy.Index(nodes[1])] += W(3,0)*Ux(nodes[0]);
-            R[Uy.Index(nodes[1])] += W(3,1)*Uy(nodes[0]);
-            R[Uy.Index(nodes[1])] += W(3,2)*Ux(nodes[1]);
-            R[Uy.Index(nodes[1])] += W(3,3)*Uy(nodes[1]);
-            R[Uy.Index(nodes[1])] += W(3,4)*Ux(nodes[2]);
-            R[Uy.Index(nodes[1])] += W(3,5)*Uy(nodes[2]);
-
-            R[Ux.Index(nodes[1])] -= rhs(2,0);
-            R[Uy.Index(nodes[1])] -= rhs(3,0);
+    }
+    else{
+        LR.add(Ux.Index(nodes[1]), W(2,0), Ux, nodes[0]);
+        LR.add(Ux.Index(nodes[1]), W(2,1), Uy, nodes[0]);
+        LR.add(Ux.Index(nodes[1]), W(2,2), Ux, nodes[1]);
+        LR.add(Ux.Index(nodes[1]), W(2,3), Uy, nodes[1]);
+        LR.add(Ux.Index(nodes[1]), W(2,4), Ux, nodes[2]);
+        LR.add(Ux.Index(nodes[1]), W(2,5), Uy, nodes[2]);
+        LR.add(Uy.Index(nodes[1]), W(3,0), Ux, nodes[0]);
+        LR.add(Uy.Index(nodes[1]), W(3,1), Uy, nodes[0]);
+        LR.add(Uy.Index(nodes[1]), W(3,2), Ux, nodes[1]);
+        LR.add(Uy.Index(nodes[1]), W(3,3), Uy, nodes[1]);
+        LR.add(Uy.Index(nodes[1]), W(3,4), Ux, nodes[2]);
+        LR.add(Uy.Index(nodes[1]), W(3,5), Uy, nodes[2]);
+
+        LR.add(Ux.Index(nodes[1]), -rhs(2,0));
+        LR.add(Uy.Index(nodes[1]), -rhs(3,0));
 
 //            R[Ux.Index(nodes[1])] += W(2,0)*Ux(nodes[0]);
 //            R[Ux.Index(nodes[1])] += W(2,1)*Ux(nodes[1]);
@@ -336,41 +502,41 @@ void Problem::assembleGlobalSystem()
 //            R[Uy.Index(nodes[1])] += W(3,3)*Uy(nodes[0]);
 //            R[Uy.Index(nodes[1])] += W(3,4)*Uy(nodes[1]);
 //            R[Uy.Index(nodes[1])] += W(3,5)*Uy(nodes[2]);
-        }
+    }
 
-        if(nodes[2].GetMarker(mrkDirNode)){
-            // Dirichlet node
-            double bcValX = nodes[2].RealArray(tagBC)[0];
-            double bcValY = nodes[2].RealArray(tagBC)[1];
-            if(!nodes[1].GetMarker(mrkDirNode)){
-                R[Ux.Index(nodes[1])] += bcValX * W(2,4);
-                R[Ux.Index(nodes[1])] += bcValY * W(2,5);
-                R[Uy.Index(nodes[1])] += bcValX * W(3,4);
-                R[Uy.Index(nodes[1])] += bcValY * W(3,5);
-            }
-            if(!nodes[0].GetMarker(mrkDirNode)){
-                R[Ux.Index(nodes[0])] += bcValX * W(0,4);
-                R[Ux.Index(nodes[0])] += bcValY * W(0,5);
-                R[Uy.Index(nodes[0])] += bcValX * W(1,4);
-                R[Uy.Index(nodes[0])] += bcValY * W(1,5);
-            }
+    if(nodes[2].GetMarker(mrkDirNode)){
+        // Dirichlet node
+        double bcValX = nodes[2].RealArray(tagBC)[0];
+        double bcValY = nodes[2].RealArray(tagBC)[1];
+        if(!nodes[1].GetMarker(mrkDirNode)){
+            LR.add(Ux.Index(nodes[1]), bcValX * W(2,4));
+            LR.add(Ux.Index(nodes[1]), bcValY * W(2,5));
+            LR.add(Uy.Index(nodes[1]), bcValX * W(3,4));
+            LR.add(Uy.Index(nodes[1]), bcValY * W(3,5));
+        }
+        if(!nodes[0].GetMarker(mrkDirNode)){
+            LR.add(Ux.Index(nodes[0]), bcValX * W(0,4));
+            LR.add(Ux.Index(nodes[0]), bcValY * W(0,5));
+            LR.add(Uy.Index(nodes[0]), bcValX * W(1,4));
+            LR.add(Uy.Index(nodes[0]), bcValY * W(1,5));
         }
-        else{
-            R[Ux.Index(nodes[2])] += W(4,0)*Ux(nodes[0]);
-            R[Ux.Index(nodes[2])] += W(4,1)*Uy(nodes[0]);
-            R[Ux.Index(nodes[2])] += W(4,2)*Ux(nodes[1]);
-            R[Ux.Index(nodes[2])] += W(4,3)*Uy(nodes[1]);
-            R[Ux.Index(nodes[2])] += W(4,4)*Ux(nodes[2]);
-            R[Ux.Index(nodes[2])] += W(4,5)*Uy(nodes[2]);
-            R[Uy.Index(nodes[2])] += W(5,0)*Ux(nodes[0]);
-            R[Uy.Index(nodes[2])] += W(5,1)*Uy(nodes[0]);
-            R[Uy.Index(nodes[2])] += W(5,2)*Ux(nodes[1]);
-            R[Uy.Index(nodes[2])] += W(5,3)*Uy(nodes[1]);
-            R[Uy.Index(nodes[2])] += W(5,4)*Ux(nodes[2]);
-            R[Uy.Index(nodes[2])] += W(5,5)*Uy(nodes[2]);
-
-            R[Ux.Index(nodes[2])] -= rhs(4,0);
-            R[Uy.Index(nodes[2])] -= rhs(5,0);
+    }
+    else{
+        LR.add(Ux.Index(nodes[2]), W(4,0), Ux, nodes[0]);
+        LR.add(Ux.Index(nodes[2]), W(4,1), Uy, nodes[0]);
+        LR.add(Ux.Index(nodes[2]), W(4,2), Ux, nodes[1]);
+        LR.add(Ux.Index(nodes[2]), W(4,3), Uy, nodes[1]);
+        LR.add(Ux.Index(nodes[2]), W(4,4), Ux, nodes[2]);
+        LR.add(Ux.Index(nodes[2]), W(4,5), Uy, nodes[2]);
+        LR.add(Uy.Index(nodes[2]), W(5,0), Ux, nodes[0]);
+        LR.add(Uy.Index(nodes[2]), W(5,1), Uy, nodes[0]);
+        LR.add(Uy.Index(nodes[2]), W(5,2), Ux, nodes[1]);
+        LR.add(Uy.Index(nodes[2]), W(5,3), Uy, nodes[1]);
+        LR.add(Uy.Index(nodes[2]), W(5,4), Ux, nodes[2]);
+        LR.add(Uy.Index(nodes[2]), W(5,5), Uy, nodes[2]);
+
+        LR.add(Ux.Index(nodes[2]), -rhs(4,0));
+        LR.add(Uy.Index(nodes[2]), -rhs(5,0));
 
 //            R[Ux.Index(nodes[2])] += W(4,0)*Ux(nodes[0]);
 //            R[Ux.Index(nodes[2])] += W(4,1)*Ux(nodes[1]);
@@ -384,12 +550,10 @@ void Problem::assembleGlobalSystem()
 //            R[Uy.Index(nodes[2])] += W(5,3)*Uy(nodes[0]);
 //            R[Uy.Index(nodes[2])] += W(5,4)*Uy(nodes[1]);
 //            R[Uy.Index(nodes[2])] += W(5,5)*Uy(nodes[2]);
-        }
     }
-    times[T_ASSEMBLE] += Timer() - t;
 }
 
-void Problem::assembleLocalSystem(Cell &cell, rMatrix &W, rMatrix &rhs)
+void Problem::assembleLocalSystem(Cell &cell, fMatrix<6,6> &W, fMatrix<6,1> &rhs)
 {
     ElementArray<Node> nodes = cell.getNodes();
 
@@ -398,13 +562,13 @@ void Problem::assembleLocalSystem(Cell &cell, rMatrix &W, rMatrix &rhs)
     nodes[1].Barycenter(x1);
     nodes[2].Barycenter(x2);
 
-    rMatrix Ck(3,3); // Stiffness tensor
-    Ck.Zero();
+    fMatrix<3,3> Ck; // Stiffness tensor
     for(unsigned i = 0; i < 3; i++)
         for(unsigned j = 0; j < 3; j++)
             Ck(i,j) = cell.RealArray(tagC)[i*3+j];
 
-    rMatrix R(3,6), PhiGrad(3,2);
+    fMatrix<3,6> R;
+    fMatrix<3,2> PhiGrad;
 //    PhiGrad(0,0) = x1[1] - x2[1]; // y2 - y3
 //    PhiGrad(0,1) = x2[0] - x1[0]; // x3 - x2
 //    PhiGrad(1,0) = x2[1] - x0[1]; // y3 - y1
@@ -413,7 +577,8 @@ void Problem::assembleLocalSystem(Cell &cell, rMatrix &W, rMatrix &rhs)
 //    PhiGrad(2,1) = x2[0] - x0[0]; // x3 - x1
 //    PhiGrad *= 0.5/cell.Volume();
 
-    rMatrix A(3,3), B(3,2);
+    fMatrix<3,3> A;
+    fMatrix<3,2> B;
     A(0,0) = 1.;
     A(0,1) = 1.;
     A(0,2) = 1.;
@@ -448,20 +613,19 @@ void Problem::assembleLocalSystem(Cell &cell, rMatrix &W, rMatrix &rhs)
 //    R.Print();
 //    exit(1);
 
-    double detA = A(0,0)*A(1,1)*A(2,2) + A(0,1)*A(1,2)*A(2,0) + A(0,2)*A(1,0)*A(2,1);
-    detA       -= A(0,2)*A(1,1)*A(2,0) + A(2,1)*A(1,2)*A(0,0) + A(2,2)*A(1,0)*A(0,1);
+    double detA = det(A);
 
 
     W = detA * 0.5 * R.Transpose() * Ck * R;
 
     // rhs assembly
-    rMatrix Bk(2,2);
+    fMatrix<2,2> Bk;
     Bk(0,0) = x1[0] - x0[0]; //x2 - x1;
     Bk(0,1) = x2[0] - x0[0]; //x3 - x1;
     Bk(1,0) = x1[1] - x0[1]; //y2 - y1;
     Bk(1,1) = x2[1] - x0[1]; //y3 - y1;
 
-    double detBk = Bk(0,0)*Bk(1,1) - Bk(0,1)*Bk(1,0);
+    double detBk = det(Bk);
     rhs(0,0) = nodes[0].RealArray(tagRHS)[0] + nodes[1].RealArray(tagRHS)[0] + nodes[2].RealArray(tagRHS)[0];
     rhs(1,0) = nodes[0].RealArray(tagRHS)[1] + nodes[1].RealArray(tagRHS)[1] + nodes[2].RealArray(tagRHS)[1];
     rhs(2,0) = rhs(0,0);
@@ -500,14 +664,62 @@ rMatrix integrateRHS(Cell &cell)
     return res * fabs(detBk) / 18.;
 }
 
+void Problem::solveBlockSystem()
+{
+    double t = Timer();
+    BlockILU0<2> prec;
+    if(!prec.build(blockA)){
+        cout << "Block ILU(0) failed: singular diagonal block" << endl;
+        exit(1);
+    }
+    prof.add(T_PRECOND, Timer() - t);
+
+    vector<double> sol(blockRHS.size(), 0.);
+    int iters;
+    double resid;
+    t = Timer();
+    bool solved = solveBlockCG(blockA, prec, blockRHS, sol, 1e-12, 1e-15, 10000, iters, resid);
+    prof.add(T_SOLVE, Timer() - t);
+    if(!solved){
+        cout << "Linear solver failed: no convergence in " << iters << " iterations" << endl;
+        cout << "Residual: " << resid << endl;
+        exit(1);
+    }
+    cout << "Linear solver iterations: " << iters << endl;
+    prof.count("linear_iterations", iters);
+
+    t = Timer();
+    double Cnorm = 0.0;
+    for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++){
+        int bi = blockRow[inode->LocalID()];
+        if(bi < 0)
+            continue;
+
+        inode->RealArray(tagSol)[0] = sol[2*bi];
+        inode->RealArray(tagSol)[1] = sol[2*bi+1];
+        Cnorm = max(Cnorm, fabs(inode->RealArray(tagSol)[0]-inode->RealArray(tagSolEx)[0]));
+        Cnorm = max(Cnorm, fabs(inode->RealArray(tagSol)[1]-inode->RealArray(tagSolEx)[1]));
+    }
+    cout << "|err|_C = " << Cnorm << endl;
+    prof.setValue("err_C", Cnorm);
+    prof.add(T_UPDATE, Timer() - t);
+}
+
 void Problem::solveSystem()
 {
-    Solver S("inner_mptiluc");
+    if(useBlock){
+        solveBlockSystem();
+        return;
+    }
+    Solver S(solverOpt.type, solverOpt.prefix);
     S.SetParameter("relative_tolerance", "1e-12");
     S.SetParameter("absolute_tolerance", "1e-15");
     double t = Timer();
-    S.SetMatrix(R.GetJacobian());
-    times[T_PRECOND] += Timer() - t;
+    perm.setMatrix(S, R.GetJacobian());
+    if(!perm.empty())
+        cout << "Matrix bandwidth: " << matrixBandwidth(R.GetJacobian()) << " -> "
+             << matrixBandwidth(perm.getMatrix()) << " after reordering" << endl;
+    prof.add(T_PRECOND, Timer() - t);
     Sparse::Vector sol;
     sol.SetInterval(aut.GetFirstIndex(), aut.GetLastIndex());
 
@@ -530,14 +742,15 @@ void Problem::solveSystem()
         //cout << "b["<<i<<"] = " << R.GetResidual()[i] << endl;
     }
     t = Timer();
-    bool solved = S.Solve(R.GetResidual(), sol);
-    times[T_SOLVE] += Timer() - t;
+    bool solved = perm.solve(S, R.GetResidual(), sol);
+    prof.add(T_SOLVE, Timer() - t);
     if(!solved){
         cout << "Linear solver failed: " << S.GetReason() << endl;
         cout << "Residual: " << S.Residual() << endl;
         exit(1);
     }
     cout << "Linear solver iterations: " << S.Iterations() << endl;
+    prof.count("linear_iterations", S.Iterations());
 
 
 //    for(unsigned i = 0; i < sol.Size(); i++){
@@ -558,12 +771,14 @@ void Problem::solveSystem()
         Cnorm = max(Cnorm, fabs(inode->RealArray(tagSol)[1]-inode->RealArray(tagSolEx)[1]));
     }
     cout << "|err|_C = " << Cnorm << endl;
-    times[T_UPDATE] += Timer() - t;
+    prof.setValue("err_C", Cnorm);
+    prof.add(T_UPDATE, Timer() - t);
 }
 
 void Problem::saveSolution(string path)
 {
     double t = Timer();
+    deleteColoring(m);
     m.Save(path);
 
     for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++){
@@ -574,22 +789,55 @@ void Problem::saveSolution(string path)
 
     m.Save("deformed.vtk");
 
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2){
-        cout << "Usage: 2d_elasticity_fem <mesh_file>" << endl;
+    if(argc < 2){
+        cout << "Usage: 2d_elasticity_fem <mesh_file> [-colored] [-reorder rcm|sfc] [-numeric] [-bsr] [-solver <type>] [-solver_db <file>]" << endl;
         return 1;
     }
 
-    Problem P(argv[1]);
-    P.initProblem();
-    P.assembleGlobalSystem();
-    P.solveSystem();
-    P.saveSolution("res.vtk");
+    bool colored = false, numeric = false, bsr = false;
+    int reorder = REORDER_NONE;
+    SolverOptions solverOpt("inner_mptiluc");
+    for(int i = 2; i < argc; i++){
+        string opt(argv[i]);
+        if(opt == "-colored")
+            colored = true;
+        else if(opt == "-reorder" && i+1 < argc)
+            reorder = parseReorderMethod(argv[++i]);
+        else if(opt == "-numeric")
+            numeric = true;
+        else if(opt == "-bsr")
+            bsr = true;
+        else if(!solverOpt.parse(i, argc, argv)){
+            cout << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    Solver::Initialize(&argc, &argv, solverOpt.database.c_str());
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    Problem *P = new Problem(argv[1]);
+    P->setColoring(colored);
+    P->setReorder(reorder);
+    P->setNumeric(numeric);
+    P->setBlock(bsr);
+    P->setSolver(solverOpt);
+    P->initProblem();
+    P->assembleGlobalSystem();
+    P->solveSystem();
+    P->saveSolution("res.vtk");
+
+    delete P;
+
+    Partitioner::Finalize();
+    Solver::Finalize();
+    Mesh::Finalize();
 
     return 0;
 }
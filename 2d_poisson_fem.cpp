@@ -1,4 +1,7 @@
 #include "inmost.h"
+#include "fixed_matrix.h"
+#include "solver_options.h"
+#include "reordering.h"
 
 //    !!!!!!! Currently NOT suited for parallel run
 //
@@ -19,7 +22,7 @@
 //    - process mesh,
 //    - init tags,
 //    - assemble linear system,
-//    - solve it with INMOST inner linear solver,
+//    - solve it with INMOST linear solver chosen by -solver (inner_ilu2 by default),
 //    - save solution in a .vtk file.
 
 
@@ -70,19 +73,28 @@ private:
     unsigned numDirNodes;
     unsigned size;        // size of resulting system = #nodes-#Dir.nodes
 
+    int reorder;          // ordering of cells and unknowns, see reordering.h
+    vector<HandleType> cellOrder; // cells in assembly order
+    UnknownPermutation perm;      // rows in node order, empty without reordering
+
+    SolverOptions solverOpt; // type and parameters of linear solver
+
 public:
     Problem(string meshName);
     ~Problem();
     void initProblem(); // create tags and set parameters
     void assembleGlobalSystem(); // assemble global linear system
-    rMatrix computeStiffMatrix(Cell &);
-    rMatrix integrateRHS(Cell &);
+    fMatrix<3,3> computeStiffMatrix(Cell &);
+    fMatrix<3,1> integrateRHS(Cell &);
+    void setSolver(const SolverOptions &o) { solverOpt = o; }
+    void setReorder(int r) { reorder = r; }
     void solveSystem();
     void saveSolution(string path); // save mesh with solution
 };
 
 Problem::Problem(string meshName)
 {
+    reorder = REORDER_NONE;
     m.Load(meshName);
     cout << "Number of cells: " << m.NumberOfCells() << endl;
     cout << "Number of faces: " << m.NumberOfFaces() << endl;
@@ -137,6 +149,24 @@ void Problem::initProblem()
         node.Real(tagSol) = exactSolution(x);
     }
     cout << "Number of Dirichlet nodes: " << numDirNodes << endl;
+
+    // Rows are numbered by LocalID of nodes during assembly
+    // and renumbered in node order for the solver
+    reorderElements(m, CELL, reorder, cellOrder);
+    if(cellOrder.empty())
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            cellOrder.push_back(icell->GetHandle());
+    if(reorder != REORDER_NONE){
+        vector<HandleType> nodeOrder;
+        reorderElements(m, NODE, reorder, nodeOrder);
+        vector<INMOST_DATA_ENUM_TYPE> unknowns;
+        for(size_t k = 0; k < nodeOrder.size(); k++){
+            Node node(&m, nodeOrder[k]);
+            if(!node.GetMarker(mrkDirNode))
+                unknowns.push_back(static_cast<INMOST_DATA_ENUM_TYPE>(node.LocalID()));
+        }
+        perm.build(0, static_cast<INMOST_DATA_ENUM_TYPE>(m.NumberOfNodes())+1, unknowns);
+    }
 }
 
 void Problem::assembleGlobalSystem()
@@ -147,19 +177,19 @@ void Problem::assembleGlobalSystem()
     size = static_cast<unsigned>(m.NumberOfNodes())+1;
     A.SetInterval(0, size);
     b.SetInterval(0, size);
-    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-        if(icell->GetStatus() == Element::Ghost)
+    for(size_t k = 0; k < cellOrder.size(); k++){
+        Cell cell(&m, cellOrder[k]);
+        if(cell.GetStatus() == Element::Ghost)
             continue;
-        Cell cell = icell->getAsCell();
 
-        ElementArray<Node> nodes = icell->getNodes();
-        rMatrix stiffMatrix = computeStiffMatrix(cell);
+        ElementArray<Node> nodes = cell.getNodes();
+        fMatrix<3,3> stiffMatrix = computeStiffMatrix(cell);
 
 //        cout << "stiffness matrix for cell " << cell.LocalID() << ":" << endl;
 //        stiffMatrix.Print();
 //        cout << endl << endl;
 
-        rMatrix bRHS = integrateRHS(cell);
+        fMatrix<3,1> bRHS = integrateRHS(cell);
         bRHS *= 1;
 
         unsigned ind0 = static_cast<unsigned>(nodes[0].LocalID());
@@ -212,7 +242,7 @@ void Problem::assembleGlobalSystem()
     }
 }
 
-rMatrix Problem::computeStiffMatrix(Cell &cell)
+fMatrix<3,3> Problem::computeStiffMatrix(Cell &cell)
 {
     ElementArray<Node> nodes = cell.getNodes();
 
@@ -221,24 +251,25 @@ rMatrix Problem::computeStiffMatrix(Cell &cell)
     nodes[1].Barycenter(x1);
     nodes[2].Barycenter(x2);
 
-    rMatrix Dk(2,2); // Diffusion tensor
+    fMatrix<2,2> Dk; // Diffusion tensor
     Dk(0,0) = cell.RealArray(tagD)[0];
     Dk(1,1) = cell.RealArray(tagD)[1];
     Dk(1,0) = cell.RealArray(tagD)[2];
     Dk(0,1) = cell.RealArray(tagD)[2];
 
-    rMatrix Bk(2,2);
+    fMatrix<2,2> Bk;
     Bk(0,0) = x1[0] - x0[0]; //x2 - x1;
     Bk(0,1) = x2[0] - x0[0]; //x3 - x1;
     Bk(1,0) = x1[1] - x0[1]; //y2 - y1;
     Bk(1,1) = x2[1] - x0[1]; //y3 - y1;
 
-    rMatrix Ck = Bk.Invert() * Dk * Bk.Invert().Transpose();
+    fMatrix<2,2> invBk = Bk.Invert();
+    fMatrix<2,2> Ck = invBk * Dk * invBk.Transpose();
     //Ck = Dk * Ck;
 
     double detBk = Bk(0,0)*Bk(1,1) - Bk(0,1)*Bk(1,0);
 
-    rMatrix Kee(3,3), Knn(3,3), Ken(3,3);
+    fMatrix<3,3> Kee, Knn, Ken;
     Kee.Zero();
     Knn.Zero();
     Ken.Zero();
@@ -254,16 +285,15 @@ rMatrix Problem::computeStiffMatrix(Cell &cell)
     Knn *= 0.5;
     Ken *= 0.5;
 
-    rMatrix M(3,3);
-    M = Ck(0,0)*Kee + Ck(1,1)*Knn + Ck(0,1)*(Ken + Ken.Transpose());
+    fMatrix<3,3> M = Ck(0,0)*Kee + Ck(1,1)*Knn + Ck(0,1)*(Ken + Ken.Transpose());
     M *= fabs(detBk);
 
     return M;
 }
 
-rMatrix Problem::integrateRHS(Cell &cell)
+fMatrix<3,1> Problem::integrateRHS(Cell &cell)
 {
-    rMatrix res(3,1);
+    fMatrix<3,1> res;
 
     ElementArray<Node> nodes = cell.getNodes();
 
@@ -272,14 +302,12 @@ rMatrix Problem::integrateRHS(Cell &cell)
     nodes[1].Barycenter(x1);
     nodes[2].Barycenter(x2);
 
-    rMatrix Bk(2,2);
+    fMatrix<2,2> Bk;
     Bk(0,0) = x1[0] - x0[0]; //x2 - x1;
     Bk(0,1) = x2[0] - x0[0]; //x3 - x1;
     Bk(1,0) = x1[1] - x0[1]; //y2 - y1;
     Bk(1,1) = x2[1] - x0[1]; //y3 - y1;
 
-    rMatrix Ck = Bk.Invert() * Bk.Invert().Transpose();
-
     double detBk = Bk(0,0)*Bk(1,1) - Bk(0,1)*Bk(1,0);
 
     res.Zero();
@@ -292,12 +320,15 @@ rMatrix Problem::integrateRHS(Cell &cell)
 
 void Problem::solveSystem()
 {
-    Solver S("inner_ilu2");
-    S.SetMatrix(linSys.A);
+    Solver S(solverOpt.type, solverOpt.prefix);
+    perm.setMatrix(S, linSys.A);
+    if(!perm.empty())
+        cout << "Matrix bandwidth: " << matrixBandwidth(linSys.A) << " -> "
+             << matrixBandwidth(perm.getMatrix()) << " after reordering" << endl;
     Sparse::Vector sol;
     cout << "size = " << size << endl;
     sol.SetInterval(0, size);
-    bool solved = S.Solve(linSys.b, sol);
+    bool solved = perm.solve(S, linSys.b, sol);
     if(!solved){
         cout << "Linear solver failed: " << S.GetReason() << endl;
         cout << "Residual: " << S.Residual() << endl;
@@ -328,16 +359,39 @@ void setProblemParams(Mesh *m)
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2){
-        cout << "Usage: 2d_poisson_fem <mesh_file>" << endl;
+    if(argc < 2){
+        cout << "Usage: 2d_poisson_fem <mesh_file> [-reorder rcm|sfc] [-solver <type>] [-solver_db <file>]" << endl;
         return 1;
     }
 
-    Problem P(argv[1]);
-    P.initProblem();
-    P.assembleGlobalSystem();
-    P.solveSystem();
-    P.saveSolution("res.vtk");
+    int reorder = REORDER_NONE;
+    SolverOptions solverOpt("inner_ilu2");
+    for(int i = 2; i < argc; i++){
+        string opt(argv[i]);
+        if(opt == "-reorder" && i+1 < argc)
+            reorder = parseReorderMethod(argv[++i]);
+        else if(!solverOpt.parse(i, argc, argv)){
+            cout << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    Solver::Initialize(&argc, &argv, solverOpt.database.c_str());
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    Problem *P = new Problem(argv[1]);
+    P->setSolver(solverOpt);
+    P->setReorder(reorder);
+    P->initProblem();
+    P->assembleGlobalSystem();
+    P->solveSystem();
+    P->saveSolution("res.vtk");
+
+    delete P;
+
+    Partitioner::Finalize();
+    Solver::Finalize();
+    Mesh::Finalize();
 
     return 0;
 }
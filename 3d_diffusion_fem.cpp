@@ -0,0 +1,472 @@
+#include "inmost.h"
+#include "fixed_matrix.h"
+#include "profiling.h"
+#include "solver_options.h"
+#include "linear_residual.h"
+#include "mesh_cache.h"
+#include "reordering.h"
+
+//    Can be run in parallel: mesh is partitioned at load,
+//    a layer of ghost cells across nodes is added,
+//    and rows are assembled for owned nodes only.
+//
+//
+//    This code solves the following
+//    boundary value problem for diffusion equation
+//
+//    div(-D grad U) = f       in unit cube
+//    U              = g       on boundary
+//
+//    D is diffusion tensor, s.p.d. 3x3 matrix defined by 6 numbers Dxx, Dyy, Dzz, Dxy, Dxz, Dyz
+//
+//    The user should provide 3D tetrahedral mesh
+//    (preferrably, a .vtk file which can be generated by Gmsh for example)
+//    which is built for (0;1)x(0;1)x(0;1)
+//
+//    P1 elements: stiffness matrix of tetrahedron is V * G^T D G,
+//    where columns of G are gradients of the 4 basis functions.
+//    Gradients and volumes are computed once and stored compactly by cells,
+//    so assembly does not query geometry of the mesh.
+//
+//    The code will then
+//    - process mesh,
+//    - init tags,
+//    - assemble linear system,
+//    - solve it with INMOST inner linear solver,
+//    - save solution in a .vtk file.
+
+
+using namespace INMOST;
+
+const std::string tagNameTensor = "DIFFUSION_TENSOR";
+const std::string tagNameBC     = "BOUNDARY_CONDITION";
+const std::string tagNameSol    = "SOLUTION";
+const std::string tagNameSolEx  = "SOLUTION_EXACT";
+
+const double Dxx = 10;
+const double Dyy = 2;
+const double Dzz = 1;
+const double Dxy = 0;
+const double Dxz = 0;
+const double Dyz = 0;
+
+#ifndef M_PI
+const double M_PI = 3.1415926535898;
+#endif
+
+double exactSolution(double *x)
+{
+    return sin(M_PI*x[0]) * sin(M_PI*x[1]) * sin(M_PI*x[2]);
+}
+
+double exactSolutionRHS(double *x)
+{
+    return M_PI*M_PI * ((Dxx+Dyy+Dzz) * exactSolution(x)
+            - 2*Dxy*cos(M_PI*x[0])*cos(M_PI*x[1])*sin(M_PI*x[2])
+            - 2*Dxz*cos(M_PI*x[0])*sin(M_PI*x[1])*cos(M_PI*x[2])
+            - 2*Dyz*sin(M_PI*x[0])*cos(M_PI*x[1])*cos(M_PI*x[2])
+            );
+}
+
+// Geometry of linear tetrahedra stored as structure of arrays,
+// indexed by position of cell in 'cells'
+struct TetGeometry
+{
+    std::vector<HandleType> cells; // all local cells, ghost ones included
+    std::vector<HandleType> nodes; // 4 per cell
+    std::vector<double> vol;       // volume per cell
+    std::vector<double> grad;      // 12 per cell: gradients of basis functions, node by node
+};
+
+class Problem
+{
+private:
+    Mesh m;
+    // List of mesh tags
+    Tag tagD;     // Diffusion tensor
+    Tag tagBC;    // Boundary conditions
+    Tag tagSol;   // Solution
+    Tag tagSolEx; // Exact solution
+
+    MarkerType mrkDirNode;  // Dirichlet node marker
+
+    Automatizator aut;    // Automatizator to handle all AD things
+    Residual R;           // Residual to assemble
+    dynamic_variable var; // Variable containing solution
+
+    TetGeometry geom;     // precomputed gradients and volumes
+    std::vector<double> nodeRHS; // source f at nodes by LocalID
+
+    int rank; // for parallel runs
+
+    int numDirNodes;
+
+    int reorder;             // ordering of cells and unknowns, see reordering.h
+    UnknownPermutation perm; // unknowns in node order, empty without reordering
+
+    SolverOptions solverOpt; // type and parameters of linear solver
+
+    Profiler prof; // run-time statistics
+
+public:
+    Problem(std::string meshName);
+    ~Problem();
+    void initProblem(); // create tags and set parameters
+    void buildGeometry(); // precompute gradients and volumes of tetrahedra
+    void assembleGlobalSystem(); // assemble global linear system
+    void assembleCell(int k);    // add contribution of cell k of geometry arrays
+    fMatrix<4,4> computeStiffMatrix(int k);
+    void setSolver(const SolverOptions &o) { solverOpt = o; }
+    void setReorder(int r) { reorder = r; }
+    void setSolverMatrix(Solver &S); // give Jacobian to S in the order of unknowns
+    void solveSystem();
+    void saveSolution(std::string path); // save mesh with solution
+    void saveMesh(std::string path) { saveMeshCache(m, path); } // save prepared mesh to .pmf
+};
+
+Problem::Problem(std::string meshName)
+{
+    reorder = REORDER_NONE;
+
+    m.SetCommunicator(INMOST_MPI_COMM_WORLD);
+    rank = m.GetProcessorRank();
+
+    double t = Timer();
+
+    // Cache made for this number of processors is already partitioned
+    bool cached = loadMesh(m, meshName);
+    if(rank == 0 && !m.isParallelFileFormat(meshName))
+    {
+        std::cout << "Number of cells: " << m.NumberOfCells() << std::endl;
+        std::cout << "Number of nodes: " << m.NumberOfNodes() << std::endl;
+    }
+
+    if(!cached)
+    {
+        if(m.GetProcessorsNumber() > 1)
+        {
+            Partitioner part(&m);
+            part.SetMethod(Partitioner::INNER_KMEANS, Partitioner::Partition);
+            part.Evaluate();
+            m.Redistribute();
+            m.AssignGlobalID(NODE);
+            m.ExchangeGhost(1, NODE);
+        }
+        else
+            m.AssignGlobalID(NODE);
+    }
+
+    prof.add(T_IO, Timer() - t);
+}
+
+Problem::~Problem()
+{
+    prof.report(m, "stats");
+}
+
+void Problem::initProblem()
+{
+    double t = Timer();
+    tagD     = m.CreateTag(tagNameTensor, DATA_REAL, CELL, NONE, 6);
+    tagBC    = m.CreateTag(tagNameBC,     DATA_REAL, NODE, NODE, 1);
+    tagSol   = m.CreateTag(tagNameSol,    DATA_REAL, NODE, NONE, 1);
+    tagSolEx = m.CreateTag(tagNameSolEx,  DATA_REAL, NODE, NONE, 1);
+
+    // Set diffusion tensor
+    double D[6] = {Dxx,Dyy,Dzz,Dxy,Dxz,Dyz};
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++) if(icell->GetStatus() != Element::Ghost)
+    {
+        for(int k = 0; k < 6; ++k)
+            icell->RealArray(tagD)[k] = D[k];
+    }
+    m.ExchangeData(tagD, CELL);
+
+    // Set boundary conditions
+    // Mark and count Dirichlet nodes
+    // Compute RHS and exact solution
+    mrkDirNode = m.CreateMarker();
+    m.MarkBoundaryFaces(mrkDirNode);
+    numDirNodes = 0;
+    nodeRHS.assign(m.NodeLastLocalID(), 0.);
+    for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++)
+    {
+        Node node = inode->getAsNode();
+        double x[3];
+        node.Barycenter(x);
+        node.Real(tagSolEx) = exactSolution(x);
+        node.Real(tagSol) = 0.0;
+        nodeRHS[node.LocalID()] = exactSolutionRHS(x);
+
+        if(node.nbAdjElements(FACE, mrkDirNode))
+        {
+            node.SetMarker(mrkDirNode);
+            if(node.GetStatus() != Element::Ghost)
+                numDirNodes++;
+            node.Real(tagBC) = exactSolution(x);
+        }
+    }
+    numDirNodes = m.Integrate(numDirNodes);
+    if(rank == 0) std::cout << "Number of Dirichlet nodes: " << numDirNodes << std::endl;
+
+    buildGeometry();
+
+    Automatizator::MakeCurrent(&aut);
+    INMOST_DATA_ENUM_TYPE SolTagEntryIndex = aut.RegisterTag(tagSol, NODE, mrkDirNode, true);
+    var = dynamic_variable(aut, SolTagEntryIndex);
+    aut.EnumerateEntries();
+    R = Residual("fem_diffusion", aut.GetFirstIndex(), aut.GetLastIndex());
+
+    // Unknowns enumerated by Automatizator are renumbered in node order
+    // for the solver, order is computed by each processor for its part of the mesh
+    if(reorder != REORDER_NONE)
+    {
+        std::vector<HandleType> nodeOrder;
+        reorderElements(m, NODE, reorder, nodeOrder);
+        std::vector<INMOST_DATA_ENUM_TYPE> unknowns;
+        for(size_t k = 0; k < nodeOrder.size(); k++)
+        {
+            Node node(&m, nodeOrder[k]);
+            if(node.GetStatus() != Element::Ghost && !node.GetMarker(mrkDirNode))
+                unknowns.push_back(var.Index(node));
+        }
+        perm.build(aut.GetFirstIndex(), aut.GetLastIndex(), unknowns);
+        if(m.GetProcessorsNumber() > 1)
+            perm.exchange(m, NODE, [this](const Element &e)
+                          { return e.GetMarker(mrkDirNode) ? ENUMUNDEF : var.Index(e); });
+    }
+    prof.add(T_INIT, Timer() - t);
+}
+
+// Barycentric coordinates are l = Bk^-1 (x - x0) for l1..l3, l0 = 1 - l1 - l2 - l3,
+// so gradients of basis functions 1..3 are rows of Bk^-1
+void Problem::buildGeometry()
+{
+    int ncells = m.NumberOfCells();
+    geom.cells.clear();
+    geom.cells.reserve(ncells);
+    geom.nodes.reserve(4*ncells);
+    geom.vol.reserve(ncells);
+    geom.grad.reserve(12*ncells);
+    std::vector<HandleType> order;
+    reorderElements(m, CELL, reorder, order);
+    if(order.empty())
+        for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            order.push_back(icell->GetHandle());
+    for(size_t k = 0; k < order.size(); k++)
+    {
+        Cell cell(&m, order[k]);
+        ElementArray<Node> nodes = cell.getNodes();
+        if(nodes.size() != 4)
+        {
+            std::cout << "Cell " << cell.GlobalID() << " has " << nodes.size() << " nodes, tetrahedral mesh is needed" << std::endl;
+            exit(1);
+        }
+        double x[4][3];
+        for(int i = 0; i < 4; i++)
+            nodes[i].Barycenter(x[i]);
+
+        fMatrix<3,3> Bk;
+        for(int d = 0; d < 3; d++)
+            for(int j = 0; j < 3; j++)
+                Bk(d,j) = x[j+1][d] - x[0][d];
+        int ierr;
+        fMatrix<3,3> invBk = Bk.Invert(&ierr);
+        if(ierr)
+        {
+            std::cout << "Degenerate cell " << cell.GlobalID() << std::endl;
+            exit(1);
+        }
+
+        geom.cells.push_back(cell.GetHandle());
+        for(int i = 0; i < 4; i++)
+            geom.nodes.push_back(nodes[i].GetHandle());
+        geom.vol.push_back(fabs(det(Bk)) / 6.);
+        for(int d = 0; d < 3; d++)
+            geom.grad.push_back(-invBk(0,d) - invBk(1,d) - invBk(2,d));
+        for(int i = 0; i < 3; i++)
+            for(int d = 0; d < 3; d++)
+                geom.grad.push_back(invBk(i,d));
+    }
+}
+
+void Problem::assembleGlobalSystem()
+{
+    double t = Timer();
+    for(int k = 0; k < static_cast<int>(geom.cells.size()); k++)
+        assembleCell(k);
+    prof.add(T_ASSEMBLE, Timer() - t);
+}
+
+fMatrix<4,4> Problem::computeStiffMatrix(int k)
+{
+    Storage::real_array Dt = m.RealArray(geom.cells[k], tagD);
+    fMatrix<3,3> Dk; // Diffusion tensor
+    Dk(0,0) = Dt[0];
+    Dk(1,1) = Dt[1];
+    Dk(2,2) = Dt[2];
+    Dk(0,1) = Dk(1,0) = Dt[3];
+    Dk(0,2) = Dk(2,0) = Dt[4];
+    Dk(1,2) = Dk(2,1) = Dt[5];
+
+    const double *g = &geom.grad[12*k];
+    fMatrix<4,4> W;
+    for(int i = 0; i < 4; i++)
+    {
+        double Dg[3];
+        for(int d = 0; d < 3; d++)
+            Dg[d] = Dk(d,0)*g[3*i] + Dk(d,1)*g[3*i+1] + Dk(d,2)*g[3*i+2];
+        for(int j = 0; j < 4; j++)
+            W(i,j) = geom.vol[k] * (Dg[0]*g[3*j] + Dg[1]*g[3*j+1] + Dg[2]*g[3*j+2]);
+    }
+    return W;
+}
+
+// Add contribution of one cell to global system,
+// source is integrated by the vertex rule: V/4 * f at each node
+void Problem::assembleCell(int k)
+{
+    LinearResidual LR(R, true);
+    fMatrix<4,4> W = computeStiffMatrix(k);
+    Node nodes[4];
+    for(int i = 0; i < 4; i++)
+        nodes[i] = Node(&m, geom.nodes[4*k+i]);
+
+    for(int i = 0; i < 4; i++)
+    {
+        if(nodes[i].GetMarker(mrkDirNode)) // boundary node
+        {
+            double bcVal = nodes[i].Real(tagBC);
+            for(int j = 0; j < 4; j++)
+                if(nodes[j].GetStatus() != Element::Ghost && !nodes[j].GetMarker(mrkDirNode))
+                    LR.add(var.Index(nodes[j]), bcVal * W(j,i));
+        }
+        else if(nodes[i].GetStatus() != Element::Ghost) // Node with unknown
+        {
+            for(int j = 0; j < 4; j++)
+                if(!nodes[j].GetMarker(mrkDirNode))
+                    LR.add(var.Index(nodes[i]), W(j,i), var, nodes[j]);
+            LR.add(var.Index(nodes[i]), -0.25 * geom.vol[k] * nodeRHS[nodes[i].LocalID()]);
+        }
+    }
+}
+
+void Problem::setSolverMatrix(Solver &S)
+{
+    perm.setMatrix(S, R.GetJacobian());
+    if(perm.empty())
+        return;
+    double bw0 = m.AggregateMax(static_cast<double>(matrixBandwidth(R.GetJacobian())));
+    double bw = m.AggregateMax(static_cast<double>(matrixBandwidth(perm.getMatrix())));
+    if(rank == 0) std::cout << "Matrix bandwidth: " << bw0 << " -> " << bw << " after reordering" << std::endl;
+    prof.setValue("bandwidth_original", bw0);
+    prof.setValue("bandwidth", bw);
+}
+
+void Problem::solveSystem()
+{
+    Solver S(solverOpt.type, solverOpt.prefix);
+    S.SetParameter("relative_tolerance", "1e-10");
+    S.SetParameter("absolute_tolerance", "1e-13");
+    double t = Timer();
+    setSolverMatrix(S);
+    prof.add(T_PRECOND, Timer() - t);
+
+    Sparse::Vector sol;
+    sol.SetInterval(aut.GetFirstIndex(), aut.GetLastIndex());
+    std::fill(sol.Begin(), sol.End(), 0.0);
+    t = Timer();
+    bool solved = perm.solve(S, R.GetResidual(), sol);
+    prof.add(T_SOLVE, Timer() - t);
+    if(!solved)
+    {
+        std::cout << "Linear solver failed: " << S.GetReason() << std::endl;
+        std::cout << "Residual: " << S.Residual() << std::endl;
+        exit(1);
+    }
+    if(rank == 0) std::cout << "Linear solver iterations: " << S.Iterations() << std::endl;
+    prof.count("linear_iterations", S.Iterations());
+
+    t = Timer();
+    double Cnorm = 0.0;
+    for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++) if(inode->GetStatus() != Element::Ghost)
+    {
+        if(inode->GetMarker(mrkDirNode))
+            inode->Real(tagSol) = inode->Real(tagBC);
+        else
+            inode->Real(tagSol) -= sol[var.Index(inode->self())];
+        Cnorm = std::max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
+    }
+    m.ExchangeData(tagSol, NODE);
+    Cnorm = m.AggregateMax(Cnorm);
+    if(rank == 0) std::cout << "|err|_C = " << Cnorm << std::endl;
+    prof.setValue("err_C", Cnorm);
+    prof.add(T_UPDATE, Timer() - t);
+}
+
+void Problem::saveSolution(std::string prefix)
+{
+    double t = Timer();
+    std::string extension;
+    if(m.GetProcessorsNumber() > 1)
+        extension = ".pvtk";
+    else
+        extension = ".vtk";
+    m.Save(prefix + extension);
+    prof.add(T_IO, Timer() - t);
+}
+
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        std::cout << "Usage: " << argv[0] << " <mesh_file> [-reorder rcm|sfc] [-solver <type>] [-solver_db <file>] [-mesh_save <file.pmf>]" << std::endl;
+        return 1;
+    }
+    std::string meshSave;
+    int reorder = REORDER_NONE;
+    SolverOptions solverOpt("inner_ilu2", "test", "database.xml");
+    for(int i = 2; i < argc; i++)
+    {
+        std::string opt(argv[i]);
+        if(opt == "-reorder" && i+1 < argc)
+            reorder = parseReorderMethod(argv[++i]);
+        else if(opt == "-mesh_save" && i+1 < argc)
+            meshSave = argv[++i];
+        else if(!solverOpt.parse(i, argc, argv))
+        {
+            std::cout << "Unknown option " << opt << std::endl;
+            return 1;
+        }
+    }
+
+    Solver::Initialize(&argc, &argv, solverOpt.database.c_str());
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    Problem* P = new Problem(argv[1]);
+    if(!meshSave.empty())
+    {
+        // Preprocessing only: later runs load the prepared mesh
+        P->saveMesh(meshSave);
+        delete P;
+        Partitioner::Finalize();
+        Solver::Finalize();
+        Mesh::Finalize();
+        return 0;
+    }
+    P->setSolver(solverOpt);
+    P->setReorder(reorder);
+    P->initProblem();
+    P->assembleGlobalSystem();
+    P->solveSystem();
+    P->saveSolution("res");
+
+    delete P;
+
+    Partitioner::Finalize();
+    Solver::Finalize();
+    Mesh::Finalize();
+
+    return 0;
+}
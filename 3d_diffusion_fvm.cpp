@@ -0,0 +1,381 @@
+#include "inmost.h"
+#include "profiling.h"
+#include "solver_options.h"
+#include "mesh_cache.h"
+#include "fv_tpfa.h"
+#include "reordering.h"
+
+//    Can be run in parallel: mesh is partitioned at load,
+//    a layer of ghost cells across faces is added,
+//    and residuals are assembled for owned cells only.
+//
+//
+//    This code solves the following
+//    boundary value problem for diffusion equation
+//
+//    div(-D grad U) = f       in unit cube
+//    U              = g       on boundary
+//
+//    D is diffusion tensor, s.p.d. 3x3 matrix defined by 6 numbers Dxx, Dyy, Dzz, Dxy, Dxz, Dyz.
+//    Two-point flux approximation (see fv_tpfa.h) is consistent for
+//    K-orthogonal meshes, e.g. for diagonal tensor on hexahedral meshes,
+//    on other meshes the error does not vanish with refinement.
+//
+//    The user should provide 3D mesh
+//    (preferrably, a .vtk file which can be generated by Gmsh for example)
+//    which is built for (0;1)x(0;1)x(0;1)
+//
+//    The code will then
+//    - process mesh,
+//    - init tags,
+//    - assemble linear system by a loop over faces,
+//    - solve it with INMOST inner linear solver,
+//    - save solution in a .vtk file.
+
+
+using namespace INMOST;
+
+const std::string tagNameTensor = "DIFFUSION_TENSOR";
+const std::string tagNameBC     = "BOUNDARY_CONDITION";
+const std::string tagNameSol    = "SOLUTION";
+const std::string tagNameSolEx  = "SOLUTION_EXACT";
+
+const double Dxx = 10;
+const double Dyy = 2;
+const double Dzz = 1;
+const double Dxy = 0;
+const double Dxz = 0;
+const double Dyz = 0;
+
+#ifndef M_PI
+const double M_PI = 3.1415926535898;
+#endif
+
+double exactSolution(double *x)
+{
+    return sin(M_PI*x[0]) * sin(M_PI*x[1]) * sin(M_PI*x[2]);
+}
+
+double exactSolutionRHS(double *x)
+{
+    return M_PI*M_PI * ((Dxx+Dyy+Dzz) * exactSolution(x)
+            - 2*Dxy*cos(M_PI*x[0])*cos(M_PI*x[1])*sin(M_PI*x[2])
+            - 2*Dxz*cos(M_PI*x[0])*sin(M_PI*x[1])*cos(M_PI*x[2])
+            - 2*Dyz*sin(M_PI*x[0])*cos(M_PI*x[1])*cos(M_PI*x[2])
+            );
+}
+
+class Problem
+{
+private:
+    Mesh m;
+    // List of mesh tags
+    Tag tagD;     // Diffusion tensor
+    Tag tagBC;    // Boundary conditions on faces: type and value
+    Tag tagSol;   // Solution
+    Tag tagSolEx; // Exact solution
+
+    Automatizator aut;    // Automatizator to handle all AD things
+    Residual R;           // Residual to assemble
+    dynamic_variable var; // Variable containing solution
+
+    FV_Diffusion_TPFA *tpfa; // transmissibilities, built after tags are set
+
+    int rank; // for parallel runs
+
+    int reorder;             // ordering of unknowns, see reordering.h
+    UnknownPermutation perm; // unknowns in cell order, empty without reordering
+
+    SolverOptions solverOpt; // type and parameters of linear solver
+
+    Profiler prof; // run-time statistics
+
+public:
+    Problem(std::string meshName);
+    ~Problem();
+    void initProblem(); // create tags and set parameters
+    void assembleGlobalSystem(); // assemble global linear system
+    void setSolver(const SolverOptions &o) { solverOpt = o; }
+    void setReorder(int r) { reorder = r; }
+    void setSolverMatrix(Solver &S); // give Jacobian to S in the order of unknowns
+    void solveSystem();
+    void saveSolution(std::string path); // save mesh with solution
+    void saveMesh(std::string path) { saveMeshCache(m, path); } // save prepared mesh to .pmf
+};
+
+Problem::Problem(std::string meshName)
+{
+    tpfa = NULL;
+    reorder = REORDER_NONE;
+
+    m.SetCommunicator(INMOST_MPI_COMM_WORLD);
+    rank = m.GetProcessorRank();
+
+    double t = Timer();
+
+    // Cache made for this number of processors is already partitioned
+    bool cached = loadMesh(m, meshName);
+    if(rank == 0 && !m.isParallelFileFormat(meshName))
+    {
+        std::cout << "Number of cells: " << m.NumberOfCells() << std::endl;
+        std::cout << "Number of faces: " << m.NumberOfFaces() << std::endl;
+    }
+
+    if(!cached)
+    {
+        if(m.GetProcessorsNumber() > 1)
+        {
+            Partitioner part(&m);
+            part.SetMethod(Partitioner::INNER_KMEANS, Partitioner::Partition);
+            part.Evaluate();
+            m.Redistribute();
+            m.AssignGlobalID(CELL|FACE|NODE);
+            // TPFA needs a layer of cells across each face
+            m.ExchangeGhost(1, FACE);
+        }
+        else
+            m.AssignGlobalID(CELL|FACE|NODE);
+
+        Mesh::GeomParam param;
+        param[MEASURE] = CELL|FACE;
+        param[ORIENTATION] = FACE;
+        param[NORMAL] = FACE;
+        param[CENTROID] = CELL|FACE;
+        param[BARYCENTER] = CELL|FACE;
+        m.PrepareGeometricData(param);
+    }
+
+    prof.add(T_IO, Timer() - t);
+}
+
+Problem::~Problem()
+{
+    delete tpfa;
+    prof.report(m, "stats");
+}
+
+void Problem::initProblem()
+{
+    double t = Timer();
+    tagD     = m.CreateTag(tagNameTensor, DATA_REAL, CELL, NONE, 6);
+    tagBC    = m.CreateTag(tagNameBC,     DATA_REAL, FACE, FACE, 2);
+    tagSol   = m.CreateTag(tagNameSol,    DATA_REAL, CELL, NONE, 1);
+    tagSolEx = m.CreateTag(tagNameSolEx,  DATA_REAL, CELL, NONE, 1);
+
+    // Set diffusion tensor, ghost cells receive it from owners
+    double D[6] = {Dxx,Dyy,Dzz,Dxy,Dxz,Dyz};
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++) if(icell->GetStatus() != Element::Ghost)
+    {
+        for(int k = 0; k < 6; ++k)
+            icell->RealArray(tagD)[k] = D[k];
+    }
+    m.ExchangeData(tagD, CELL);
+
+    // Exact solution and initial guess
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
+    {
+        double x[3];
+        icell->Barycenter(x);
+        icell->Real(tagSolEx) = exactSolution(x);
+        icell->Real(tagSol) = 0.0;
+    }
+
+    // Set boundary conditions: Dirichlet on the whole boundary
+    MarkerType mrkBnd = m.CreateMarker();
+    m.MarkBoundaryFaces(mrkBnd);
+    int numBndFaces = 0;
+    for(Mesh::iteratorFace iface = m.BeginFace(); iface != m.EndFace(); iface++) if(iface->GetMarker(mrkBnd))
+    {
+        double x[3];
+        iface->Barycenter(x);
+        iface->RealArray(tagBC)[0] = 0.0;
+        iface->RealArray(tagBC)[1] = exactSolution(x);
+        if(iface->GetStatus() != Element::Ghost)
+            numBndFaces++;
+    }
+    m.ReleaseMarker(mrkBnd, FACE);
+    numBndFaces = m.Integrate(numBndFaces);
+    if(rank == 0) std::cout << "Number of boundary faces: " << numBndFaces << std::endl;
+
+    tpfa = new FV_Diffusion_TPFA(&m, tagNameTensor, tagNameBC);
+    tpfa->build();
+
+    Automatizator::MakeCurrent(&aut);
+    INMOST_DATA_ENUM_TYPE SolTagEntryIndex = aut.RegisterTag(tagSol, CELL);
+    var = dynamic_variable(aut, SolTagEntryIndex);
+    aut.EnumerateEntries();
+    R = Residual("fvm_diffusion", aut.GetFirstIndex(), aut.GetLastIndex());
+
+    // Unknowns enumerated by Automatizator are renumbered in cell order
+    // for the solver, order is computed by each processor for its part of the mesh
+    if(reorder != REORDER_NONE)
+    {
+        std::vector<HandleType> cellOrder;
+        reorderElements(m, CELL, reorder, cellOrder);
+        std::vector<INMOST_DATA_ENUM_TYPE> unknowns;
+        for(size_t k = 0; k < cellOrder.size(); k++)
+        {
+            Cell cell(&m, cellOrder[k]);
+            if(cell.GetStatus() != Element::Ghost)
+                unknowns.push_back(var.Index(cell));
+        }
+        perm.build(aut.GetFirstIndex(), aut.GetLastIndex(), unknowns);
+        if(m.GetProcessorsNumber() > 1)
+            perm.exchange(m, CELL, [this](const Element &e) { return var.Index(e); });
+    }
+    prof.add(T_INIT, Timer() - t);
+}
+
+// Each face adds its flux to owned cells on both sides:
+// faces between owned and ghost cells are visited by both processors,
+// each of which fills the row of its own cell
+void Problem::assembleGlobalSystem()
+{
+    double t = Timer();
+    for(Mesh::iteratorFace iface = m.BeginFace(); iface != m.EndFace(); iface++)
+    {
+        Face f = iface->getAsFace();
+        Cell cp = f.BackCell(), cm = f.FrontCell();
+        bool ownP = cp.GetStatus() != Element::Ghost;
+        bool ownM = cm.isValid() && cm.GetStatus() != Element::Ghost;
+        if(!ownP && !ownM)
+            continue;
+        // Total flux -D grad U . n from back to front cell
+        variable q = -f.Area() * tpfa->getDgradU(f, var);
+        if(ownP)
+            R[var.Index(cp)] += q;
+        if(ownM)
+            R[var.Index(cm)] -= q;
+    }
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++) if(icell->GetStatus() != Element::Ghost)
+    {
+        Cell cell = icell->getAsCell();
+        double x[3];
+        cell.Barycenter(x);
+        R[var.Index(cell)] -= exactSolutionRHS(x) * cell.Volume();
+    }
+    prof.add(T_ASSEMBLE, Timer() - t);
+}
+
+void Problem::setSolverMatrix(Solver &S)
+{
+    perm.setMatrix(S, R.GetJacobian());
+    if(perm.empty())
+        return;
+    double bw0 = m.AggregateMax(static_cast<double>(matrixBandwidth(R.GetJacobian())));
+    double bw = m.AggregateMax(static_cast<double>(matrixBandwidth(perm.getMatrix())));
+    if(rank == 0) std::cout << "Matrix bandwidth: " << bw0 << " -> " << bw << " after reordering" << std::endl;
+    prof.setValue("bandwidth_original", bw0);
+    prof.setValue("bandwidth", bw);
+}
+
+void Problem::solveSystem()
+{
+    Solver S(solverOpt.type, solverOpt.prefix);
+    S.SetParameter("relative_tolerance", "1e-10");
+    S.SetParameter("absolute_tolerance", "1e-13");
+    double t = Timer();
+    setSolverMatrix(S);
+    prof.add(T_PRECOND, Timer() - t);
+
+    Sparse::Vector sol;
+    sol.SetInterval(aut.GetFirstIndex(), aut.GetLastIndex());
+    std::fill(sol.Begin(), sol.End(), 0.0);
+    t = Timer();
+    bool solved = perm.solve(S, R.GetResidual(), sol);
+    prof.add(T_SOLVE, Timer() - t);
+    if(!solved)
+    {
+        std::cout << "Linear solver failed: " << S.GetReason() << std::endl;
+        std::cout << "Residual: " << S.Residual() << std::endl;
+        exit(1);
+    }
+    if(rank == 0) std::cout << "Linear solver iterations: " << S.Iterations() << std::endl;
+    prof.count("linear_iterations", S.Iterations());
+
+    t = Timer();
+    double Cnorm = 0.0, L2norm = 0.0;
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++) if(icell->GetStatus() != Element::Ghost)
+    {
+        icell->Real(tagSol) -= sol[var.Index(icell->self())];
+        double err = fabs(icell->Real(tagSol) - icell->Real(tagSolEx));
+        Cnorm = std::max(Cnorm, err);
+        L2norm += err * err * icell->getAsCell().Volume();
+    }
+    m.ExchangeData(tagSol, CELL);
+    Cnorm = m.AggregateMax(Cnorm);
+    L2norm = sqrt(m.Integrate(L2norm));
+    if(rank == 0) std::cout << "|err|_C  = " << Cnorm << std::endl;
+    if(rank == 0) std::cout << "|err|_L2 = " << L2norm << std::endl;
+    prof.setValue("err_C", Cnorm);
+    prof.setValue("err_L2", L2norm);
+    prof.add(T_UPDATE, Timer() - t);
+}
+
+void Problem::saveSolution(std::string prefix)
+{
+    double t = Timer();
+    std::string extension;
+    if(m.GetProcessorsNumber() > 1)
+        extension = ".pvtk";
+    else
+        extension = ".vtk";
+    m.Save(prefix + extension);
+    prof.add(T_IO, Timer() - t);
+}
+
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        std::cout << "Usage: " << argv[0] << " <mesh_file> [-reorder rcm|sfc] [-solver <type>] [-solver_db <file>] [-mesh_save <file.pmf>]" << std::endl;
+        return 1;
+    }
+    std::string meshSave;
+    int reorder = REORDER_NONE;
+    SolverOptions solverOpt("inner_ilu2", "test", "database.xml");
+    for(int i = 2; i < argc; i++)
+    {
+        std::string opt(argv[i]);
+        if(opt == "-reorder" && i+1 < argc)
+            reorder = parseReorderMethod(argv[++i]);
+        else if(opt == "-mesh_save" && i+1 < argc)
+            meshSave = argv[++i];
+        else if(!solverOpt.parse(i, argc, argv))
+        {
+            std::cout << "Unknown option " << opt << std::endl;
+            return 1;
+        }
+    }
+
+    Solver::Initialize(&argc, &argv, solverOpt.database.c_str());
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    Problem* P = new Problem(argv[1]);
+    if(!meshSave.empty())
+    {
+        // Preprocessing only: later runs load the prepared mesh
+        P->saveMesh(meshSave);
+        delete P;
+        Partitioner::Finalize();
+        Solver::Finalize();
+        Mesh::Finalize();
+        return 0;
+    }
+    P->setSolver(solverOpt);
+    P->setReorder(reorder);
+    P->initProblem();
+    P->assembleGlobalSystem();
+    P->solveSystem();
+    P->saveSolution("res");
+
+    delete P;
+
+    Partitioner::Finalize();
+    Solver::Finalize();
+    Mesh::Finalize();
+
+    return 0;
+}
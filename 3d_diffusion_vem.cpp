@@ -1,6 +1,27 @@
 #include "inmost.h"
+#include "coloring.h"
+#include "fixed_matrix.h"
+#include "profiling.h"
+#include "solver_options.h"
+#include "linear_residual.h"
+#include "shape_cache.h"
+#include "matrix_free.h"
+#include "reordering.h"
+#include "mesh_cache.h"
+#include "load_balance.h"
+#include "halo_overlap.h"
+#include "tensor_tag.h"
+#include "memory_report.h"
+#if defined(USE_OMP)
+#include <omp.h>
+#endif
 
-//    !!!!!!! Currently NOT suited for parallel run
+//    Can be run in parallel: mesh is partitioned at load (optionally
+//    with cell weights and repartitioned by measured cost, see load_balance.h),
+//    a layer of ghost cells across nodes is added,
+//    and rows are assembled for owned nodes only; with -overlap ghost
+//    exchanges overlap assembly of interior cells (see halo_overlap.h).
+//    Solution is saved to .pvtk in parallel runs.
 //
 //
 //    This code solves the following
@@ -25,21 +46,14 @@
 
 using namespace INMOST;
 
-enum
-{
-    T_ASSEMBLE = 0,
-    T_SOLVE,
-    T_PRECOND,
-    T_IO,
-    T_INIT,
-    T_UPDATE
-};
-
 const std::string tagNameTensor = "DIFFUSION_TENSOR";
 const std::string tagNameBC     = "BOUNDARY_CONDITION";
 const std::string tagNameRHS    = "RHS";
 const std::string tagNameSol    = "SOLUTION";
 const std::string tagNameSolEx  = "SOLUTION_EXACT";
+const std::string tagNameDiam   = "VEM_DIAMETER";
+const std::string tagNameLocal  = "VEM_LOCAL_INDEX";
+const std::string tagNameMFX    = "VEM_MATFREE_X";
 
 const int n_polys = 4;
 
@@ -59,22 +73,53 @@ const double Dyz = 0;
 const double M_PI = 3.1415926535898;
 #endif
 
-double exactSolution(double *x)
+// a is frequency of solution, it is changed for cases of a sweep
+double exactSolution(double *x, double a = M_PI)
 {
     //return x[0];//sin(M_PI*x[0]) * sin(M_PI*x[1]);
-    return sin(M_PI*x[0]) * sin(M_PI*x[1]) * sin(M_PI*x[2]);
+    return sin(a*x[0]) * sin(a*x[1]) * sin(a*x[2]);
 }
 
-double exactSolutionRHS(double *x)
+double exactSolutionRHS(double *x, double a = M_PI)
 {
     //return 0;//M_PI*M_PI * ((Dxx+Dyy) * exactSolution(x) - 2*Dxy*cos(M_PI*x[0])*cos(M_PI*x[1]));
-    return M_PI*M_PI * ((Dxx+Dyy+Dzz) * exactSolution(x)
-		    - 2*Dxy*cos(M_PI*x[0])*cos(M_PI*x[1])*sin(M_PI*x[2])
-		    - 2*Dxz*cos(M_PI*x[0])*sin(M_PI*x[1])*cos(M_PI*x[2])
-		    - 2*Dyz*sin(M_PI*x[0])*cos(M_PI*x[1])*cos(M_PI*x[2])
+    return a*a * ((Dxx+Dyy+Dzz) * exactSolution(x, a)
+		    - 2*Dxy*cos(a*x[0])*cos(a*x[1])*sin(a*x[2])
+		    - 2*Dxz*cos(a*x[0])*sin(a*x[1])*cos(a*x[2])
+		    - 2*Dyz*sin(a*x[0])*cos(a*x[1])*cos(a*x[2])
 		    );
 }
 
+// Scratch matrices of local VEM system, one per thread.
+// They are resized only when number of cell nodes changes,
+// so assembly on meshes with one cell type does not allocate memory.
+struct VEMWorkspace
+{
+    int nn;       // number of nodes the matrices are sized for
+    rMatrix D;    // nn x n_polys, monomials at nodes
+    rMatrix B;    // n_polys x nn
+    rMatrix Proj; // n_polys x nn, projector coefficients
+    rMatrix GP;   // n_polys x nn, G * Proj
+    rMatrix Se;   // nn x nn, stabilization
+    rMatrix W;    // nn x nn, local stiffness
+    rMatrix rhs;  // nn x 1
+    ShapeCache::Key key; // shape of current cell
+    VEMWorkspace() : nn(-1) {}
+    void resize(int n)
+    {
+        if(n == nn)
+            return;
+        nn = n;
+        D.Resize(n, n_polys);
+        B.Resize(n_polys, n);
+        Proj.Resize(n_polys, n);
+        GP.Resize(n_polys, n);
+        Se.Resize(n, n);
+        W.Resize(n, n);
+        rhs.Resize(n, 1);
+    }
+};
+
 class Problem
 {
 private:
@@ -84,6 +129,8 @@ private:
     Tag tagBC;    // Boundary conditions
     Tag tagSol;   // Solution
     Tag tagSolEx; // Exact solution
+    Tag tagDiam;  // Cell diameter
+    Tag tagLocal; // Index of node in cell being assembled
 
     MarkerType mrkDirNode;  // Dirichlet node marker
 
@@ -95,100 +142,229 @@ private:
 
     int numDirNodes;
 
-    double times[10];
-    double ttt; // global timer
+    bool useColoring;     // assemble cells concurrently by colors
+
+    bool useOverlap;      // process interior cells while ghost data is exchanged
+    HaloExchange exchD;   // exchange of diffusion tensor, completed before halo cells
+    HaloExchange exchX;   // exchange of matrix-free operand
+
+    // Cells grouped by color (single group without coloring); with overlap
+    // groups hold interior cells and haloGroups the rest, see halo_overlap.h
+    std::vector< std::vector<HandleType> > groups, haloGroups;
+
+    int reorder;          // ordering of cell loops, see reordering.h
+    std::vector<HandleType> cellOrder; // local cells in assembly order
+    UnknownPermutation perm; // unknowns in node order, empty without reordering
+
+    bool useNumeric;      // assemble linear residual without AD expressions
+    std::vector<VEMWorkspace> work; // local system scratch, one per thread
+
+    bool useShapeCache;   // reuse W for cells of the same shape
+    ShapeCache shapes;    // W of already met shapes
+
+    bool useMatrixFree;   // apply matrix by cells instead of storing it
+    Tag tagMFX;           // operand of matrix-free product, exchanged to ghost nodes
+    std::vector<double> mfRHS;  // right-hand side by node LocalID, zero for ghost and Dirichlet nodes
+    std::vector<double> mfDiag; // diagonal of matrix for Jacobi preconditioner
+
+    SolverOptions solverOpt; // type and parameters of linear solver
+
+    double freq;          // frequency of exact solution of current case
+    bool rhsOnly;         // assemble only residual of zero initial guess, Jacobian is kept
+
+    int costModel;        // cell cost for load balance, see load_balance.h
+    double rebalance;     // repartition if imbalance is above it, 0 - never
+    Partitioner::Type graphPartitioner;
+    bool recordTime;      // keep assembly time of each cell in ASSEMBLY_TIME
+    Tag tagCost;
+
+    bool compactTensor;   // constant tensor is stored once on the mesh, see tensor_tag.h
+    MemoryReport mem;     // memory used by tags, topology, matrix and solver
+
+    Profiler prof; // run-time statistics
 
 public:
     Problem(std::string meshName);
     ~Problem();
     void initProblem(); // create tags and set parameters
     void assembleGlobalSystem(); // assemble global linear system
-    void assembleLocalSystem(Cell &, rMatrix &, rMatrix &);
+    void assembleCell(Cell &);    // add contribution of one cell
+    void setColoring(bool b) { useColoring = b; }
+    void setOverlap(bool b) { useOverlap = b; }
+    void prepareGroups();
+    void assembleGroups(const std::vector< std::vector<HandleType> > &);
+    void multiplyGroups(const std::vector< std::vector<HandleType> > &, std::vector<double> &);
+    void setReorder(int r) { reorder = r; }
+    void setSolver(const SolverOptions &o) { solverOpt = o; }
+    void setNumeric(bool b) { useNumeric = b; }
+    void setShapeCache(bool b) { useShapeCache = b; }
+    void setMatrixFree(bool b) { useMatrixFree = b; }
+    void multiplyCell(Cell &, std::vector<double> &);
+    void multiply(const std::vector<double> &x, std::vector<double> &y); // y = A*x by cells
+    double dot(const std::vector<double> &a, const std::vector<double> &b);
+    void assembleLocalSystem(Cell &, ElementArray<Node> &, VEMWorkspace &);
+    void setCase(int k); // boundary data and exact solution of case k of a sweep
     void solveSystem();
+    bool solveRHS(Solver &S); // solve with matrix already given to S
+    void setSolverMatrix(Solver &S); // give Jacobian to S in the order of unknowns
+    void solveSweep(int n);   // solve n cases with the same matrix
+    void solveMatrixFree();
     void saveSolution(std::string path); // save mesh with solution
+    void saveMesh(std::string path) { saveMeshCache(m, path); } // save prepared mesh to .pmf
+    void prepareGeometry();
+    void setBalance(int model, double threshold, Partitioner::Type type)
+    { costModel = model; rebalance = threshold; graphPartitioner = type; }
+    void setRecordTime(bool b) { recordTime = b; }
+    void setCompactTensor(bool b) { compactTensor = b; }
+    void setMemoryReport(bool b) { mem.enable(b); }
+    void balanceLoad(); // report imbalance of cell costs, repartition if needed
+    void assembleCellTimed(Cell &);
 };
 
 Problem::Problem(std::string meshName)
 {
-    ttt = Timer();
-    for(int i = 0; i < 10; i++)
-        times[i] = 0.;
+    useColoring = false;
+    useOverlap = false;
+    reorder = REORDER_NONE;
+    useNumeric = false;
+    useShapeCache = false;
+    useMatrixFree = false;
+    freq = M_PI;
+    rhsOnly = false;
+    costModel = COST_UNIFORM;
+    rebalance = 0.0;
+    graphPartitioner = Partitioner::Parmetis;
+    recordTime = false;
+    compactTensor = false;
 
     m.SetCommunicator(INMOST_MPI_COMM_WORLD);
     rank = m.GetProcessorRank();
 
     double t = Timer();
 
-    if(m.isParallelFileFormat(meshName))
-	    m.Load(meshName);
-    else if(rank == 0)
+    // Cache made for this number of processors is already partitioned
+    bool cached = loadMesh(m, meshName);
+    if(rank == 0 && !m.isParallelFileFormat(meshName))
     {
-        m.Load(meshName);
         std::cout << "Number of cells: " << m.NumberOfCells() << std::endl;
         std::cout << "Number of faces: " << m.NumberOfFaces() << std::endl;
         std::cout << "Number of edges: " << m.NumberOfEdges() << std::endl;
         std::cout << "Number of nodes: " << m.NumberOfNodes() << std::endl;
     }
 
-    if(m.GetProcessorsNumber() > 1)
+    if(!cached)
     {
-	Partitioner part(&m);
-	part.SetMethod(Partitioner::INNER_KMEANS, Partitioner::Partition);
-	part.Evaluate();
-	m.Redistribute();
-	m.AssignGlobalID(NODE);
-	m.ExchangeGhost(1, NODE);
+        if(m.GetProcessorsNumber() > 1)
+        {
+            Partitioner part(&m);
+            part.SetMethod(Partitioner::INNER_KMEANS, Partitioner::Partition);
+            part.Evaluate();
+            m.Redistribute();
+            m.AssignGlobalID(NODE);
+            m.ExchangeGhost(1, NODE);
+        }
+        else
+            m.AssignGlobalID(NODE);
+
+        prepareGeometry();
     }
-    else
-	m.AssignGlobalID(NODE);
-    	
+
+    prof.add(T_IO, Timer() - t);
+}
+
+void Problem::prepareGeometry()
+{
+    Mesh::GeomParam param;
+    param[MEASURE] = CELL|FACE;
+    param[ORIENTATION] = FACE;
+    param[NORMAL] = FACE;
+    param[CENTROID] = CELL|FACE;
+    param[BARYCENTER] = CELL|FACE;
+    m.PrepareGeometricData(param);
+}
+
+// Geometric partitioning balances numbers of cells, not their costs.
+// Imbalance of cell weights is reported, and above threshold the mesh
+// is repartitioned by graph partitioner with these weights
+void Problem::balanceLoad()
+{
+    if(m.GetProcessorsNumber() == 1 || costModel == COST_UNIFORM)
+        return;
+    double t = Timer();
+    Tag tagW = setCellWeights(m, costModel);
+    double imb = weightImbalance(m, tagW);
+    if(rank == 0) std::cout << "Load imbalance (max/avg of cell weights): " << imb << std::endl;
+    if(rebalance > 0.0 && imb > rebalance)
     {
-	    Mesh::GeomParam param;
-	    param[MEASURE] = CELL|FACE;
-	    param[ORIENTATION] = FACE;
-	    param[NORMAL] = FACE;
-	    param[CENTROID] = CELL|FACE;
-	    param[BARYCENTER] = CELL|FACE;
-	    m.PrepareGeometricData(param);
+        repartitionWeighted(m, tagW, graphPartitioner);
+        m.AssignGlobalID(NODE);
+        m.ExchangeGhost(1, NODE);
+        prepareGeometry();
+        imb = weightImbalance(m, tagW);
+        if(rank == 0) std::cout << "Load imbalance after repartitioning: " << imb << std::endl;
+        prof.count("repartitions");
     }
-
-    times[T_IO] += Timer() - t;
+    prof.setValue("imbalance_weights", imb);
+    prof.add(T_IO, Timer() - t);
 }
 
 Problem::~Problem()
 {
-	m.AggregateMax(times, 10);
-	if(rank == 0)
-	{
-		printf("\n+=========================\n");
-		printf("| T_assemble = %lf\n", times[T_ASSEMBLE]);
-		printf("| T_precond  = %lf\n", times[T_PRECOND]);
-		printf("| T_solve    = %lf\n", times[T_SOLVE]);
-		printf("| T_IO       = %lf\n", times[T_IO]);
-		printf("| T_update   = %lf\n", times[T_UPDATE]);
-		printf("| T_init     = %lf\n", times[T_INIT]);
-		printf("+-------------------------\n");
-		printf("| T_total    = %lf\n", Timer() - ttt);
-		printf("+=========================\n");
-	}
+    if(mem.isEnabled())
+    {
+        mem.addTags(m);
+        mem.addTopology(m);
+        mem.report(m, prof);
+    }
+    prof.report(m, "stats");
 }
 
 void Problem::initProblem()
 {
     double t = Timer();
-    tagD     = m.CreateTag(tagNameTensor, DATA_REAL, CELL, NONE, 6);
+    tagD     = createTensorTag(m, tagNameTensor, 6, compactTensor);
     tagBC    = m.CreateTag(tagNameBC,     DATA_REAL, NODE, NODE, 1);
     tagSol   = m.CreateTag(tagNameSol,    DATA_REAL, NODE, NONE, 1);
     tagSolEx = m.CreateTag(tagNameSolEx,  DATA_REAL, NODE, NONE, 1);
+    tagDiam  = m.CreateTag(tagNameDiam,   DATA_REAL, CELL, NONE, 1);
+    tagLocal = m.CreateTag(tagNameLocal,  DATA_INTEGER, NODE, NONE, 1);
+    if(recordTime)
+        tagCost = m.CreateTag(tagNameCost, DATA_REAL, CELL, NONE, 1);
 
     // Set diffusion tensor
     double D[6] = {Dxx,Dyy,Dzz,Dxy,Dxz,Dyz};
-    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++) if(icell->GetStatus() != Element::Ghost)
+    if(compactTensor)
+        setDefaultTensor(m, tagD, D); // same on all processors, nothing to exchange
+    else
     {
-	    for(int k = 0; k < 6; ++k)
-		    icell->RealArray(tagD)[k] = D[k];
+        for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++) if(icell->GetStatus() != Element::Ghost)
+        {
+            for(int k = 0; k < 6; ++k)
+                icell->RealArray(tagD)[k] = D[k];
+        }
+        // Only halo cells need tensor of ghost cells
+        if(useOverlap)
+            exchD.begin(m, tagD, CELL);
+        else
+            m.ExchangeData(tagD, CELL);
+    }
+
+    // Cell diameters are needed for scaling of monomials
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
+    {
+        ElementArray<Node> nodes = icell->getNodes();
+        double diam = 0.0;
+        for(unsigned i = 0; i < nodes.size(); i++)
+        {
+            Storage::real_array xi = nodes[i].Coords();
+            for(unsigned j = i+1; j < nodes.size(); j++)
+            {
+                Storage::real_array xj = nodes[j].Coords();
+                diam = std::max(diam, (xi[0]-xj[0])*(xi[0]-xj[0]) + (xi[1]-xj[1])*(xi[1]-xj[1]) + (xi[2]-xj[2])*(xi[2]-xj[2]));
+            }
+        }
+        icell->Real(tagDiam) = sqrt(diam);
     }
-    m.ExchangeData(tagD, CELL);
 
     // Set boundary conditions
     // Mark and count Dirichlet nodes
@@ -201,14 +377,14 @@ void Problem::initProblem()
         Node node = inode->getAsNode();
         double x[3];
         node.Barycenter(x);
-        node.Real(tagSolEx) = exactSolution(x);
+        node.Real(tagSolEx) = exactSolution(x, freq);
         node.Real(tagSol) = 0.0;
 
 	if(node.nbAdjElements(FACE, mrkDirNode))
 	{
 		node.SetMarker(mrkDirNode);
 		numDirNodes++;
-		node.Real(tagBC) = exactSolution(x);
+		node.Real(tagBC) = exactSolution(x, freq);
 	}
     }
     numDirNodes = m.Integrate(numDirNodes);
@@ -216,161 +392,557 @@ void Problem::initProblem()
 
     Automatizator::MakeCurrent(&aut);
 
+    if(useMatrixFree)
+    {
+        tagMFX = m.CreateTag(tagNameMFX, DATA_REAL, NODE, NONE, 1);
+        for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++)
+            inode->Real(tagMFX) = 0.0;
+    }
+
     INMOST_DATA_ENUM_TYPE SolTagEntryIndex = aut.RegisterTag(tagSol, NODE, mrkDirNode, true);
     var = dynamic_variable(aut, SolTagEntryIndex);
     aut.EnumerateEntries();
     R = Residual("vem_diffusion", aut.GetFirstIndex(), aut.GetLastIndex());
-    times[T_INIT] += Timer() - t;
+
+    // Order is computed by each processor for its part of the mesh.
+    // Cell loops follow the cell order, unknowns enumerated by Automatizator
+    // are renumbered in node order for the solver
+    reorderElements(m, CELL, reorder, cellOrder);
+    if(cellOrder.empty())
+        for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); ++icell)
+            cellOrder.push_back(icell->GetHandle());
+    if(reorder != REORDER_NONE)
+    {
+        std::vector<HandleType> nodeOrder;
+        reorderElements(m, NODE, reorder, nodeOrder);
+        std::vector<INMOST_DATA_ENUM_TYPE> unknowns;
+        for(size_t k = 0; k < nodeOrder.size(); k++)
+        {
+            Node node(&m, nodeOrder[k]);
+            if(node.GetStatus() != Element::Ghost && !node.GetMarker(mrkDirNode))
+                unknowns.push_back(var.Index(node));
+        }
+        perm.build(aut.GetFirstIndex(), aut.GetLastIndex(), unknowns);
+        if(m.GetProcessorsNumber() > 1)
+            perm.exchange(m, NODE, [this](const Element &e)
+                          { return e.GetMarker(mrkDirNode) ? ENUMUNDEF : var.Index(e); });
+    }
+    prof.add(T_INIT, Timer() - t);
+}
+
+// Case k of a sweep has exact solution with frequency (1+k/2)*pi,
+// so that both source term and boundary data change from case to case
+void Problem::setCase(int k)
+{
+    freq = M_PI * (1. + 0.5*k);
+    for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++)
+    {
+        double x[3];
+        inode->Barycenter(x);
+        inode->Real(tagSolEx) = exactSolution(x, freq);
+        inode->Real(tagSol) = 0.0;
+        if(inode->GetMarker(mrkDirNode))
+            inode->Real(tagBC) = exactSolution(x, freq);
+    }
 }
 
 void Problem::assembleGlobalSystem()
 {
     double t = Timer();
-    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); ++icell) //if(icell->GetStatus() != Element::Ghost)
+#if defined(USE_OMP)
+    work.resize(omp_get_max_threads());
+#else
+    work.resize(1);
+#endif
+    if(rhsOnly)
+        std::fill(R.GetResidual().Begin(), R.GetResidual().End(), 0.0);
+    else if(useMatrixFree)
+    {
+        // Only right-hand side and diagonal are assembled
+        mfRHS.assign(m.NodeLastLocalID(), 0.);
+        mfDiag.assign(m.NodeLastLocalID(), 0.);
+    }
+    prepareGroups();
+    assembleGroups(groups);
+    exchD.end();
+    assembleGroups(haloGroups);
+    t = Timer() - t;
+    prof.add(T_ASSEMBLE, t);
+    if(mem.isEnabled())
     {
-        Cell cell = icell->getAsCell();
+        if(useMatrixFree)
+            mem.set("matrix_free", (mfRHS.size() + mfDiag.size()) * sizeof(double));
+        else
+            mem.set("jacobian", MemoryReport::matrixBytes(R.GetJacobian()));
+    }
+    if(m.GetProcessorsNumber() > 1)
+    {
+        double imb = imbalance(m, t);
+        if(rank == 0) std::cout << "Assembly imbalance (max/avg time): " << imb << std::endl;
+        prof.setValue("imbalance_assemble", imb);
+    }
+    if(useShapeCache)
+    {
+        if(rank == 0)
+            std::cout << "Shape cache: " << shapes.numShapes() << " shapes, "
+                      << shapes.numHits() << " hits, " << shapes.numMisses() << " misses" << std::endl;
+        prof.setValue("shapes", shapes.numShapes());
+    }
+}
 
-        ElementArray<Node> nodes = icell->getNodes();
-        rMatrix rhs, W;
-        assembleLocalSystem(cell, W, rhs);
+// Cells of one color share no nodes and are assembled concurrently.
+// Interior cells need no data of ghost elements, so with overlap
+// they are grouped apart and processed during ghost exchange
+void Problem::prepareGroups()
+{
+    if(!groups.empty())
+        return;
+    if(useColoring)
+        colorCells(m, NODE, groups, &cellOrder);
+    else
+        groups.push_back(cellOrder);
+    if(useOverlap && m.GetProcessorsNumber() > 1)
+    {
+        splitHaloCells(m, NODE, groups, haloGroups);
+        size_t nhalo = 0;
+        for(size_t g = 0; g < haloGroups.size(); g++)
+            nhalo += haloGroups[g].size();
+        prof.count("halo_cells", nhalo);
+    }
+}
+
+void Problem::assembleGroups(const std::vector< std::vector<HandleType> > &cells)
+{
+    for(size_t c = 0; c < cells.size(); c++)
+    {
+#if defined(USE_OMP)
+#pragma omp parallel for if(useColoring)
+#endif
+        for(int k = 0; k < static_cast<int>(cells[c].size()); k++)
+        {
+            Cell cell(&m, cells[c][k]);
+            assembleCellTimed(cell);
+        }
+    }
+}
+
+void Problem::multiplyGroups(const std::vector< std::vector<HandleType> > &cells, std::vector<double> &y)
+{
+    for(size_t c = 0; c < cells.size(); c++)
+    {
+#if defined(USE_OMP)
+#pragma omp parallel for if(useColoring)
+#endif
+        for(int k = 0; k < static_cast<int>(cells[c].size()); k++)
+        {
+            Cell cell(&m, cells[c][k]);
+            multiplyCell(cell, y);
+        }
+    }
+}
+
+// Assembly time of the cell is stored for cost-weighted partitioning of later runs
+void Problem::assembleCellTimed(Cell &cell)
+{
+    if(!recordTime || rhsOnly)
+    {
+        assembleCell(cell);
+        return;
+    }
+    double tc = Timer();
+    assembleCell(cell);
+    cell.Real(tagCost) = Timer() - tc;
+}
+
+// Add contribution of one cell to global system
+void Problem::assembleCell(Cell &cell)
+{
+    LinearResidual LR(R, useNumeric);
+    ElementArray<Node> nodes = cell.getNodes();
+#if defined(USE_OMP)
+    VEMWorkspace &ws = work[omp_get_thread_num()];
+#else
+    VEMWorkspace &ws = work[0];
+#endif
+    assembleLocalSystem(cell, nodes, ws);
+    const rMatrix &W = ws.W, &rhs = ws.rhs;
+
+    int nnodes = nodes.size();
 
-        int nnodes = nodes.size();
+    if(useMatrixFree)
+    {
+        for(int i = 0; i != nnodes; i++)
+        {
+            if(nodes[i].GetMarker(mrkDirNode) || nodes[i].GetStatus() == Element::Ghost)
+                continue;
+            int ind = nodes[i].LocalID();
+            for(int j = 0; j != nnodes; j++)
+                if(nodes[j].GetMarker(mrkDirNode))
+                    mfRHS[ind] -= nodes[j].Real(tagBC) * W(j,i);
+            mfRHS[ind] += rhs(i,0);
+            mfDiag[ind] += W(i,i);
+        }
+        return;
+    }
 
+    if(rhsOnly)
+    {
+        // Unknowns are zero, so the residual has only terms of boundary data and source
+        Sparse::Vector &r = R.GetResidual();
         for(int i = 0; i != nnodes; i++)
-	{
-            if(nodes[i]->GetMarker(mrkDirNode)) // boundary node
-	    {
+        {
+            if(nodes[i].GetMarker(mrkDirNode))
+            {
                 double bcVal = nodes[i].Real(tagBC);
                 for(int j = 0; j != nnodes; j++)
                     if(nodes[j].GetStatus() != Element::Ghost && !nodes[j].GetMarker(mrkDirNode))
-                        R[var.Index(nodes[j])] += bcVal * W(j,i);
-            }
-            else if(nodes[i].GetStatus() != Element::Ghost) // Node with unknown
-	    {
-                for(int j = 0; j != nnodes; j++)
-                    if(!nodes[j].GetMarker(mrkDirNode))
-                        R[var.Index(nodes[i])] += W(j,i) * var(nodes[j]);
-                R[var.Index(nodes[i])] -= rhs(i,0);
+                        r[var.Index(nodes[j])] += bcVal * W(j,i);
             }
+            else if(nodes[i].GetStatus() != Element::Ghost)
+                r[var.Index(nodes[i])] -= rhs(i,0);
+        }
+        return;
+    }
+
+    for(int i = 0; i != nnodes; i++)
+    {
+        if(nodes[i]->GetMarker(mrkDirNode)) // boundary node
+        {
+            double bcVal = nodes[i].Real(tagBC);
+            for(int j = 0; j != nnodes; j++)
+                if(nodes[j].GetStatus() != Element::Ghost && !nodes[j].GetMarker(mrkDirNode))
+                    LR.add(var.Index(nodes[j]), bcVal * W(j,i));
+        }
+        else if(nodes[i].GetStatus() != Element::Ghost) // Node with unknown
+        {
+            for(int j = 0; j != nnodes; j++)
+                if(!nodes[j].GetMarker(mrkDirNode))
+                    LR.add(var.Index(nodes[i]), W(j,i), var, nodes[j]);
+            LR.add(var.Index(nodes[i]), -rhs(i,0));
         }
     }
-    times[T_ASSEMBLE] += Timer() - t;
 }
 
 
-void Problem::assembleLocalSystem(Cell &cell, rMatrix &W, rMatrix &b)
+// y += A*x for rows of owned nodes of the cell, x is taken from tagMFX
+void Problem::multiplyCell(Cell &cell, std::vector<double> &y)
 {
     ElementArray<Node> nodes = cell.getNodes();
+#if defined(USE_OMP)
+    VEMWorkspace &ws = work[omp_get_thread_num()];
+#else
+    VEMWorkspace &ws = work[0];
+#endif
+    assembleLocalSystem(cell, nodes, ws);
+    const rMatrix &W = ws.W;
+
+    int nnodes = nodes.size();
+    for(int i = 0; i != nnodes; i++)
+    {
+        if(nodes[i].GetMarker(mrkDirNode) || nodes[i].GetStatus() == Element::Ghost)
+            continue;
+        double s = 0.;
+        for(int j = 0; j != nnodes; j++)
+            s += W(j,i) * nodes[j].Real(tagMFX); // zero in Dirichlet nodes
+        y[nodes[i].LocalID()] += s;
+    }
+}
+
+void Problem::multiply(const std::vector<double> &x, std::vector<double> &y)
+{
+    for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++)
+        if(inode->GetStatus() != Element::Ghost && !inode->GetMarker(mrkDirNode))
+            inode->Real(tagMFX) = x[inode->LocalID()];
+    if(useOverlap)
+        exchX.begin(m, tagMFX, NODE);
+    else
+        m.ExchangeData(tagMFX, NODE);
+
+    std::fill(y.begin(), y.end(), 0.);
+    multiplyGroups(groups, y);
+    exchX.end();
+    multiplyGroups(haloGroups, y);
+}
+
+// Entries of ghost and Dirichlet nodes are zero, so the sum is over owned unknowns
+double Problem::dot(const std::vector<double> &a, const std::vector<double> &b)
+{
+    double s = 0.;
+    for(size_t i = 0; i < a.size(); i++)
+        s += a[i] * b[i];
+    return m.Integrate(s);
+}
+
+// Local VEM stiffness matrix and RHS of a cell are written to ws.W and ws.rhs.
+// Local indices of nodes are kept in node tag, which is safe for colored
+// assembly since cells of one color have no common nodes.
+void Problem::assembleLocalSystem(Cell &cell, ElementArray<Node> &nodes, VEMWorkspace &ws)
+{
     ElementArray<Face> faces = cell.getFaces();
     int nn = nodes.size(), nf = faces.size();
-    double xc[3], diam = 0.0;
+    double xc[3], diam = cell.Real(tagDiam);
     cell.Centroid(xc);
-    for(ElementArray<Node>::iterator it = nodes.begin(); it != nodes.end(); it++)
+    ws.resize(nn);
+
+    double rhs = exactSolutionRHS(xc, freq) * cell.Volume() / nn;
+    for(int i = 0; i < nn; i++)
+        ws.rhs(i,0) = rhs;
+
+    const double *K = cellTensor(m, tagD, cell.GetHandle());
+    if(useShapeCache)
     {
-	    Storage::real_array xi = it->Coords();
-	    for(auto jt = nodes.begin(); jt != nodes.end(); jt++)
-	    {
-		    Storage::real_array xj = jt->Coords();
-		    diam = std::max(diam, (xi[0]-xj[0])*(xi[0]-xj[0]) + (xi[1]-xj[1])*(xi[1]-xj[1]) + (xi[2]-xj[2])*(xi[2]-xj[2]));
-	    }
+        shapes.makeKey(nodes, nn, 3, K, 6, ws.key);
+        if(shapes.find(ws.key, ws.W.data(), nn*nn))
+            return;
     }
-    diam = sqrt(diam);
-    rMatrix D(nn, n_polys), B(n_polys, nn);
+
+    rMatrix &D = ws.D, &B = ws.B;
     B.Zero();
-    D.Zero();
     for(int i = 0; i < nn; i++)
     {
-	    D(i,0) = 1.0;
-	    B(0,i) = 1.0/nn;
+        D(i,0) = 1.0;
+        B(0,i) = 1.0/nn;
+        nodes[i].Integer(tagLocal) = i;
     }
 
-    std::map<HandleType,int> gid_cnodes;
-    for(int i = 0; i < nn; ++i) gid_cnodes[nodes[i].GlobalID()] = i;
-
-    Storage::real_array K = cell.RealArray(tagD);
     for(int fid = 0; fid < nf; ++fid)
     {
-	    Face f = faces[fid];
-	    double area = f.Area();
-	    double nrm[3], knrm[3];
-	    f.OrientedUnitNormal(cell, nrm);
-	    knrm[0] = K[0]*nrm[0] + K[3]*nrm[1] + K[4]*nrm[2];
-	    knrm[1] = K[3]*nrm[0] + K[1]*nrm[1] + K[5]*nrm[2];
-	    knrm[2] = K[4]*nrm[0] + K[5]*nrm[1] + K[2]*nrm[2];
-	    ElementArray<Node> fnodes = f.getNodes();
-	    int nfn = fnodes.size();
-	    for(int k = 0; k < nfn; ++k) 
-	    {
-		    Node node = fnodes[k];
-		    assert(gid_cnodes.find(node.GlobalID()) != gid_cnodes.end());
-		    int i = gid_cnodes[node.GlobalID()];
-		    assert(i < nn);
-		    for(int j = 1; j < n_polys; ++j)
-			    B(j,i) += 1.0/nfn * area / diam * knrm[j-1];
-	    }
+        Face f = faces[fid];
+        double area = f.Area();
+        double nrm[3], knrm[3];
+        f.OrientedUnitNormal(cell, nrm);
+        knrm[0] = K[0]*nrm[0] + K[3]*nrm[1] + K[4]*nrm[2];
+        knrm[1] = K[3]*nrm[0] + K[1]*nrm[1] + K[5]*nrm[2];
+        knrm[2] = K[4]*nrm[0] + K[5]*nrm[1] + K[2]*nrm[2];
+        ElementArray<Node> fnodes = f.getNodes();
+        int nfn = fnodes.size();
+        for(int k = 0; k < nfn; ++k)
+        {
+            int i = fnodes[k].Integer(tagLocal);
+            assert(i >= 0 && i < nn && nodes[i] == fnodes[k]);
+            for(int j = 1; j < n_polys; ++j)
+                B(j,i) += 1.0/nfn * area / diam * knrm[j-1];
+        }
     }
     for(int vid = 0; vid < nn; ++vid)
     {
-	    Storage::real_array xv = nodes[vid].Coords();
-	    double monom[3] = { (xv[0]-xc[0])/diam, (xv[1]-xc[1])/diam, (xv[2]-xc[2])/diam };
-	    for(int j = 1; j < n_polys; ++j)
-		    D(vid,j) = monom[j-1];
+        Storage::real_array xv = nodes[vid].Coords();
+        double monom[3] = { (xv[0]-xc[0])/diam, (xv[1]-xc[1])/diam, (xv[2]-xc[2])/diam };
+        for(int j = 1; j < n_polys; ++j)
+            D(vid,j) = monom[j-1];
     }
+
+    // G = B*D and its inverse are small and fixed-size
+    fMatrix<n_polys,n_polys> G;
+    for(int i = 0; i < n_polys; i++)
+        for(int j = 0; j < n_polys; j++)
+        {
+            double s = 0.0;
+            for(int k = 0; k < nn; k++)
+                s += B(i,k) * D(k,j);
+            G(i,j) = s;
+        }
     int ierr = -1;
-    rMatrix BDinv = (B*D).Invert(&ierr);
-    if(ierr > 0) 
-    {
-	    std::cerr << "ierr = " << ierr << std::endl;
-	    std::cerr << "B" << std::endl;
-	    B.Print();
-	    std::cerr << "D" << std::endl;
-	    D.Print();
-	    std::cerr << "B*D" << std::endl;
-	    (B*D).Print();
-    }
-    rMatrix Proj = BDinv * B;
-    rMatrix Se = rMatrix::Unit(nn) - D*Proj;
-    rMatrix G = B*D;
-    G(0,1,0,n_polys).Zero();
-    W = Proj.Transpose() * G * Proj + Se.Transpose() * Se;
-    double rhs = exactSolutionRHS(xc) * cell.Volume() / nn;
-    b = rMatrix::Col(nn, rhs);
+    fMatrix<n_polys,n_polys> BDinv = G.Invert(&ierr);
+    if(ierr > 0)
+    {
+        std::cerr << "ierr = " << ierr << std::endl;
+        std::cerr << "B" << std::endl;
+        B.Print();
+        std::cerr << "D" << std::endl;
+        D.Print();
+        std::cerr << "B*D" << std::endl;
+        G.Print();
+    }
+    for(int j = 0; j < n_polys; j++)
+        G(0,j) = 0.0;
+
+    // Proj = (B*D)^{-1} B, GP = G*Proj
+    rMatrix &Proj = ws.Proj, &GP = ws.GP;
+    for(int i = 0; i < n_polys; i++)
+        for(int k = 0; k < nn; k++)
+        {
+            double s = 0.0;
+            for(int j = 0; j < n_polys; j++)
+                s += BDinv(i,j) * B(j,k);
+            Proj(i,k) = s;
+        }
+    for(int i = 0; i < n_polys; i++)
+        for(int k = 0; k < nn; k++)
+        {
+            double s = 0.0;
+            for(int j = 0; j < n_polys; j++)
+                s += G(i,j) * Proj(j,k);
+            GP(i,k) = s;
+        }
+    // Se = I - D*Proj
+    rMatrix &Se = ws.Se;
+    for(int i = 0; i < nn; i++)
+        for(int k = 0; k < nn; k++)
+        {
+            double s = (i == k) ? 1.0 : 0.0;
+            for(int j = 0; j < n_polys; j++)
+                s -= D(i,j) * Proj(j,k);
+            Se(i,k) = s;
+        }
+    // W = Proj^T G Proj + Se^T Se
+    rMatrix &W = ws.W;
+    for(int i = 0; i < nn; i++)
+        for(int k = 0; k < nn; k++)
+        {
+            double s = 0.0;
+            for(int j = 0; j < n_polys; j++)
+                s += Proj(j,i) * GP(j,k);
+            for(int j = 0; j < nn; j++)
+                s += Se(j,i) * Se(j,k);
+            W(i,k) = s;
+        }
+    if(useShapeCache)
+        shapes.insert(ws.key, W.data(), nn*nn);
+}
+
+void Problem::solveMatrixFree()
+{
+    std::vector<double> sol(mfRHS.size(), 0.);
+    int iters;
+    double resid;
+    double t = Timer();
+    bool solved = solveMatrixFreeCG(*this, mfDiag, mfRHS, sol, 1e-10, 1e-13, 10000, iters, resid);
+    prof.add(T_SOLVE, Timer() - t);
+    if(!solved)
+    {
+        if(rank == 0)
+        {
+            std::cout << "Linear solver failed: no convergence in " << iters << " iterations" << std::endl;
+            std::cout << "Residual: " << resid << std::endl;
+        }
+        return;
+    }
+    if(rank == 0) std::cout << "Linear solver iterations: " << iters << std::endl;
+    prof.count("linear_iterations", iters);
+
+    t = Timer();
+    double Cnorm = 0.0;
+    for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++) if(inode->GetStatus() != Element::Ghost && !inode->GetMarker(mrkDirNode))
+        inode->Real(tagSol) = sol[inode->LocalID()];
+    HaloExchange exchSol;
+    exchSol.begin(m, tagSol, NODE);
+    for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++) if(inode->GetStatus() != Element::Ghost && !inode->GetMarker(mrkDirNode))
+        Cnorm = std::max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
+    exchSol.end();
+    Cnorm = m.AggregateMax(Cnorm);
+    if(rank == 0) std::cout << "|err|_C = " << Cnorm << std::endl;
+    prof.setValue("err_C", Cnorm);
+    prof.add(T_UPDATE, Timer() - t);
 }
 
 void Problem::solveSystem()
 {
-    Solver S("inner_ilu2", "test");
+    if(useMatrixFree)
+    {
+        solveMatrixFree();
+        return;
+    }
+    Solver S(solverOpt.type, solverOpt.prefix);
     S.SetParameter("relative_tolerance", "1e-10");
     S.SetParameter("absolute_tolerance", "1e-13");
+    double rss = MemoryReport::residentMemory();
     double t = Timer();
 
-    S.SetMatrix(R.GetJacobian());
-    times[T_PRECOND] += Timer() - t;
+    setSolverMatrix(S);
+    prof.add(T_PRECOND, Timer() - t);
+    mem.set("solver", MemoryReport::residentMemory() - rss);
+    solveRHS(S);
+}
+
+void Problem::setSolverMatrix(Solver &S)
+{
+    perm.setMatrix(S, R.GetJacobian());
+    if(perm.empty())
+        return;
+    double bw0 = m.AggregateMax(static_cast<double>(matrixBandwidth(R.GetJacobian())));
+    double bw = m.AggregateMax(static_cast<double>(matrixBandwidth(perm.getMatrix())));
+    if(rank == 0) std::cout << "Matrix bandwidth: " << bw0 << " -> " << bw << " after reordering" << std::endl;
+    prof.setValue("bandwidth_original", bw0);
+    prof.setValue("bandwidth", bw);
+}
+
+bool Problem::solveRHS(Solver &S)
+{
     Sparse::Vector sol;
     sol.SetInterval(aut.GetFirstIndex(), aut.GetLastIndex());
     std::fill(sol.Begin(), sol.End(), 0.0);
-    t = Timer();
-    bool solved = S.Solve(R.GetResidual(), sol);
-    times[T_SOLVE] += Timer() - t;
+    double t = Timer();
+    bool solved = perm.solve(S, R.GetResidual(), sol);
+    prof.add(T_SOLVE, Timer() - t);
     if(!solved)
     {
         std::cout << "Linear solver failed: " << S.GetReason() << std::endl;
         std::cout << "Residual: " << S.Residual() << std::endl;
-        return;
+        return false;
     }
     if(rank == 0) std::cout << "Linear solver iterations: " << S.Iterations() << std::endl;
+    prof.count("linear_iterations", S.Iterations());
 
     t = Timer();
     double Cnorm = 0.0;
     for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++) if(inode->GetStatus() != Element::Ghost && !inode->GetMarker(mrkDirNode))
-    {
         inode->Real(tagSol) -= sol[var.Index(inode->self())];
+    // Error norm on owned nodes is computed while ghost values are sent
+    HaloExchange exchSol;
+    exchSol.begin(m, tagSol, NODE);
+    for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++) if(inode->GetStatus() != Element::Ghost && !inode->GetMarker(mrkDirNode))
         Cnorm = std::max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
-    }
-    m.ExchangeData(tagSol, NODE);
+    exchSol.end();
     Cnorm = m.AggregateMax(Cnorm);
     if(rank == 0) std::cout << "|err|_C = " << Cnorm << std::endl;
-    times[T_UPDATE] += Timer() - t;
+    prof.setValue("err_C", Cnorm);
+    prof.add(T_UPDATE, Timer() - t);
+    return true;
+}
+
+// Jacobian is assembled and preconditioner is built once,
+// for every next case only residual is assembled.
+// Solution of case k is kept in tag SOLUTION_<k>
+void Problem::solveSweep(int n)
+{
+    if(useMatrixFree)
+    {
+        if(rank == 0) std::cout << "Sweep needs assembled matrix, -matfree is not supported" << std::endl;
+        exit(1);
+    }
+    assembleGlobalSystem();
+    Solver S(solverOpt.type, solverOpt.prefix);
+    S.SetParameter("relative_tolerance", "1e-10");
+    S.SetParameter("absolute_tolerance", "1e-13");
+    double rss = MemoryReport::residentMemory();
+    double t = Timer();
+    setSolverMatrix(S);
+    prof.add(T_PRECOND, Timer() - t);
+    mem.set("solver", MemoryReport::residentMemory() - rss);
+    for(int k = 0; k < n; k++)
+    {
+        if(k > 0)
+        {
+            setCase(k);
+            rhsOnly = true;
+            assembleGlobalSystem();
+            rhsOnly = false;
+        }
+        if(rank == 0) std::cout << "Case " << k << ", frequency " << freq << ":" << std::endl;
+        if(!solveRHS(S))
+            continue;
+        prof.count("sweep_cases");
+        Tag tagCase = m.CreateTag(tagNameSol + "_" + std::to_string(k), DATA_REAL, NODE, NONE, 1);
+        double Cnorm = 0.0;
+        for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++)
+        {
+            inode->Real(tagCase) = inode->Real(tagSol);
+            if(inode->GetStatus() != Element::Ghost)
+                Cnorm = std::max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
+        }
+        prof.setValue("err_C_" + std::to_string(k), m.AggregateMax(Cnorm));
+    }
 }
 
 void Problem::saveSolution(std::string prefix)
@@ -381,27 +953,110 @@ void Problem::saveSolution(std::string prefix)
 	    extension = ".pvtk";
     else
 	    extension = ".vtk";
+    // Work tags of assembly are not part of the result
+    if(tagDiam.isValid())
+        tagDiam = m.DeleteTag(tagDiam);
+    if(tagLocal.isValid())
+        tagLocal = m.DeleteTag(tagLocal);
+    deleteColoring(m);
     m.Save(prefix + extension);
-    times[T_IO] += Timer() - t;
+    prof.add(T_IO, Timer() - t);
 }
 
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2)
+    if(argc < 2)
     {
-        std::cout << "Usage: " << argv[0] << " <mesh_file>" << std::endl;
+        std::cout << "Usage: " << argv[0] << " <mesh_file> [-colored] [-reorder rcm|sfc] [-shape_cache] [-numeric] [-matfree] [-sweep <n>] [-solver <type>] [-solver_db <file>] [-mesh_save <file.pmf>]"
+                  << " [-weights nodes|time] [-rebalance <imbalance>] [-partitioner parmetis|zoltan] [-record_time] [-overlap]"
+                  << " [-compact_tensors] [-mem_report]" << std::endl;
         return 1;
     }
-    
-    Solver::Initialize(&argc, &argv, "database.xml");
+    bool colored = false, shapeCache = false, numeric = false, matfree = false;
+    int reorder = REORDER_NONE;
+    std::string meshSave;
+    int sweep = 0;
+    int costModel = COST_UNIFORM;
+    double rebalance = 0.0;
+    Partitioner::Type graphPartitioner = Partitioner::Parmetis;
+    bool recordTime = false;
+    bool overlap = false;
+    bool compactTensor = false, memReport = false;
+    SolverOptions solverOpt("inner_ilu2", "test", "database.xml");
+    for(int i = 2; i < argc; i++)
+    {
+        std::string opt(argv[i]);
+        if(opt == "-colored")
+            colored = true;
+        else if(opt == "-reorder" && i+1 < argc)
+            reorder = parseReorderMethod(argv[++i]);
+        else if(opt == "-shape_cache")
+            shapeCache = true;
+        else if(opt == "-numeric")
+            numeric = true;
+        else if(opt == "-matfree")
+            matfree = true;
+        else if(opt == "-mesh_save" && i+1 < argc)
+            meshSave = argv[++i];
+        else if(opt == "-sweep" && i+1 < argc)
+            sweep = atoi(argv[++i]);
+        else if(opt == "-weights" && i+1 < argc)
+            costModel = parseCostModel(argv[++i]);
+        else if(opt == "-rebalance" && i+1 < argc)
+            rebalance = atof(argv[++i]);
+        else if(opt == "-partitioner" && i+1 < argc)
+            graphPartitioner = parsePartitioner(argv[++i]);
+        else if(opt == "-record_time")
+            recordTime = true;
+        else if(opt == "-overlap")
+            overlap = true;
+        else if(opt == "-compact_tensors")
+            compactTensor = true;
+        else if(opt == "-mem_report")
+            memReport = true;
+        else if(!solverOpt.parse(i, argc, argv))
+        {
+            std::cout << "Unknown option " << opt << std::endl;
+            return 1;
+        }
+    }
+
+    Solver::Initialize(&argc, &argv, solverOpt.database.c_str());
     Mesh::Initialize(&argc, &argv);
     Partitioner::Initialize(&argc, &argv);
 
     Problem* P = new Problem(argv[1]);
+    P->setBalance(costModel, rebalance, graphPartitioner);
+    P->balanceLoad();
+    if(!meshSave.empty())
+    {
+        // Preprocessing only: later runs load the prepared mesh
+        P->saveMesh(meshSave);
+        delete P;
+        Partitioner::Finalize();
+        Solver::Finalize();
+        Mesh::Finalize();
+        return 0;
+    }
+    P->setColoring(colored);
+    P->setOverlap(overlap);
+    P->setCompactTensor(compactTensor);
+    P->setMemoryReport(memReport);
+    P->setReorder(reorder);
+    P->setShapeCache(shapeCache);
+    P->setNumeric(numeric);
+    P->setMatrixFree(matfree);
+    P->setRecordTime(recordTime);
+    P->setSolver(solverOpt);
     P->initProblem();
-    P->assembleGlobalSystem();
-    P->solveSystem();
+    if(sweep > 0)
+        P->solveSweep(sweep);
+    else
+    {
+        P->assembleGlobalSystem();
+        P->solveSystem();
+    }
     P->saveSolution("res");
 
     delete P;
@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+#
+#    Mesh-scaling benchmark for all drivers.
+#
+#    Every driver is run on each level of the mesh refinement series
+#    it supports, optionally for several numbers of MPI processes.
+#    Each run is done in its own directory, the statistics are taken
+#    from stats.json written by the drivers (see profiling.h).
+#
+#    The result is a plain-text table (one line per run) which can be
+#    diffed between commits, and the same data in CSV.
+#
+#    Strong scaling: --np 1,2,4 runs every mesh on 1, 2 and 4 processes.
+#    Weak scaling:   --np 1,4,16 --weak runs k-th mesh of a series
+#                    on k-th number of processes.
+#    Serial drivers are run on one process only: in strong scaling once
+#    per mesh, in weak scaling for the meshes paired with np 1.
+
+import argparse
+import glob
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import time
+
+# Refinement series, levels are sorted by number in the file name
+SERIES = {
+    'tri':  'unit_square[0-9]*.vtk',
+    'tri_': 'unit_square_[0-9]*.vtk',
+    'quad': 'unit_square_quad[0-9]*.vtk',
+}
+
+# Driver name, extra arguments, series it can run on, runs in parallel
+DRIVERS = [
+    ('2d_diffusion_fem',    [],      ['tri', 'tri_'],         False),
+    ('2d_diffusion_fem_ad', [],      ['tri', 'tri_'],         False),
+    ('2d_elasticity_fem',   [],      ['tri', 'tri_'],         False),
+    ('2d_diffusion_vem',    [],      ['tri', 'tri_', 'quad'], False),
+    ('2d_diffusion_mfd',    [],      ['tri', 'tri_', 'quad'], False),
+    ('2d_dens_driven_flow', ['fim'], ['tri', 'tri_', 'quad'], True),
+    ('3d_diffusion_vem',    [],      ['3d'],                  True),
+    ('3d_diffusion_fvm',    [],      ['3d'],                  True),
+    ('3d_diffusion_fem',    [],      ['3d'],                  True),
+]
+
+COLUMNS = ['driver', 'series', 'level', 'np', 'status',
+           'T_assemble', 'T_precond', 'T_solve', 'T_IO', 'T_total',
+           'rss_kb', 'lin_it', 'err_C']
+
+
+def level_of(path):
+    nums = re.findall(r'([0-9]+)', os.path.basename(path))
+    return int(nums[-1]) if nums else 0
+
+
+def find_series(meshdir, mesh3d):
+    series = {}
+    for name, pattern in SERIES.items():
+        files = glob.glob(os.path.join(meshdir, pattern))
+        series[name] = sorted(files, key=level_of)
+    series['3d'] = sorted(mesh3d, key=level_of)
+    return series
+
+
+def phase_max(stats, name):
+    for p in stats.get('phases', []):
+        if p['name'] == name:
+            return p['max']
+    return float('nan')
+
+
+def run_case(exe, args, mesh, nproc, mpiexec, workdir, timeout):
+    if os.path.isdir(workdir):
+        shutil.rmtree(workdir)
+    os.makedirs(workdir)
+    cmd = [exe, os.path.abspath(mesh)] + args
+    if nproc > 1 or mpiexec:
+        cmd = [mpiexec or 'mpirun', '-np', str(nproc)] + cmd
+    with open(os.path.join(workdir, 'log.txt'), 'w') as log:
+        try:
+            ret = subprocess.call(cmd, cwd=workdir, stdout=log, stderr=subprocess.STDOUT,
+                                  timeout=timeout)
+        except subprocess.TimeoutExpired:
+            return 'timeout', {}
+    path = os.path.join(workdir, 'stats.json')
+    if ret != 0 or not os.path.exists(path):
+        return 'failed', {}
+    with open(path) as f:
+        return 'ok', json.load(f)
+
+
+def make_row(driver, series, level, nproc, status, stats):
+    values = stats.get('values', {})
+    err = values.get('err_C', values.get('errP_C', float('nan')))
+    return {
+        'driver': driver, 'series': series, 'level': level, 'np': nproc, 'status': status,
+        'T_assemble': phase_max(stats, 'assemble'),
+        'T_precond':  phase_max(stats, 'precond'),
+        'T_solve':    phase_max(stats, 'solve'),
+        'T_IO':       phase_max(stats, 'IO'),
+        'T_total':    stats.get('total', {}).get('max', float('nan')),
+        'rss_kb':     stats.get('peak_rss_kb', float('nan')),
+        'lin_it':     stats.get('counters', {}).get('linear_iterations', 0),
+        'err_C':      err,
+    }
+
+
+def format_value(v):
+    if isinstance(v, float):
+        return '%.4e' % v
+    return str(v)
+
+
+def write_table(rows, path):
+    cells = [COLUMNS] + [[format_value(r[c]) for c in COLUMNS] for r in rows]
+    width = [max(len(line[i]) for line in cells) for i in range(len(COLUMNS))]
+    with open(path, 'w') as f:
+        for line in cells:
+            f.write('  '.join(v.ljust(w) for v, w in zip(line, width)).rstrip() + '\n')
+
+
+def write_csv(rows, path):
+    with open(path, 'w') as f:
+        f.write(','.join(COLUMNS) + '\n')
+        for r in rows:
+            f.write(','.join(format_value(r[c]) for c in COLUMNS) + '\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run drivers over mesh refinement series')
+    parser.add_argument('--bindir', default='.', help='directory with built executables')
+    parser.add_argument('--meshdir', default='meshes', help='directory with mesh series')
+    parser.add_argument('--mesh3d', nargs='*', default=[], help='3D meshes for 3d_diffusion_vem, 3d_diffusion_fvm and 3d_diffusion_fem (tetrahedral)')
+    parser.add_argument('--drivers', default='', help='comma-separated subset of drivers')
+    parser.add_argument('--series', default='', help='comma-separated subset of series')
+    parser.add_argument('--max-level', type=int, default=0, help='skip meshes of higher level')
+    parser.add_argument('--np', default='1', help='comma-separated numbers of MPI processes')
+    parser.add_argument('--weak', action='store_true', help='k-th mesh of series on k-th np')
+    parser.add_argument('--mpiexec', default='', help='MPI launcher')
+    parser.add_argument('--timeout', type=float, default=3600., help='time limit of one run, s')
+    parser.add_argument('--out', default='benchmark', help='prefix of result files')
+    opt = parser.parse_args()
+
+    nps = [int(n) for n in opt.np.split(',') if n]
+    only_drivers = [d for d in opt.drivers.split(',') if d]
+    only_series = [s for s in opt.series.split(',') if s]
+    series = find_series(opt.meshdir, opt.mesh3d)
+    rundir = os.path.abspath(opt.out + '_runs')
+
+    rows = []
+    t0 = time.time()
+    for driver, args, supported, parallel in DRIVERS:
+        if only_drivers and driver not in only_drivers:
+            continue
+        exe = os.path.abspath(os.path.join(opt.bindir, driver))
+        if not os.path.exists(exe):
+            print('%s: executable not found, skipped' % driver)
+            continue
+        for sname in supported:
+            if only_series and sname not in only_series:
+                continue
+            meshes = [mesh for mesh in series[sname]
+                      if opt.max_level <= 0 or level_of(mesh) <= opt.max_level]
+            for k, mesh in enumerate(meshes):
+                if opt.weak:
+                    if k >= len(nps):
+                        break
+                    cases = [nps[k]]
+                else:
+                    cases = nps
+                if not parallel:
+                    # N copies of a serial run tell nothing about scaling
+                    cases = [1] if (1 in cases or not opt.weak) else []
+                for nproc in cases:
+                    level = level_of(mesh)
+                    workdir = os.path.join(rundir, '%s_%s%d_np%d' % (driver, sname, level, nproc))
+                    sys.stdout.write('%-20s %-5s level %d, np %d ... ' % (driver, sname, level, nproc))
+                    sys.stdout.flush()
+                    status, stats = run_case(exe, args, mesh, nproc, opt.mpiexec, workdir, opt.timeout)
+                    print(status)
+                    rows.append(make_row(driver, sname, level, nproc, status, stats))
+
+    write_table(rows, opt.out + '.txt')
+    write_csv(rows, opt.out + '.csv')
+    print('%d runs in %.1f s, results in %s.txt and %s.csv' % (len(rows), time.time() - t0, opt.out, opt.out))
+    return 0 if all(r['status'] == 'ok' for r in rows) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,256 @@
+#ifndef BLOCK_SPARSE_H
+#define BLOCK_SPARSE_H
+
+#include "fixed_matrix.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+//    Block sparse row (BSR) matrix with dense BxB blocks,
+//    block ILU(0) preconditioner and preconditioned CG solver.
+//
+//    Intended for systems with B unknowns per node (displacements
+//    in elasticity): block (i,j) couples all unknowns of nodes i and j.
+//    Column indices are stored once per block instead of once per entry,
+//    and all kernels work on whole blocks with compile-time size.
+//
+//    Vectors are plain arrays of size B*n, unknowns of a node are contiguous.
+
+template<int B>
+class BSRMatrix
+{
+private:
+    int n;                    // number of block rows
+    std::vector<int> rowPtr;  // start of each block row, size n+1
+    std::vector<int> colInd;  // block column of each block, sorted in a row
+    std::vector<int> diagPos; // position of diagonal block in each row
+    std::vector<double> val;  // B*B values of each block, row-wise
+public:
+    BSRMatrix() : n(0) {}
+
+    // Set pattern from sorted lists of block columns of each block row,
+    // every row should contain its diagonal block
+    void setPattern(const std::vector< std::vector<int> > &cols)
+    {
+        n = static_cast<int>(cols.size());
+        rowPtr.assign(n+1, 0);
+        for(int i = 0; i < n; i++)
+            rowPtr[i+1] = rowPtr[i] + static_cast<int>(cols[i].size());
+        colInd.resize(rowPtr[n]);
+        diagPos.assign(n, -1);
+        for(int i = 0; i < n; i++)
+            for(int k = 0; k < static_cast<int>(cols[i].size()); k++){
+                colInd[rowPtr[i]+k] = cols[i][k];
+                if(cols[i][k] == i)
+                    diagPos[i] = rowPtr[i]+k;
+            }
+        val.assign(B*B*rowPtr[n], 0.);
+    }
+
+    int size() const { return n; }
+    int numBlocks() const { return rowPtr.empty() ? 0 : rowPtr[n]; }
+    int rowBegin(int i) const { return rowPtr[i]; }
+    int rowEnd(int i) const { return rowPtr[i+1]; }
+    int col(int k) const { return colInd[k]; }
+    int diag(int i) const { return diagPos[i]; }
+
+    // Position of block (i,j), -1 if it is not in the pattern
+    int find(int i, int j) const
+    {
+        std::vector<int>::const_iterator beg = colInd.begin() + rowPtr[i], end = colInd.begin() + rowPtr[i+1];
+        std::vector<int>::const_iterator it = std::lower_bound(beg, end, j);
+        return (it != end && *it == j) ? static_cast<int>(it - colInd.begin()) : -1;
+    }
+
+    double *block(int k)             { return &val[B*B*k]; }
+    const double *block(int k) const { return &val[B*B*k]; }
+
+    void zero() { std::fill(val.begin(), val.end(), 0.); }
+
+    // y = A*x
+    void multiply(const double *x, double *y) const
+    {
+#if defined(USE_OMP)
+#pragma omp parallel for
+#endif
+        for(int i = 0; i < n; i++){
+            double s[B];
+            for(int r = 0; r < B; r++)
+                s[r] = 0.;
+            for(int k = rowPtr[i]; k < rowPtr[i+1]; k++){
+                const double *a = &val[B*B*k];
+                const double *xj = x + B*colInd[k];
+                for(int r = 0; r < B; r++)
+                    for(int c = 0; c < B; c++)
+                        s[r] += a[r*B+c] * xj[c];
+            }
+            for(int r = 0; r < B; r++)
+                y[B*i+r] = s[r];
+        }
+    }
+
+    // Memory of pattern and values in bytes
+    size_t memory() const
+    {
+        return sizeof(int) * (rowPtr.size() + colInd.size() + diagPos.size()) + sizeof(double) * val.size();
+    }
+};
+
+// C -= A*B for BxB blocks
+template<int B>
+inline void blockMultSub(const double *a, const double *b, double *c)
+{
+    for(int i = 0; i < B; i++)
+        for(int j = 0; j < B; j++){
+            double s = 0.;
+            for(int k = 0; k < B; k++)
+                s += a[i*B+k] * b[k*B+j];
+            c[i*B+j] -= s;
+        }
+}
+
+//    Block ILU(0): L*U has the pattern of A, L has identity diagonal blocks.
+//    Inverses of diagonal blocks of U are stored separately.
+template<int B>
+class BlockILU0
+{
+private:
+    BSRMatrix<B> LU;
+    std::vector<double> dinv; // inverted diagonal blocks of U
+public:
+    // Returns false if a diagonal block is singular
+    bool build(const BSRMatrix<B> &A)
+    {
+        LU = A;
+        int n = LU.size();
+        dinv.assign(B*B*n, 0.);
+        std::vector<int> pos(n, -1); // position of block column in current row
+        fMatrix<B,B> D;
+        for(int i = 0; i < n; i++){
+            for(int k = LU.rowBegin(i); k < LU.rowEnd(i); k++)
+                pos[LU.col(k)] = k;
+            for(int k = LU.rowBegin(i); k < LU.diag(i); k++){
+                int j = LU.col(k);
+                // L(i,j) = A(i,j) * U(j,j)^-1
+                double l[B*B];
+                for(int q = 0; q < B*B; q++)
+                    l[q] = 0.;
+                blockMultSub<B>(LU.block(k), &dinv[B*B*j], l);
+                for(int q = 0; q < B*B; q++)
+                    LU.block(k)[q] = -l[q];
+                // A(i,c) -= L(i,j) * U(j,c) for c > j in pattern of row i
+                for(int kk = LU.diag(j)+1; kk < LU.rowEnd(j); kk++){
+                    int p = pos[LU.col(kk)];
+                    if(p >= 0)
+                        blockMultSub<B>(LU.block(k), LU.block(kk), LU.block(p));
+                }
+            }
+            const double *d = LU.block(LU.diag(i));
+            for(int q = 0; q < B*B; q++)
+                D.data()[q] = d[q];
+            int ierr;
+            D = D.Invert(&ierr);
+            if(ierr)
+                return false;
+            for(int q = 0; q < B*B; q++)
+                dinv[B*B*i+q] = D.data()[q];
+            for(int k = LU.rowBegin(i); k < LU.rowEnd(i); k++)
+                pos[LU.col(k)] = -1;
+        }
+        return true;
+    }
+
+    // z = (LU)^-1 r
+    void apply(const double *r, double *z) const
+    {
+        int n = LU.size();
+        for(int i = 0; i < n; i++){
+            double s[B];
+            for(int c = 0; c < B; c++)
+                s[c] = r[B*i+c];
+            for(int k = LU.rowBegin(i); k < LU.diag(i); k++){
+                const double *l = LU.block(k), *zj = z + B*LU.col(k);
+                for(int p = 0; p < B; p++)
+                    for(int c = 0; c < B; c++)
+                        s[p] -= l[p*B+c] * zj[c];
+            }
+            for(int c = 0; c < B; c++)
+                z[B*i+c] = s[c];
+        }
+        for(int i = n-1; i >= 0; i--){
+            double s[B];
+            for(int c = 0; c < B; c++)
+                s[c] = z[B*i+c];
+            for(int k = LU.diag(i)+1; k < LU.rowEnd(i); k++){
+                const double *u = LU.block(k), *zj = z + B*LU.col(k);
+                for(int p = 0; p < B; p++)
+                    for(int c = 0; c < B; c++)
+                        s[p] -= u[p*B+c] * zj[c];
+            }
+            const double *d = &dinv[B*B*i];
+            for(int p = 0; p < B; p++){
+                double v = 0.;
+                for(int c = 0; c < B; c++)
+                    v += d[p*B+c] * s[c];
+                z[B*i+p] = v;
+            }
+        }
+    }
+};
+
+//    Preconditioned conjugate gradients for symmetric positive definite A.
+//    Stops when |r| <= max(rtol*|b|, atol), returns false if maxit is reached.
+//    For symmetric A the block ILU(0) preconditioner is symmetric as well.
+template<int B>
+bool solveBlockCG(const BSRMatrix<B> &A, const BlockILU0<B> &M,
+                  const std::vector<double> &b, std::vector<double> &x,
+                  double rtol, double atol, int maxit, int &iters, double &resid)
+{
+    int N = B*A.size();
+    std::vector<double> r(N), z(N), p(N), q(N);
+    A.multiply(&x[0], &q[0]);
+    double bnorm = 0., rr = 0.;
+    for(int i = 0; i < N; i++){
+        r[i] = b[i] - q[i];
+        bnorm += b[i]*b[i];
+        rr += r[i]*r[i];
+    }
+    double tol = std::max(rtol*sqrt(bnorm), atol);
+    resid = sqrt(rr);
+    iters = 0;
+    if(resid <= tol)
+        return true;
+    M.apply(&r[0], &z[0]);
+    p = z;
+    double rz = 0.;
+    for(int i = 0; i < N; i++)
+        rz += r[i]*z[i];
+    while(iters < maxit){
+        iters++;
+        A.multiply(&p[0], &q[0]);
+        double pq = 0.;
+        for(int i = 0; i < N; i++)
+            pq += p[i]*q[i];
+        double alpha = rz / pq;
+        rr = 0.;
+        for(int i = 0; i < N; i++){
+            x[i] += alpha * p[i];
+            r[i] -= alpha * q[i];
+            rr += r[i]*r[i];
+        }
+        resid = sqrt(rr);
+        if(resid <= tol)
+            return true;
+        M.apply(&r[0], &z[0]);
+        double rzNew = 0.;
+        for(int i = 0; i < N; i++)
+            rzNew += r[i]*z[i];
+        double beta = rzNew / rz;
+        rz = rzNew;
+        for(int i = 0; i < N; i++)
+            p[i] = z[i] + beta * p[i];
+    }
+    return false;
+}
+
+#endif // BLOCK_SPARSE_H
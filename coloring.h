@@ -0,0 +1,96 @@
+#ifndef COLORING_H
+#define COLORING_H
+
+#include "inmost.h"
+
+//    Greedy coloring of mesh cells for parallel assembly.
+//
+//    Cells of the same color share no element of type 'shared'
+//    (NODE for node-based unknowns, FACE for face-based ones),
+//    so all cells of one color can be assembled concurrently
+//    without locks or atomics: every row of the global system
+//    is touched by at most one cell of the color.
+//
+//    The color of each cell is stored in an integer tag, its record on
+//    the mesh keeps the type 'shared' the coloring was made for. If the tag
+//    is already present for the same type the coloring is reused, otherwise
+//    cells are colored again. The tag is a work one: drivers remove it
+//    with deleteColoring() before the result is saved.
+//    If order of cells is given (see reordering.h), cells are colored
+//    and listed within each color in that order.
+
+const std::string tagNameColor = "ASSEMBLY_COLOR";
+
+// Mark colors of cells adjacent to given elements as used
+template<typename ElementT>
+void markUsedColors(INMOST::ElementArray<ElementT> adj, const INMOST::Tag &tagColor, std::vector<char> &used)
+{
+    using namespace INMOST;
+    for(typename ElementArray<ElementT>::iterator ie = adj.begin(); ie != adj.end(); ie++){
+        ElementArray<Cell> cells = ie->getCells();
+        for(ElementArray<Cell>::iterator jc = cells.begin(); jc != cells.end(); jc++){
+            int c = jc->Integer(tagColor);
+            if(c >= 0)
+                used[c] = 1;
+        }
+    }
+}
+
+inline void colorCells(INMOST::Mesh &m, INMOST::ElementType shared,
+                       std::vector< std::vector<INMOST::HandleType> > &colors,
+                       const std::vector<INMOST::HandleType> *order = NULL)
+{
+    using namespace INMOST;
+
+    colors.clear();
+    std::vector<HandleType> cells;
+    if(order != NULL && !order->empty())
+        cells = *order;
+    else
+        for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            cells.push_back(icell->GetHandle());
+
+    Tag tagColor;
+    if(m.HaveTag(tagNameColor)){
+        tagColor = m.GetTag(tagNameColor);
+        if(!tagColor.isDefined(MESH) || m.Integer(m.GetHandle(), tagColor) != static_cast<int>(shared))
+            tagColor = m.DeleteTag(tagColor);
+    }
+    if(!tagColor.isValid()){
+        tagColor = m.CreateTag(tagNameColor, DATA_INTEGER, CELL|MESH, NONE, 1);
+        m.Integer(m.GetHandle(), tagColor) = static_cast<int>(shared);
+        for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            icell->Integer(tagColor) = -1;
+
+        std::vector<char> used;
+        for(size_t k = 0; k < cells.size(); k++){
+            Cell cell(&m, cells[k]);
+            std::fill(used.begin(), used.end(), 0);
+            if(shared == FACE)
+                markUsedColors(cell.getFaces(), tagColor, used);
+            else
+                markUsedColors(cell.getNodes(), tagColor, used);
+            int c = 0;
+            while(c < static_cast<int>(used.size()) && used[c])
+                c++;
+            if(c == static_cast<int>(used.size()))
+                used.push_back(0);
+            cell.Integer(tagColor) = c;
+        }
+    }
+
+    for(size_t k = 0; k < cells.size(); k++){
+        int c = m.Integer(cells[k], tagColor);
+        if(c >= static_cast<int>(colors.size()))
+            colors.resize(c+1);
+        colors[c].push_back(cells[k]);
+    }
+}
+
+inline void deleteColoring(INMOST::Mesh &m)
+{
+    if(m.HaveTag(tagNameColor))
+        m.DeleteTag(m.GetTag(tagNameColor));
+}
+
+#endif // COLORING_H
@@ -0,0 +1,309 @@
+#ifndef CPR_H
+#define CPR_H
+
+#include "inmost.h"
+#include "block_sparse.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+//    Constrained pressure residual (CPR) solver for coupled head-concentration
+//    Jacobians of the fully implicit scheme.
+//
+//    Unknowns come in pairs (head, concentration) of a cell, which form 2x2 blocks
+//    of BSRMatrix<2>. The system is first decoupled by alternate block
+//    factorization (true block-Jacobi decoupling): the matrix is multiplied
+//    from the left by the inverse of its block diagonal, so that head
+//    equations depend weakly on concentration. Preconditioner is then
+//      1. x_p = A_pp^-1 r_p: head block of decoupled matrix, solved with
+//         loose tolerance by an INMOST solver (AMG or ILU);
+//      2. z = x_p + M^-1 (r - A x_p), M - block ILU(0) of the decoupled matrix.
+//    Stage 1 is iterative, so outer iteration is flexible restarted GMRES.
+//
+//    Interface follows INMOST::Solver (SetMatrix, Solve, Iterations, ...),
+//    so both can be passed to the same Newton step code.
+//    Works on one processor: all blocks of the Jacobian should be local.
+
+class CPRSolver
+{
+private:
+    int n;                               // number of cells (block rows)
+    INMOST_DATA_ENUM_TYPE first, last;   // interval of Jacobian
+    std::vector<INMOST_DATA_ENUM_TYPE> index; // head and concentration index of each cell
+    std::vector<int> pos;                // position of Jacobian index in block vectors, -1 if none
+    INMOST::Sparse::Matrix *J;           // current Jacobian
+
+    BSRMatrix<2> A;                      // decoupled matrix at last rebuild
+    std::vector<double> dinv;            // decoupling: inverses of diagonal blocks, 4 per cell
+    BlockILU0<2> ilu;
+    INMOST::Sparse::Matrix Ap;           // head block of decoupled matrix
+    INMOST::Sparse::Vector rp, xp;
+    INMOST::Solver Sp;                   // solver of stage 1
+    bool built;
+
+    int restart, maxit;
+    double rtol, atol;
+    int iters, pressureIters;
+    double resid;
+    std::string reason;
+
+    double dot(const std::vector<double> &a, const std::vector<double> &b) const
+    {
+        double s = 0.;
+        for(size_t i = 0; i < a.size(); i++)
+            s += a[i]*b[i];
+        return s;
+    }
+
+    // y = D^-1 J x with current Jacobian and decoupling of last rebuild
+    void multiply(const std::vector<double> &x, std::vector<double> &y)
+    {
+        for(int i = 0; i < n; i++){
+            double s[2] = {0., 0.};
+            for(int c = 0; c < 2; c++){
+                INMOST::Sparse::Row &row = (*J)[index[2*i+c]];
+                for(INMOST_DATA_ENUM_TYPE k = 0; k < row.Size(); k++){
+                    INMOST_DATA_ENUM_TYPE col = row.GetIndex(k);
+                    if(col < first || col >= last || pos[col-first] < 0)
+                        continue;
+                    s[c] += row.GetValue(k) * x[pos[col-first]];
+                }
+            }
+            const double *d = &dinv[4*i];
+            y[2*i]   = d[0]*s[0] + d[1]*s[1];
+            y[2*i+1] = d[2]*s[0] + d[3]*s[1];
+        }
+    }
+
+    // z = P^-1 v, two stages
+    void precondition(const std::vector<double> &v, std::vector<double> &z)
+    {
+        for(int i = 0; i < n; i++){
+            rp[i] = v[2*i];
+            xp[i] = 0.;
+        }
+        Sp.Solve(rp, xp);
+        pressureIters += Sp.Iterations();
+
+        std::vector<double> t(2*n, 0.), w(2*n);
+        for(int i = 0; i < n; i++)
+            t[2*i] = xp[i];
+        A.multiply(&t[0], &w[0]);
+        for(int k = 0; k < 2*n; k++)
+            t[k] = v[k] - w[k];
+        ilu.apply(&t[0], &z[0]);
+        for(int i = 0; i < n; i++)
+            z[2*i] += xp[i];
+    }
+
+    // Decouple Jacobian and build both stages, false if a diagonal block is singular
+    bool build()
+    {
+        std::vector< std::vector<int> > cols(n);
+        dinv.assign(4*n, 0.);
+        for(int i = 0; i < n; i++){
+            double D[4] = {0., 0., 0., 0.};
+            cols[i].push_back(i);
+            for(int c = 0; c < 2; c++){
+                INMOST::Sparse::Row &row = (*J)[index[2*i+c]];
+                for(INMOST_DATA_ENUM_TYPE k = 0; k < row.Size(); k++){
+                    INMOST_DATA_ENUM_TYPE col = row.GetIndex(k);
+                    if(col < first || col >= last || pos[col-first] < 0)
+                        continue;
+                    int p = pos[col-first];
+                    cols[i].push_back(p/2);
+                    if(p/2 == i)
+                        D[2*c + p%2] += row.GetValue(k);
+                }
+            }
+            std::sort(cols[i].begin(), cols[i].end());
+            cols[i].erase(std::unique(cols[i].begin(), cols[i].end()), cols[i].end());
+            double det = D[0]*D[3] - D[1]*D[2];
+            if(det == 0.)
+                return false;
+            dinv[4*i]   =  D[3]/det;
+            dinv[4*i+1] = -D[1]/det;
+            dinv[4*i+2] = -D[2]/det;
+            dinv[4*i+3] =  D[0]/det;
+        }
+
+        A.setPattern(cols);
+        A.zero();
+        for(int i = 0; i < n; i++){
+            for(int c = 0; c < 2; c++){
+                INMOST::Sparse::Row &row = (*J)[index[2*i+c]];
+                for(INMOST_DATA_ENUM_TYPE k = 0; k < row.Size(); k++){
+                    INMOST_DATA_ENUM_TYPE col = row.GetIndex(k);
+                    if(col < first || col >= last || pos[col-first] < 0)
+                        continue;
+                    int p = pos[col-first];
+                    A.block(A.find(i, p/2))[2*c + p%2] += row.GetValue(k);
+                }
+            }
+            const double *d = &dinv[4*i];
+            for(int k = A.rowBegin(i); k < A.rowEnd(i); k++){
+                double *a = A.block(k);
+                double b[4] = {a[0], a[1], a[2], a[3]};
+                a[0] = d[0]*b[0] + d[1]*b[2];
+                a[1] = d[0]*b[1] + d[1]*b[3];
+                a[2] = d[2]*b[0] + d[3]*b[2];
+                a[3] = d[2]*b[1] + d[3]*b[3];
+            }
+        }
+        if(!ilu.build(A))
+            return false;
+
+        for(int i = 0; i < n; i++){
+            Ap[i].Clear();
+            for(int k = A.rowBegin(i); k < A.rowEnd(i); k++)
+                Ap[i][A.col(k)] = A.block(k)[0];
+        }
+        Sp.SetMatrix(Ap);
+        return true;
+    }
+
+public:
+    // Unknowns of a cell are indH[i], indC[i]; stage 1 uses INMOST solver of given type
+    CPRSolver(const std::vector<INMOST_DATA_ENUM_TYPE> &indH, const std::vector<INMOST_DATA_ENUM_TYPE> &indC,
+              const std::string &type, const std::string &prefix = "")
+        : n(static_cast<int>(indH.size())), J(NULL), Sp(type, prefix), built(false),
+          restart(30), maxit(1000), rtol(1e-12), atol(1e-15), iters(0), pressureIters(0), resid(0.)
+    {
+        first = ENUMUNDEF;
+        last = 0;
+        for(int i = 0; i < n; i++){
+            index.push_back(indH[i]);
+            index.push_back(indC[i]);
+            first = std::min(first, std::min(indH[i], indC[i]));
+            last  = std::max(last,  std::max(indH[i], indC[i]) + 1);
+        }
+        if(n == 0)
+            first = 0;
+        pos.assign(last - first, -1);
+        for(int k = 0; k < 2*n; k++)
+            pos[index[k]-first] = k;
+        Ap.SetInterval(0, n);
+        rp.SetInterval(0, n);
+        xp.SetInterval(0, n);
+        Sp.SetParameter("relative_tolerance", "1e-3");
+        Sp.SetParameter("maximum_iterations", "100");
+    }
+
+    void SetParameter(const std::string &name, const std::string &val)
+    {
+        if(name == "relative_tolerance")
+            rtol = atof(val.c_str());
+        else if(name == "absolute_tolerance")
+            atol = atof(val.c_str());
+        else if(name == "maximum_iterations")
+            maxit = atoi(val.c_str());
+        else if(name == "gmres_restart")
+            restart = atoi(val.c_str());
+    }
+
+    // Jacobian for next Solve; with oldPreconditioner both stages of the last rebuild are kept
+    void SetMatrix(INMOST::Sparse::Matrix &Jac, bool modifiedPattern = true, bool oldPreconditioner = false)
+    {
+        (void)modifiedPattern;
+        J = &Jac;
+        if(oldPreconditioner && built)
+            return;
+        built = build();
+    }
+
+    // Flexible GMRES(restart) for J sol = rhs, right-preconditioned
+    bool Solve(INMOST::Sparse::Vector &rhs, INMOST::Sparse::Vector &sol)
+    {
+        iters = 0;
+        pressureIters = 0;
+        if(!built){
+            reason = "singular diagonal block in CPR preconditioner";
+            return false;
+        }
+        int N = 2*n;
+        std::vector<double> b(N), x(N, 0.), r(N), w(N);
+        for(int i = 0; i < n; i++){
+            const double *d = &dinv[4*i];
+            double b0 = rhs[index[2*i]], b1 = rhs[index[2*i+1]];
+            b[2*i]   = d[0]*b0 + d[1]*b1;
+            b[2*i+1] = d[2]*b0 + d[3]*b1;
+        }
+        double tol = std::max(rtol*sqrt(dot(b, b)), atol);
+        r = b;
+        resid = sqrt(dot(r, r));
+
+        std::vector< std::vector<double> > V(restart+1, std::vector<double>(N)), Z(restart, std::vector<double>(N));
+        std::vector<double> H((restart+1)*restart), cs(restart), sn(restart), g(restart+1), y(restart);
+        while(resid > tol && iters < maxit){
+            for(int k = 0; k < N; k++)
+                V[0][k] = r[k] / resid;
+            std::fill(g.begin(), g.end(), 0.);
+            g[0] = resid;
+            int m = 0;
+            while(m < restart && iters < maxit){
+                precondition(V[m], Z[m]);
+                multiply(Z[m], w);
+                // Modified Gram-Schmidt
+                for(int j = 0; j <= m; j++){
+                    double h = dot(w, V[j]);
+                    H[j*restart+m] = h;
+                    for(int k = 0; k < N; k++)
+                        w[k] -= h * V[j][k];
+                }
+                double h = sqrt(dot(w, w));
+                H[(m+1)*restart+m] = h;
+                if(h > 0.)
+                    for(int k = 0; k < N; k++)
+                        V[m+1][k] = w[k] / h;
+                // Givens rotations make H upper triangular
+                for(int j = 0; j < m; j++){
+                    double a = H[j*restart+m], c = H[(j+1)*restart+m];
+                    H[j*restart+m]     =  cs[j]*a + sn[j]*c;
+                    H[(j+1)*restart+m] = -sn[j]*a + cs[j]*c;
+                }
+                double a = H[m*restart+m], c = H[(m+1)*restart+m], d = sqrt(a*a + c*c);
+                cs[m] = d > 0. ? a/d : 1.;
+                sn[m] = d > 0. ? c/d : 0.;
+                H[m*restart+m] = d;
+                H[(m+1)*restart+m] = 0.;
+                g[m+1] = -sn[m]*g[m];
+                g[m]   =  cs[m]*g[m];
+                iters++;
+                m++;
+                if(fabs(g[m]) <= tol || h == 0.)
+                    break;
+            }
+            for(int j = m-1; j >= 0; j--){
+                double s = g[j];
+                for(int l = j+1; l < m; l++)
+                    s -= H[j*restart+l] * y[l];
+                y[j] = H[j*restart+j] != 0. ? s / H[j*restart+j] : 0.;
+            }
+            for(int j = 0; j < m; j++)
+                for(int k = 0; k < N; k++)
+                    x[k] += y[j] * Z[j][k];
+            multiply(x, w);
+            for(int k = 0; k < N; k++)
+                r[k] = b[k] - w[k];
+            resid = sqrt(dot(r, r));
+        }
+
+        for(int k = 0; k < N; k++)
+            sol[index[k]] = x[k];
+        if(resid > tol){
+            reason = "maximum number of iterations reached";
+            return false;
+        }
+        reason = "converged";
+        return true;
+    }
+
+    INMOST_DATA_ENUM_TYPE Iterations() const { return static_cast<INMOST_DATA_ENUM_TYPE>(iters); }
+    int PressureIterations() const { return pressureIters; }
+    double Residual() const { return resid; }
+    std::string GetReason() const { return reason; }
+};
+
+#endif // CPR_H
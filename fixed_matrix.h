@@ -0,0 +1,187 @@
+#ifndef FIXED_MATRIX_H
+#define FIXED_MATRIX_H
+
+#include <cmath>
+#include <cstdio>
+
+//    Small dense matrices with sizes known at compile time.
+//
+//    Unlike rMatrix, storage lives on the stack, so element kernels
+//    built on fMatrix do not allocate memory inside cell loops.
+//    All loops have compile-time bounds and are unrolled by the compiler.
+//
+//    Interface follows rMatrix where possible: entries are accessed
+//    as A(i,j), matrices can be added, multiplied, transposed and inverted.
+
+
+template<int M, int N>
+class fMatrix
+{
+private:
+    double a[M*N]; // row-wise storage
+public:
+    fMatrix() {}
+
+    double &operator()(int i, int j)       { return a[i*N+j]; }
+    double  operator()(int i, int j) const { return a[i*N+j]; }
+    double *data()                         { return a; }
+    const double *data() const             { return a; }
+    int Rows() const { return M; }
+    int Cols() const { return N; }
+
+    void Zero()
+    {
+        for(int k = 0; k < M*N; k++)
+            a[k] = 0.;
+    }
+
+    fMatrix<N,M> Transpose() const
+    {
+        fMatrix<N,M> res;
+        for(int i = 0; i < M; i++)
+            for(int j = 0; j < N; j++)
+                res(j,i) = a[i*N+j];
+        return res;
+    }
+
+    fMatrix &operator*=(double s)
+    {
+        for(int k = 0; k < M*N; k++)
+            a[k] *= s;
+        return *this;
+    }
+
+    fMatrix &operator/=(double s)
+    {
+        for(int k = 0; k < M*N; k++)
+            a[k] /= s;
+        return *this;
+    }
+
+    fMatrix &operator+=(const fMatrix &B)
+    {
+        for(int k = 0; k < M*N; k++)
+            a[k] += B.a[k];
+        return *this;
+    }
+
+    fMatrix &operator-=(const fMatrix &B)
+    {
+        for(int k = 0; k < M*N; k++)
+            a[k] -= B.a[k];
+        return *this;
+    }
+
+    fMatrix operator+(const fMatrix &B) const { fMatrix res(*this); res += B; return res; }
+    fMatrix operator-(const fMatrix &B) const { fMatrix res(*this); res -= B; return res; }
+    fMatrix operator*(double s)         const { fMatrix res(*this); res *= s; return res; }
+    fMatrix operator/(double s)         const { fMatrix res(*this); res /= s; return res; }
+
+    template<int K>
+    fMatrix<M,K> operator*(const fMatrix<N,K> &B) const
+    {
+        fMatrix<M,K> res;
+        for(int i = 0; i < M; i++)
+            for(int j = 0; j < K; j++){
+                double s = 0.;
+                for(int l = 0; l < N; l++)
+                    s += a[i*N+l] * B(l,j);
+                res(i,j) = s;
+            }
+        return res;
+    }
+
+    double DotProduct(const fMatrix &B) const
+    {
+        double s = 0.;
+        for(int k = 0; k < M*N; k++)
+            s += a[k] * B.a[k];
+        return s;
+    }
+
+    // Inverse of a square matrix by Gauss-Jordan elimination
+    // with partial pivoting; *ierr is set to nonzero if matrix is singular
+    fMatrix Invert(int *ierr = NULL) const
+    {
+        static_assert(M == N, "fMatrix::Invert requires square matrix");
+        fMatrix A(*this), res;
+        res.Zero();
+        for(int i = 0; i < M; i++)
+            res(i,i) = 1.;
+        if(ierr)
+            *ierr = 0;
+        for(int k = 0; k < M; k++){
+            int p = k;
+            for(int i = k+1; i < M; i++)
+                if(fabs(A(i,k)) > fabs(A(p,k)))
+                    p = i;
+            if(A(p,k) == 0.){
+                if(ierr)
+                    *ierr = k+1;
+                return res;
+            }
+            if(p != k){
+                for(int j = 0; j < M; j++){
+                    double t = A(k,j); A(k,j) = A(p,j); A(p,j) = t;
+                    t = res(k,j); res(k,j) = res(p,j); res(p,j) = t;
+                }
+            }
+            double d = 1. / A(k,k);
+            for(int j = 0; j < M; j++){
+                A(k,j) *= d;
+                res(k,j) *= d;
+            }
+            for(int i = 0; i < M; i++){
+                if(i == k)
+                    continue;
+                double c = A(i,k);
+                for(int j = 0; j < M; j++){
+                    A(i,j) -= c * A(k,j);
+                    res(i,j) -= c * res(k,j);
+                }
+            }
+        }
+        return res;
+    }
+
+    bool isSymmetric(double eps = 1e-7) const
+    {
+        if(M != N)
+            return false;
+        for(int i = 0; i < M; i++)
+            for(int j = i+1; j < N; j++)
+                if(fabs(a[i*N+j] - a[j*N+i]) > eps)
+                    return false;
+        return true;
+    }
+
+    void Print() const
+    {
+        for(int i = 0; i < M; i++){
+            for(int j = 0; j < N; j++)
+                printf("%14e ", a[i*N+j]);
+            printf("\n");
+        }
+    }
+};
+
+template<int M, int N>
+fMatrix<M,N> operator*(double s, const fMatrix<M,N> &A)
+{
+    return A * s;
+}
+
+// Determinants of small matrices in closed form
+inline double det(const fMatrix<2,2> &A)
+{
+    return A(0,0)*A(1,1) - A(0,1)*A(1,0);
+}
+
+inline double det(const fMatrix<3,3> &A)
+{
+    return A(0,0)*(A(1,1)*A(2,2) - A(1,2)*A(2,1))
+         - A(0,1)*(A(1,0)*A(2,2) - A(1,2)*A(2,0))
+         + A(0,2)*(A(1,0)*A(2,1) - A(1,1)*A(2,0));
+}
+
+#endif // FIXED_MATRIX_H
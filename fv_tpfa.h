@@ -0,0 +1,168 @@
+#ifndef FV_TPFA_H
+#define FV_TPFA_H
+
+#include "inmost.h"
+#include "tensor_tag.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+//    Finite volume approximation of diffusive flux D grad U through faces.
+//
+//    Works for 2D and 3D meshes, dimension is taken from the mesh.
+//    Diffusion tensor is stored in a cell tag:
+//      2D: 3 numbers  Dxx, Dyy, Dxy
+//      3D: 6 numbers  Dxx, Dyy, Dzz, Dxy, Dxz, Dyz  (as in 3d_diffusion_vem)
+//    Boundary condition tag is defined on faces with 2 numbers:
+//    type (<= 0 - Dirichlet, > 0 - Neumann) and value (U or flux -D grad U . n).
+//
+//    Tensor may be stored compactly on the mesh, see tensor_tag.h.
+//    Fluxes are densities along face unit normal (oriented from back
+//    to front cell), multiply by face area to get total flux.
+//    Gravity term getDgradZ uses the last coordinate as vertical one.
+
+class FV_Diffusion
+{
+protected:
+    INMOST::Mesh *m;
+    INMOST::Tag tagD;  // Diffusion tensor tag
+    INMOST::Tag tagBC; // Boundary condition
+public:
+    FV_Diffusion(INMOST::Mesh *mm, std::string nameD, std::string nameBC)
+    {
+        if(mm == nullptr){
+            std::cout << "Bad mesh pointer" << std::endl;
+            exit(1);
+        }
+        m = mm;
+        if(m->HaveTag(nameD)){
+            tagD = m->GetTag(nameD);
+        }
+        else{
+            std::cout << "Bad tensor name tag" << std::endl;
+            exit(1);
+        }
+        INMOST_DATA_ENUM_TYPE size = m->GetDimensions() == 2 ? 3 : 6;
+        if(tagD.GetSize() != size){
+            std::cout << "Tensor tag " << nameD << " has size " << tagD.GetSize()
+                      << ", " << size << " is needed for " << m->GetDimensions() << "D mesh" << std::endl;
+            exit(1);
+        }
+        if(m->HaveTag(nameBC)){
+            tagBC = m->GetTag(nameBC);
+        }
+        else{
+            std::cout << "Bad BC name tag" << std::endl;
+            exit(1);
+        }
+    }
+    virtual ~FV_Diffusion(){}
+    virtual void build() = 0;
+    virtual INMOST::variable getDgradU(const INMOST::Face &f, INMOST::dynamic_variable &U) = 0;
+    virtual double   getDgradZ(const INMOST::Face &f) = 0;
+};
+
+// Projection D*l/|l|^2 on face normal, l = xf - xc, d is tensor in the layout above
+inline double tpfaHalfCoef(const double *d, int dim, const double *xf, const double *xc, const double *ne)
+{
+    double T[3][3];
+    if(dim == 2){
+        T[0][0] = d[0]; T[0][1] = d[2];
+        T[1][0] = d[2]; T[1][1] = d[1];
+    }
+    else{
+        T[0][0] = d[0]; T[0][1] = d[3]; T[0][2] = d[4];
+        T[1][0] = d[3]; T[1][1] = d[1]; T[1][2] = d[5];
+        T[2][0] = d[4]; T[2][1] = d[5]; T[2][2] = d[2];
+    }
+    double l[3], l2 = 0., s = 0.;
+    for(int i = 0; i < dim; i++){
+        l[i] = xf[i] - xc[i];
+        l2 += l[i]*l[i];
+    }
+    for(int i = 0; i < dim; i++)
+        for(int j = 0; j < dim; j++)
+            s += T[i][j] * l[j] * ne[i];
+    return s / l2;
+}
+
+class FV_Diffusion_TPFA : public FV_Diffusion
+{
+protected:
+    // Per-face data indexed by face LocalID, filled in build()
+    std::vector<double>     trans;   // TPFA transmissibility coeff
+    std::vector<double>     transDz; // transmissibility times vertical difference for gravity term
+    std::vector<INMOST::HandleType> cellP;   // back cell
+    std::vector<INMOST::HandleType> cellM;   // front cell, InvalidHandle() on boundary
+public:
+    void build();
+    INMOST::variable getDgradU(const INMOST::Face &f, INMOST::dynamic_variable &U);
+    double   getDgradZ(const INMOST::Face &f);
+    FV_Diffusion_TPFA(INMOST::Mesh *mm, std::string s1, std::string s2) : FV_Diffusion(mm,s1,s2) {}
+    ~FV_Diffusion_TPFA() {}
+};
+
+inline void FV_Diffusion_TPFA::build()
+{
+    using namespace INMOST;
+    int dim = m->GetDimensions();
+    int nf = m->FaceLastLocalID();
+    trans.assign(nf, 0.);
+    transDz.assign(nf, 0.);
+    cellP.assign(nf, InvalidHandle());
+    cellM.assign(nf, InvalidHandle());
+    for(Mesh::iteratorFace iface = m->BeginFace(); iface != m->EndFace(); iface++){
+        Face f = iface->getAsFace();
+        int k = f.LocalID();
+        double xf[3] = {0., 0., 0.}, ne[3] = {0., 0., 0.};
+        f.Barycenter(xf);
+        // Get unit normal for face
+        f.UnitNormal(ne);
+
+        // Here 'p' and 'm' refer to '+' and '-'
+        Cell cp = f.BackCell();
+        double xp[3] = {0., 0., 0.};
+        cp.Barycenter(xp);
+        double cpD = tpfaHalfCoef(cellTensor(*m, tagD, cp.GetHandle()), dim, xf, xp, ne);
+        cellP[k] = cp.GetHandle();
+
+        if(f.Boundary()){
+            trans[k]   = cpD;
+            transDz[k] = cpD * (xf[dim-1] - xp[dim-1]);
+        }
+        else{ // internal face
+            Cell cm = f.FrontCell();
+            double xm[3] = {0., 0., 0.};
+            cm.Barycenter(xm);
+            double cmD = tpfaHalfCoef(cellTensor(*m, tagD, cm.GetHandle()), dim, xf, xm, ne);
+            cellM[k] = cm.GetHandle();
+
+            trans[k]   = -cpD * cmD / (cpD - cmD);
+            transDz[k] = trans[k] * (xm[dim-1] - xp[dim-1]);
+        }
+    }
+}
+
+inline INMOST::variable FV_Diffusion_TPFA::getDgradU(const INMOST::Face &f, INMOST::dynamic_variable &U)
+{
+    using namespace INMOST;
+    int k = f.LocalID();
+    Cell cp(m, cellP[k]);
+    if(cellM[k] == InvalidHandle()){
+        // Check if Neumann, then flux is known
+        if(f.RealArray(tagBC)[0] > 0.)
+            return -f.RealArray(tagBC)[1]; // minus because we know flux which is -DgradU
+
+        // Dirichlet
+        return trans[k] * (f.RealArray(tagBC)[1] - U(cp));
+    }
+    Cell cm(m, cellM[k]);
+    return trans[k] * (U(cm) - U(cp));
+}
+
+inline double FV_Diffusion_TPFA::getDgradZ(const INMOST::Face &f)
+{
+    return transDz[f.LocalID()];
+}
+
+#endif // FV_TPFA_H
@@ -0,0 +1,78 @@
+#ifndef HALO_OVERLAP_H
+#define HALO_OVERLAP_H
+
+#include "inmost.h"
+#include <vector>
+
+//    Overlap of ghost data exchange with computation.
+//
+//    Cells are split into interior and halo ones. A cell is interior if it
+//    is owned and has no ghost elements of type 'bridge' (NODE for node-based
+//    unknowns, FACE for face-based ones): it needs no data of other
+//    processors. Interior cells are processed while exchange of a tag
+//    is in flight, halo cells after the exchange is completed.
+//
+//    HaloExchange wraps Mesh::ExchangeDataBegin/ExchangeDataEnd for one tag,
+//    end() does nothing if no exchange was started, so it is safe to call
+//    it unconditionally before halo cells.
+
+// Split groups of cells (colors or a single list) into interior and halo parts
+// of the same structure, order of cells within each group is kept
+inline void splitHaloCells(INMOST::Mesh &m, INMOST::ElementType bridge,
+                           std::vector< std::vector<INMOST::HandleType> > &groups,
+                           std::vector< std::vector<INMOST::HandleType> > &halo)
+{
+    using namespace INMOST;
+    halo.assign(groups.size(), std::vector<HandleType>());
+    for(size_t g = 0; g < groups.size(); g++){
+        std::vector<HandleType> inner;
+        for(size_t k = 0; k < groups[g].size(); k++){
+            Cell cell(&m, groups[g][k]);
+            bool isHalo = cell.GetStatus() == Element::Ghost;
+            if(!isHalo){
+                ElementArray<Element> adj = cell.getAdjElements(bridge);
+                for(ElementArray<Element>::iterator it = adj.begin(); it != adj.end(); it++)
+                    if(it->GetStatus() == Element::Ghost){
+                        isHalo = true;
+                        break;
+                    }
+            }
+            if(isHalo)
+                halo[g].push_back(groups[g][k]);
+            else
+                inner.push_back(groups[g][k]);
+        }
+        groups[g].swap(inner);
+    }
+}
+
+class HaloExchange
+{
+private:
+    INMOST::Mesh *m;
+    INMOST::Tag tag;
+    INMOST::ElementType etype;
+    INMOST::Mesh::exchange_data storage;
+    bool pending;
+public:
+    HaloExchange() : m(NULL), etype(INMOST::NONE), pending(false) {}
+    ~HaloExchange() { end(); }
+    void begin(INMOST::Mesh &mesh, const INMOST::Tag &t, INMOST::ElementType type)
+    {
+        end();
+        m = &mesh;
+        tag = t;
+        etype = type;
+        m->ExchangeDataBegin(tag, etype, 0, storage);
+        pending = true;
+    }
+    void end()
+    {
+        if(!pending)
+            return;
+        m->ExchangeDataEnd(tag, etype, 0, storage);
+        pending = false;
+    }
+};
+
+#endif // HALO_OVERLAP_H
@@ -0,0 +1,47 @@
+#ifndef LINEAR_RESIDUAL_H
+#define LINEAR_RESIDUAL_H
+
+#include "inmost.h"
+
+//    Assembly of residual of a linear problem.
+//
+//    For a linear problem R = A*x - b and the Jacobian is just A.
+//    In AD mode every R[i] += a*x(e) builds a variable expression
+//    and merges its sparse row of derivatives into the residual.
+//    In numeric mode coefficient a is added straight to the Jacobian
+//    and a*x(e) to the residual value, which gives the same system
+//    without temporary expressions.
+//
+//    Indices are taken from dynamic_variable in both modes,
+//    so the rest of the code (solver, solution update) is the same.
+
+class LinearResidual
+{
+private:
+    INMOST::Residual &R;
+    bool numeric;
+public:
+    LinearResidual(INMOST::Residual &res, bool num) : R(res), numeric(num) {}
+
+    // R[i] += a * x(e)
+    void add(INMOST_DATA_ENUM_TYPE i, double a, const INMOST::dynamic_variable &x, const INMOST::Element &e)
+    {
+        if(numeric){
+            R.GetJacobian()[i][x.Index(e)] += a;
+            R.GetResidual()[i] += a * x.Value(e);
+        }
+        else
+            R[i] += a * x(e);
+    }
+
+    // R[i] += c
+    void add(INMOST_DATA_ENUM_TYPE i, double c)
+    {
+        if(numeric)
+            R.GetResidual()[i] += c;
+        else
+            R[i] += c;
+    }
+};
+
+#endif // LINEAR_RESIDUAL_H
@@ -0,0 +1,125 @@
+#ifndef LOAD_BALANCE_H
+#define LOAD_BALANCE_H
+
+#include "inmost.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+//    Cost-weighted load balance of cells.
+//
+//    Geometric partitioning gives every processor the same number of cells,
+//    while cost of a cell may differ a lot: VEM assembly grows roughly
+//    with the square of number of cell nodes. Cost of each owned cell is
+//    estimated by a model and stored in integer tag PARTITION_WEIGHT:
+//      nodes - (number of nodes)^2;
+//      time  - assembly time of the cell measured in an earlier run
+//              and stored in real tag ASSEMBLY_TIME of the mesh file.
+//    Imbalance is max over processors of the summed weight of owned cells
+//    divided by its average; 1 is perfect balance. If it is above threshold,
+//    the mesh is repartitioned by a graph partitioner with these weights.
+
+const std::string tagNameWeight = "PARTITION_WEIGHT";
+const std::string tagNameCost   = "ASSEMBLY_TIME";
+
+enum CostModel
+{
+    COST_UNIFORM = 0,
+    COST_NODES,
+    COST_TIME
+};
+
+inline int parseCostModel(const std::string &name)
+{
+    if(name == "nodes")
+        return COST_NODES;
+    if(name == "time")
+        return COST_TIME;
+    if(name == "uniform")
+        return COST_UNIFORM;
+    std::cout << "Unknown cost model " << name << ", use nodes, time or uniform" << std::endl;
+    exit(1);
+}
+
+inline INMOST::Partitioner::Type parsePartitioner(const std::string &name)
+{
+    if(name == "parmetis")
+        return INMOST::Partitioner::Parmetis;
+    if(name == "zoltan")
+        return INMOST::Partitioner::Zoltan_PHG;
+    std::cout << "Unknown graph partitioner " << name << ", use parmetis or zoltan" << std::endl;
+    exit(1);
+}
+
+// Set weights of owned cells by cost model. Measured times are scaled
+// to integers 1..1000 by the largest time over all processors
+inline INMOST::Tag setCellWeights(INMOST::Mesh &m, int model)
+{
+    using namespace INMOST;
+    Tag tagW = m.CreateTag(tagNameWeight, DATA_INTEGER, CELL, NONE, 1);
+    Tag tagT;
+    double tmax = 0.;
+    if(model == COST_TIME){
+        if(!m.HaveTag(tagNameCost)){
+            if(m.GetProcessorRank() == 0)
+                std::cout << "Mesh has no tag " << tagNameCost << " with measured cell costs" << std::endl;
+            exit(1);
+        }
+        tagT = m.GetTag(tagNameCost);
+        for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            if(icell->GetStatus() != Element::Ghost)
+                tmax = std::max(tmax, icell->Real(tagT));
+        tmax = m.AggregateMax(tmax);
+    }
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        if(icell->GetStatus() == Element::Ghost)
+            continue;
+        int w = 1;
+        if(model == COST_NODES){
+            int nn = static_cast<int>(icell->getNodes().size());
+            w = nn * nn;
+        }
+        else if(model == COST_TIME && tmax > 0.)
+            w = std::max(1, static_cast<int>(1000. * icell->Real(tagT) / tmax + 0.5));
+        icell->Integer(tagW) = w;
+    }
+    return tagW;
+}
+
+// Max over processors of a local load divided by its average
+inline double imbalance(INMOST::Mesh &m, double load)
+{
+    double lmax = m.AggregateMax(load);
+    double lavg = m.Integrate(load) / m.GetProcessorsNumber();
+    return lavg > 0. ? lmax / lavg : 1.;
+}
+
+// Imbalance of summed weights of owned cells
+inline double weightImbalance(INMOST::Mesh &m, INMOST::Tag tagW)
+{
+    using namespace INMOST;
+    double load = 0.;
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
+        if(icell->GetStatus() != Element::Ghost)
+            load += icell->Integer(tagW);
+    return imbalance(m, load);
+}
+
+// Repartition owned cells with weights by graph partitioner.
+// Ghost layers are removed, the caller restores them together
+// with global IDs and geometric data
+inline void repartitionWeighted(INMOST::Mesh &m, INMOST::Tag tagW, INMOST::Partitioner::Type type)
+{
+    using namespace INMOST;
+    m.RemoveGhost();
+    Partitioner part(&m);
+    part.SetMethod(type, Partitioner::Repartition);
+    part.SetWeight(tagW);
+    part.Evaluate();
+    m.Redistribute();
+    m.ReorderEmpty(CELL|FACE|EDGE|NODE);
+}
+
+#endif // LOAD_BALANCE_H
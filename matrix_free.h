@@ -0,0 +1,61 @@
+#ifndef MATRIX_FREE_H
+#define MATRIX_FREE_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+//    Conjugate gradients for matrix-free operators.
+//
+//    The global matrix is never stored: the operator provides
+//      void multiply(const std::vector<double> &x, std::vector<double> &y);
+//      double dot(const std::vector<double> &a, const std::vector<double> &b);
+//    where multiply() applies A by a loop over cells with local matrices
+//    and dot() sums over owned unknowns of all processors.
+//
+//    Preconditioner is Jacobi with assembled diagonal of A;
+//    entries with zero diagonal (rows without unknowns) are kept zero.
+//    Stops when |r| <= max(rtol*|b|, atol), returns false if maxit is reached.
+
+template<typename Operator>
+bool solveMatrixFreeCG(Operator &op, const std::vector<double> &diag,
+                       const std::vector<double> &b, std::vector<double> &x,
+                       double rtol, double atol, int maxit, int &iters, double &resid)
+{
+    size_t N = b.size();
+    std::vector<double> r(N), z(N), p(N), q(N);
+    op.multiply(x, q);
+    for(size_t i = 0; i < N; i++)
+        r[i] = b[i] - q[i];
+    double tol = std::max(rtol*sqrt(op.dot(b, b)), atol);
+    resid = sqrt(op.dot(r, r));
+    iters = 0;
+    if(resid <= tol)
+        return true;
+    for(size_t i = 0; i < N; i++)
+        z[i] = diag[i] != 0. ? r[i] / diag[i] : 0.;
+    p = z;
+    double rz = op.dot(r, z);
+    while(iters < maxit){
+        iters++;
+        op.multiply(p, q);
+        double alpha = rz / op.dot(p, q);
+        for(size_t i = 0; i < N; i++){
+            x[i] += alpha * p[i];
+            r[i] -= alpha * q[i];
+        }
+        resid = sqrt(op.dot(r, r));
+        if(resid <= tol)
+            return true;
+        for(size_t i = 0; i < N; i++)
+            z[i] = diag[i] != 0. ? r[i] / diag[i] : 0.;
+        double rzNew = op.dot(r, z);
+        double beta = rzNew / rz;
+        rz = rzNew;
+        for(size_t i = 0; i < N; i++)
+            p[i] = z[i] + beta * p[i];
+    }
+    return false;
+}
+
+#endif // MATRIX_FREE_H
@@ -0,0 +1,176 @@
+#ifndef MEMORY_REPORT_H
+#define MEMORY_REPORT_H
+
+#include "inmost.h"
+#include "profiling.h"
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+//    Memory accounting of a run.
+//
+//    Bytes are estimated by items:
+//      tag <name> - data of a mesh tag: number of records (all elements
+//                   for dense tags, elements having data for sparse ones)
+//                   times record size; for DATA_VARIABLE derivatives of
+//                   each variable, which live on heap, are added;
+//      topology   - adjacency lists of mesh elements;
+//      jacobian   - nonzeros of the largest assembled matrix;
+//      solver     - growth of resident memory while preconditioner is built,
+//                   largest over all builds.
+//    report() is collective: it prints max and sum over processors
+//    and stores max bytes of each item in profiler values "mem_<item>".
+//    Items are matched by name with agreeNames(), missing ones count as zero.
+
+class MemoryReport
+{
+private:
+    std::vector<std::string> names;
+    std::vector<double> bytes;
+    bool enabled;
+
+    int index(const std::string &name)
+    {
+        for(int i = 0; i < static_cast<int>(names.size()); i++)
+            if(names[i] == name)
+                return i;
+        names.push_back(name);
+        bytes.push_back(0.);
+        return static_cast<int>(names.size()) - 1;
+    }
+
+public:
+    MemoryReport() : enabled(false) {}
+    void enable(bool b) { enabled = b; }
+    bool isEnabled() const { return enabled; }
+
+    void set(const std::string &name, double b) { bytes[index(name)] = b; }
+
+    // Keep the largest of values measured several times
+    void setMax(const std::string &name, double b)
+    {
+        int i = index(name);
+        if(b > bytes[i])
+            bytes[i] = b;
+    }
+
+    // Current resident set size of this process in bytes, 0 if unknown
+    static double residentMemory()
+    {
+#if defined(__linux__)
+        FILE *f = fopen("/proc/self/statm", "r");
+        if(f == NULL)
+            return 0.;
+        long pages = 0, resident = 0;
+        int n = fscanf(f, "%ld %ld", &pages, &resident);
+        fclose(f);
+        if(n == 2)
+            return static_cast<double>(resident) * sysconf(_SC_PAGESIZE);
+#endif
+        return 0.;
+    }
+
+    static double matrixBytes(const INMOST::Sparse::Matrix &A)
+    {
+        double nnz = 0.;
+        for(INMOST_DATA_ENUM_TYPE i = A.GetFirstIndex(); i < A.GetLastIndex(); i++)
+            nnz += A[i].Size();
+        return nnz * (sizeof(INMOST_DATA_ENUM_TYPE) + sizeof(INMOST_DATA_REAL_TYPE));
+    }
+
+    // Heap part of DATA_VARIABLE record of an element: its derivatives
+    static double variableBytes(INMOST::Mesh &m, INMOST::HandleType h, const INMOST::Tag &tag)
+    {
+        double entries = 0.;
+        INMOST::Storage::var_array v = m.VariableArray(h, tag);
+        for(INMOST_DATA_ENUM_TYPE k = 0; k < v.size(); k++)
+            entries += v[k].GetRow().Size();
+        return entries * (sizeof(INMOST_DATA_ENUM_TYPE) + sizeof(INMOST_DATA_REAL_TYPE));
+    }
+
+    void addTags(INMOST::Mesh &m)
+    {
+        using namespace INMOST;
+        const ElementType types[5] = {NODE, EDGE, FACE, CELL, MESH};
+        std::vector<std::string> list;
+        m.ListTagNames(list);
+        for(size_t k = 0; k < list.size(); k++){
+            Tag tag = m.GetTag(list[k]);
+            bool heap = tag.GetDataType() == DATA_VARIABLE;
+            double b = 0.;
+            for(int t = 0; t < 5; t++){
+                if(!tag.isDefined(types[t]))
+                    continue;
+                if(types[t] == MESH){
+                    b += m.GetDataSize(m.GetHandle(), tag) * tag.GetBytesSize();
+                    if(heap && m.HaveData(m.GetHandle(), tag))
+                        b += variableBytes(m, m.GetHandle(), tag);
+                    continue;
+                }
+                bool fixed = tag.GetSize() != ENUMUNDEF;
+                if(fixed && !tag.isSparse(types[t]) && !heap){
+                    double n = types[t] == NODE ? m.NumberOfNodes() :
+                               types[t] == EDGE ? m.NumberOfEdges() :
+                               types[t] == FACE ? m.NumberOfFaces() : m.NumberOfCells();
+                    b += n * tag.GetSize() * tag.GetBytesSize();
+                    continue;
+                }
+                for(Mesh::iteratorElement it = m.BeginElement(types[t]); it != m.EndElement(); it++)
+                    if(m.HaveData(it->GetHandle(), tag)){
+                        b += m.GetDataSize(it->GetHandle(), tag) * tag.GetBytesSize();
+                        if(heap)
+                            b += variableBytes(m, it->GetHandle(), tag);
+                    }
+            }
+            set("tag " + list[k], b);
+        }
+    }
+
+    void addTopology(INMOST::Mesh &m)
+    {
+        using namespace INMOST;
+        double links = 0.;
+        for(Mesh::iteratorElement it = m.BeginElement(NODE|EDGE|FACE|CELL); it != m.EndElement(); it++)
+            links += m.LowConn(it->GetHandle()).size() + m.HighConn(it->GetHandle()).size();
+        set("topology", links * sizeof(HandleType));
+    }
+
+    void report(INMOST::Mesh &m, Profiler &prof)
+    {
+        if(!enabled)
+            return;
+        std::vector<std::string> all = agreeNames(m, names);
+        int n = static_cast<int>(all.size());
+        std::vector<double> bmax(n, 0.), bsum;
+        for(int i = 0; i < n; i++){
+            size_t k = std::find(names.begin(), names.end(), all[i]) - names.begin();
+            if(k < names.size())
+                bmax[i] = bytes[k];
+        }
+        bsum = bmax;
+        if(n > 0 && m.GetProcessorsNumber() > 1){
+            m.AggregateMax(&bmax[0], n);
+            m.Integrate(&bsum[0], n);
+        }
+        for(int i = 0; i < n; i++)
+            prof.setValue("mem_" + all[i], bmax[i]);
+        if(m.GetProcessorRank() != 0)
+            return;
+        double total = 0.;
+        printf("\n+=========================\n");
+        printf("| %-30s %12s %12s\n", "Memory, MB", "max", "sum");
+        for(int i = 0; i < n; i++){
+            printf("| %-30s %12.2lf %12.2lf\n", all[i].c_str(), bmax[i] / 1048576., bsum[i] / 1048576.);
+            total += bsum[i];
+        }
+        printf("+-------------------------\n");
+        printf("| %-30s %12s %12.2lf\n", "total", "", total / 1048576.);
+        printf("+=========================\n");
+    }
+};
+
+#endif // MEMORY_REPORT_H
@@ -0,0 +1,65 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "inmost.h"
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+//    Binary cache of prepared mesh.
+//
+//    Parsing of ASCII VTK, partitioning and redistribution of a large mesh
+//    may take longer than the solution itself. saveMeshCache() writes the mesh
+//    after this preparation (parts of processors, ghost layers, global IDs and
+//    geometric data) to INMOST binary format .pmf, the number of processors
+//    is stored in a mesh tag. Loaded on the same number of processors,
+//    every processor reads its own part and partitioning is skipped.
+//
+//    The cache keeps ghost layers of the driver that made it,
+//    so it should be used with the same driver.
+
+const std::string tagNameCacheProcs = "MESH_CACHE_PROCESSORS";
+
+inline bool isMeshCache(const std::string &name)
+{
+    return name.size() > 4 && name.compare(name.size()-4, 4, ".pmf") == 0;
+}
+
+// Load mesh: parallel formats on all processors, others on processor 0.
+// Returns true if it is a cache made for the current number of processors
+inline bool loadMesh(INMOST::Mesh &m, const std::string &name)
+{
+    using namespace INMOST;
+    if(m.isParallelFileFormat(name))
+        m.Load(name);
+    else if(m.GetProcessorRank() == 0)
+        m.Load(name);
+    if(!isMeshCache(name) || !m.HaveTag(tagNameCacheProcs))
+        return false;
+    int np = m.Integer(m.GetHandle(), m.GetTag(tagNameCacheProcs));
+    if(np != m.GetProcessorsNumber()){
+        if(m.GetProcessorRank() == 0)
+            std::cout << "Mesh cache was made for " << np << " processors, repartitioning" << std::endl;
+        return false;
+    }
+    m.RestoreGeometricTags();
+    return true;
+}
+
+// Save prepared mesh to .pmf file
+inline void saveMeshCache(INMOST::Mesh &m, const std::string &name)
+{
+    using namespace INMOST;
+    if(!isMeshCache(name)){
+        if(m.GetProcessorRank() == 0)
+            std::cout << "Mesh cache should be a .pmf file: " << name << std::endl;
+        exit(1);
+    }
+    Tag tagProcs = m.CreateTag(tagNameCacheProcs, DATA_INTEGER, MESH, NONE, 1);
+    m.Integer(m.GetHandle(), tagProcs) = m.GetProcessorsNumber();
+    m.Save(name);
+    if(m.GetProcessorRank() == 0)
+        std::cout << "Mesh saved to " << name << std::endl;
+}
+
+#endif // MESH_CACHE_H
@@ -0,0 +1,323 @@
+#ifndef PROFILING_H
+#define PROFILING_H
+
+#include "inmost.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+//    Run-time statistics shared by all drivers.
+//
+//    Time is collected per phase: top-level phases are the T_* ones below,
+//    nested phases are opened with Profiler::Scope inside other scopes
+//    and are reported as "parent/child". Each phase counts its calls.
+//    Integer counters (Newton, linear iterations, ...) are accumulated
+//    in total and per time step, scalar values (errors, norms) are stored as is.
+//
+//    report() prints the table of times (min/avg/max over processors)
+//    with peak resident memory of the largest process and writes <prefix>.json and, if steps were recorded, <prefix>_steps.csv.
+//    Counters in <prefix>.json are max over processors, per step ones are of processor 0.
+//    It is collective: all processors should call it. Phases and counters
+//    are created on first use, so processors may have different lists;
+//    they are matched by name with agreeNames() and missing ones count as zero.
+
+enum{
+    T_ASSEMBLE = 0,
+    T_SOLVE,
+    T_PRECOND,
+    T_IO,
+    T_INIT,
+    T_UPDATE,
+    T_NUM
+};
+
+// Union of name lists of all processors, the same on each of them:
+// names of processor 0 first, then new names of processor 1 and so on.
+// Collective. Lists are usually equal, which is checked at once; otherwise
+// names missing somewhere are sent one by one
+inline std::vector<std::string> agreeNames(INMOST::Mesh &m, const std::vector<std::string> &names)
+{
+    if(m.GetProcessorsNumber() == 1)
+        return names;
+    unsigned hash = 2166136261u; // FNV-1a over names with separators
+    for(size_t i = 0; i < names.size(); i++)
+        for(size_t k = 0; k <= names[i].size(); k++){
+            hash ^= k < names[i].size() ? static_cast<unsigned char>(names[i][k]) : 0u;
+            hash *= 16777619u;
+        }
+    int h = static_cast<int>(hash & 0x7fffffff);
+    if(m.AggregateMin(h) == m.AggregateMax(h))
+        return names;
+
+    int rank = m.GetProcessorRank(), nproc = m.GetProcessorsNumber();
+    std::vector<std::string> agreed;
+    while(true){
+        size_t k = 0;
+        while(k < names.size() && std::find(agreed.begin(), agreed.end(), names[k]) != agreed.end())
+            k++;
+        int sender = m.AggregateMin(k < names.size() ? rank : nproc);
+        if(sender == nproc)
+            break;
+        int len = m.AggregateMax(rank == sender ? static_cast<int>(names[k].size()) : 0);
+        std::vector<int> buf(len + 1, 0);
+        if(rank == sender)
+            for(int c = 0; c < len; c++)
+                buf[c] = static_cast<unsigned char>(names[k][c]);
+        m.Integrate(&buf[0], len + 1);
+        std::string name;
+        for(int c = 0; c < len; c++)
+            name += static_cast<char>(buf[c]);
+        agreed.push_back(name);
+    }
+    return agreed;
+}
+
+class Profiler
+{
+private:
+    struct Phase
+    {
+        std::string name;
+        int parent;
+        double time;
+        long long calls;
+    };
+    std::vector<Phase> phases;
+    std::vector<int> active; // stack of open scopes
+
+    std::vector<std::string> counterNames;
+    std::vector<long long> counters;
+    std::vector< std::vector<long long> > steps; // counters of each finished time step
+    std::vector<long long> stepCounters;         // counters of current time step
+    std::vector<double> stepTimes;
+
+    std::vector<std::string> valueNames;
+    std::vector<double> values;
+
+    double tStart;
+
+    int addPhase(const std::string &name, int parent)
+    {
+        for(int i = 0; i < static_cast<int>(phases.size()); i++)
+            if(phases[i].parent == parent && phases[i].name == name)
+                return i;
+        Phase p;
+        p.name = name;
+        p.parent = parent;
+        p.time = 0.;
+        p.calls = 0;
+        phases.push_back(p);
+        return static_cast<int>(phases.size()) - 1;
+    }
+
+    std::string fullName(int i) const
+    {
+        if(phases[i].parent < 0)
+            return phases[i].name;
+        return fullName(phases[i].parent) + "/" + phases[i].name;
+    }
+
+    int counterIndex(const std::string &name)
+    {
+        for(int i = 0; i < static_cast<int>(counterNames.size()); i++)
+            if(counterNames[i] == name)
+                return i;
+        counterNames.push_back(name);
+        counters.push_back(0);
+        stepCounters.push_back(0);
+        return static_cast<int>(counterNames.size()) - 1;
+    }
+
+public:
+    // Time from construction to destruction is added to the phase
+    class Scope
+    {
+    private:
+        Profiler &p;
+        int id;
+        double t0;
+    public:
+        Scope(Profiler &prof, int phase) : p(prof), id(phase), t0(INMOST::Timer()) { p.active.push_back(id); }
+        Scope(Profiler &prof, const std::string &name) : p(prof), t0(INMOST::Timer())
+        {
+            id = p.addPhase(name, p.active.empty() ? -1 : p.active.back());
+            p.active.push_back(id);
+        }
+        ~Scope()
+        {
+            p.add(id, INMOST::Timer() - t0);
+            p.active.pop_back();
+        }
+    };
+
+    Profiler()
+    {
+        const char *names[T_NUM] = {"assemble", "solve", "precond", "IO", "init", "update"};
+        for(int i = 0; i < T_NUM; i++)
+            addPhase(names[i], -1);
+        tStart = INMOST::Timer();
+    }
+
+    // Add time of one call to top-level phase
+    void add(int phase, double t)
+    {
+        phases[phase].time += t;
+        phases[phase].calls++;
+    }
+
+    double get(int phase) const { return phases[phase].time; }
+
+    // Add to counter, both in total and for current time step
+    void count(const std::string &name, long long n = 1)
+    {
+        int i = counterIndex(name);
+        counters[i] += n;
+        stepCounters[i] += n;
+    }
+
+    long long getCounter(const std::string &name)
+    {
+        return counters[counterIndex(name)];
+    }
+
+    void setValue(const std::string &name, double v)
+    {
+        for(int i = 0; i < static_cast<int>(valueNames.size()); i++)
+            if(valueNames[i] == name){
+                values[i] = v;
+                return;
+            }
+        valueNames.push_back(name);
+        values.push_back(v);
+    }
+
+    // Finish time step at model time T: store and reset step counters
+    void endStep(double T)
+    {
+        steps.push_back(stepCounters);
+        stepTimes.push_back(T);
+        std::fill(stepCounters.begin(), stepCounters.end(), 0);
+    }
+
+    // Peak resident set size of this process in kilobytes, 0 if unknown
+    static double peakMemory()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        struct rusage usage;
+        if(getrusage(RUSAGE_SELF, &usage) == 0){
+#if defined(__APPLE__)
+            return usage.ru_maxrss / 1024.; // bytes on macOS
+#else
+            return static_cast<double>(usage.ru_maxrss);
+#endif
+        }
+#endif
+        return 0.;
+    }
+
+    void report(INMOST::Mesh &m, const std::string &prefix)
+    {
+        using namespace INMOST;
+        std::vector<std::string> local;
+        for(int i = 0; i < static_cast<int>(phases.size()); i++)
+            local.push_back(fullName(i));
+        std::vector<std::string> names = agreeNames(m, local);
+        std::vector<std::string> cnames = agreeNames(m, counterNames);
+
+        int np = static_cast<int>(names.size()) + 1;
+        std::vector<double> tmin(np, 0.), tmax(np, 0.), tavg(np, 0.), calls(np-1, 0.);
+        for(int i = 0; i < np-1; i++){
+            int k = static_cast<int>(std::find(local.begin(), local.end(), names[i]) - local.begin());
+            if(k == static_cast<int>(local.size()))
+                continue;
+            tmin[i] = tmax[i] = tavg[i] = phases[k].time;
+            calls[i] = static_cast<double>(phases[k].calls);
+        }
+        tmin[np-1] = tmax[np-1] = tavg[np-1] = Timer() - tStart;
+        int nc = static_cast<int>(cnames.size());
+        std::vector<double> cmax(nc, 0.);
+        for(int i = 0; i < nc; i++){
+            int k = static_cast<int>(std::find(counterNames.begin(), counterNames.end(), cnames[i]) - counterNames.begin());
+            if(k < static_cast<int>(counters.size()))
+                cmax[i] = static_cast<double>(counters[k]);
+        }
+        double rss = peakMemory();
+        int nproc = m.GetProcessorsNumber();
+        if(nproc > 1){
+            rss = m.AggregateMax(rss);
+            m.AggregateMin(&tmin[0], np);
+            m.AggregateMax(&tmax[0], np);
+            m.Integrate(&tavg[0], np);
+            for(int i = 0; i < np; i++)
+                tavg[i] /= nproc;
+            if(np > 1)
+                m.AggregateMax(&calls[0], np-1);
+            if(nc > 0)
+                m.AggregateMax(&cmax[0], nc);
+        }
+        if(m.GetProcessorRank() != 0)
+            return;
+
+        printf("\n+=========================\n");
+        for(int i = 0; i < np-1; i++){
+            int d = static_cast<int>(std::count(names[i].begin(), names[i].end(), '/'));
+            if(calls[i] == 0 && d > 0)
+                continue;
+            std::string label = std::string(2*d, ' ') + "T_" + names[i].substr(names[i].rfind('/') + 1);
+            printf("| %-10s = %lf", label.c_str(), tmax[i]);
+            if(nproc > 1)
+                printf("  (min %lf, avg %lf)", tmin[i], tavg[i]);
+            printf("\n");
+        }
+        printf("+-------------------------\n");
+        printf("| T_total    = %lf\n", tmax[np-1]);
+        printf("| Peak RSS   = %.0lf kB\n", rss);
+        printf("+=========================\n");
+
+        std::ofstream out((prefix + ".json").c_str());
+        out.precision(10);
+        out << "{\n";
+        out << "  \"processors\": " << nproc << ",\n";
+        out << "  \"peak_rss_kb\": " << rss << ",\n";
+        out << "  \"total\": {\"min\": " << tmin[np-1] << ", \"avg\": " << tavg[np-1]
+            << ", \"max\": " << tmax[np-1] << "},\n";
+        out << "  \"phases\": [\n";
+        for(int i = 0; i < np-1; i++){
+            out << "    {\"name\": \"" << names[i] << "\", \"calls\": " << static_cast<long long>(calls[i])
+                << ", \"min\": " << tmin[i] << ", \"avg\": " << tavg[i] << ", \"max\": " << tmax[i] << "}"
+                << (i+2 < np ? "," : "") << "\n";
+        }
+        out << "  ],\n";
+        out << "  \"counters\": {";
+        for(int i = 0; i < nc; i++)
+            out << (i ? ", " : "") << "\"" << cnames[i] << "\": " << static_cast<long long>(cmax[i]);
+        out << "},\n";
+        out << "  \"values\": {";
+        for(size_t i = 0; i < values.size(); i++)
+            out << (i ? ", " : "") << "\"" << valueNames[i] << "\": " << values[i];
+        out << "}\n";
+        out << "}\n";
+
+        if(steps.empty())
+            return;
+        std::ofstream csv((prefix + "_steps.csv").c_str());
+        csv.precision(10);
+        csv << "step,time";
+        for(size_t i = 0; i < counterNames.size(); i++)
+            csv << "," << counterNames[i];
+        csv << "\n";
+        for(size_t k = 0; k < steps.size(); k++){
+            csv << k << "," << stepTimes[k];
+            for(size_t i = 0; i < counterNames.size(); i++)
+                csv << "," << (i < steps[k].size() ? steps[k][i] : 0);
+            csv << "\n";
+        }
+    }
+};
+
+#endif // PROFILING_H
@@ -0,0 +1,326 @@
+#ifndef REORDERING_H
+#define REORDERING_H
+
+#include "inmost.h"
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+//    Cache-friendly ordering of mesh elements.
+//
+//    Mesh files (Gmsh output in particular) often list neighbouring
+//    elements far from each other, so cell loops and matrix rows
+//    numbered in file order jump over memory. Two orderings are available:
+//      rcm - reverse Cuthill-McKee over adjacency graph: cells are adjacent
+//            through faces, nodes through cells; reduces matrix bandwidth
+//            and ILU fill;
+//      sfc - Morton (Z-order) space-filling curve over centroids;
+//            cheap and good for locality of cell loops.
+//
+//    The position of each element in the new order is stored in integer tag
+//    REORDER_INDEX, so that saved results can be mapped between orders.
+//    Mesh storage itself is not changed: drivers iterate over the ordered
+//    handles and number their own unknowns by the tag.
+//
+//    Unknowns enumerated by Automatizator keep its LocalID-based numbering.
+//    UnknownPermutation renumbers them in element order: the Jacobian and
+//    residual are permuted before they go to the solver, and the solution
+//    is permuted back, so that drivers keep indexing by Automatizator.
+
+const std::string tagNameReorder = "REORDER_INDEX";
+
+enum ReorderMethod
+{
+    REORDER_NONE = 0,
+    REORDER_RCM,
+    REORDER_SFC
+};
+
+inline int parseReorderMethod(const std::string &name)
+{
+    if(name == "rcm")
+        return REORDER_RCM;
+    if(name == "sfc")
+        return REORDER_SFC;
+    if(name == "none")
+        return REORDER_NONE;
+    std::cout << "Unknown reordering " << name << ", use rcm, sfc or none" << std::endl;
+    exit(1);
+}
+
+// Adjacent elements of the same type: cells through faces, nodes through cells
+inline void adjacentElements(INMOST::Element e, std::vector<INMOST::HandleType> &adj)
+{
+    using namespace INMOST;
+    adj.clear();
+    if(e.GetElementType() == CELL){
+        ElementArray<Cell> cells = e.getAsCell().NeighbouringCells();
+        for(unsigned k = 0; k < cells.size(); k++)
+            adj.push_back(cells[k].GetHandle());
+    }
+    else{
+        ElementArray<Cell> cells = e.getCells();
+        for(unsigned k = 0; k < cells.size(); k++){
+            ElementArray<Node> nodes = cells[k].getNodes();
+            for(unsigned l = 0; l < nodes.size(); l++)
+                if(nodes[l].GetHandle() != e.GetHandle())
+                    adj.push_back(nodes[l].GetHandle());
+        }
+        std::sort(adj.begin(), adj.end());
+        adj.erase(std::unique(adj.begin(), adj.end()), adj.end());
+    }
+}
+
+// Reverse Cuthill-McKee, each connected component starts from an element of minimal degree
+inline void orderRCM(INMOST::Mesh &m, INMOST::ElementType etype, std::vector<INMOST::HandleType> &order)
+{
+    using namespace INMOST;
+    int n = m.LastLocalID(etype);
+    std::vector<int> degree(n, -1); // -1 for deleted elements
+    std::vector< std::vector<HandleType> > adj(n);
+    for(Mesh::iteratorElement it = m.BeginElement(etype); it != m.EndElement(); it++){
+        adjacentElements(it->self(), adj[it->LocalID()]);
+        degree[it->LocalID()] = static_cast<int>(adj[it->LocalID()].size());
+    }
+    std::vector<int> seeds;
+    for(int i = 0; i < n; i++)
+        if(degree[i] >= 0)
+            seeds.push_back(i);
+    std::stable_sort(seeds.begin(), seeds.end(),
+                     [&degree](int a, int b) { return degree[a] < degree[b]; });
+
+    std::vector<char> visited(n, 0);
+    order.clear();
+    std::vector<int> next;
+    for(size_t s = 0; s < seeds.size(); s++){
+        if(visited[seeds[s]])
+            continue;
+        size_t head = order.size();
+        visited[seeds[s]] = 1;
+        order.push_back(m.ElementByLocalID(etype, seeds[s]).GetHandle());
+        while(head < order.size()){
+            next.clear();
+            const std::vector<HandleType> &a = adj[GetHandleID(order[head++])];
+            for(size_t k = 0; k < a.size(); k++){
+                int id = GetHandleID(a[k]);
+                if(!visited[id]){
+                    visited[id] = 1;
+                    next.push_back(id);
+                }
+            }
+            std::sort(next.begin(), next.end(),
+                      [&degree](int a, int b) { return degree[a] < degree[b]; });
+            for(size_t k = 0; k < next.size(); k++)
+                order.push_back(m.ElementByLocalID(etype, next[k]).GetHandle());
+        }
+    }
+    std::reverse(order.begin(), order.end());
+}
+
+// Morton code of a point with coordinates in [0,1]^3, 21 bits per coordinate
+inline uint64_t mortonCode(const double *x)
+{
+    uint64_t code = 0;
+    uint64_t q[3];
+    for(int d = 0; d < 3; d++){
+        double v = std::min(std::max(x[d], 0.), 1.);
+        q[d] = static_cast<uint64_t>(v * ((1 << 21) - 1));
+    }
+    for(int b = 20; b >= 0; b--)
+        for(int d = 0; d < 3; d++)
+            code = (code << 1) | ((q[d] >> b) & 1);
+    return code;
+}
+
+inline void orderSFC(INMOST::Mesh &m, INMOST::ElementType etype, std::vector<INMOST::HandleType> &order)
+{
+    using namespace INMOST;
+    double xmin[3] = {1e300, 1e300, 1e300}, xmax[3] = {-1e300, -1e300, -1e300};
+    std::vector< std::pair<uint64_t, HandleType> > keys;
+    std::vector< std::vector<double> > xc;
+    for(Mesh::iteratorElement it = m.BeginElement(etype); it != m.EndElement(); it++){
+        std::vector<double> x(3, 0.);
+        it->Centroid(&x[0]);
+        for(int d = 0; d < m.GetDimensions(); d++){
+            xmin[d] = std::min(xmin[d], x[d]);
+            xmax[d] = std::max(xmax[d], x[d]);
+        }
+        xc.push_back(x);
+        keys.push_back(std::make_pair(0, it->GetHandle()));
+    }
+    for(size_t k = 0; k < keys.size(); k++){
+        double y[3] = {0., 0., 0.};
+        for(int d = 0; d < m.GetDimensions(); d++)
+            if(xmax[d] > xmin[d])
+                y[d] = (xc[k][d] - xmin[d]) / (xmax[d] - xmin[d]);
+        keys[k].first = mortonCode(y);
+    }
+    std::stable_sort(keys.begin(), keys.end());
+    order.resize(keys.size());
+    for(size_t k = 0; k < keys.size(); k++)
+        order[k] = keys[k].second;
+}
+
+// Compute order of elements of type etype and store positions in REORDER_INDEX tag
+inline void reorderElements(INMOST::Mesh &m, INMOST::ElementType etype, int method,
+                            std::vector<INMOST::HandleType> &order)
+{
+    using namespace INMOST;
+    order.clear();
+    if(method == REORDER_NONE)
+        return;
+    if(method == REORDER_RCM)
+        orderRCM(m, etype, order);
+    else
+        orderSFC(m, etype, order);
+    Tag tagOrder = m.CreateTag(tagNameReorder, DATA_INTEGER, etype, NONE, 1);
+    for(size_t k = 0; k < order.size(); k++)
+        m.Integer(order[k], tagOrder) = static_cast<int>(k);
+}
+
+class UnknownPermutation
+{
+private:
+    INMOST_DATA_ENUM_TYPE first, last;
+    std::vector<INMOST_DATA_ENUM_TYPE> perm; // new index by old index - first
+    std::map<INMOST_DATA_ENUM_TYPE, INMOST_DATA_ENUM_TYPE> remote; // new indices of other processors' unknowns
+    INMOST::Sparse::Matrix permuted; // matrix given to solver by setMatrix
+
+    INMOST_DATA_ENUM_TYPE newIndex(INMOST_DATA_ENUM_TYPE i) const
+    {
+        if(i >= first && i < last)
+            return perm[i - first];
+        std::map<INMOST_DATA_ENUM_TYPE, INMOST_DATA_ENUM_TYPE>::const_iterator it = remote.find(i);
+        return it == remote.end() ? i : it->second;
+    }
+
+public:
+    UnknownPermutation() : first(0), last(0) {}
+    bool empty() const { return perm.empty(); }
+
+    // Old indices of own unknowns are listed in new order, repeated
+    // and foreign ones are skipped; unknowns not met keep their old order at the end
+    void build(INMOST_DATA_ENUM_TYPE beg, INMOST_DATA_ENUM_TYPE end, const std::vector<INMOST_DATA_ENUM_TYPE> &order)
+    {
+        first = beg;
+        last = end;
+        perm.assign(last - first, ENUMUNDEF);
+        remote.clear();
+        INMOST_DATA_ENUM_TYPE next = first;
+        for(size_t k = 0; k < order.size(); k++)
+            if(order[k] >= first && order[k] < last && perm[order[k] - first] == ENUMUNDEF)
+                perm[order[k] - first] = next++;
+        for(INMOST_DATA_ENUM_TYPE i = 0; i < last - first; i++)
+            if(perm[i] == ENUMUNDEF)
+                perm[i] = next++;
+    }
+
+    // New indices of unknowns of ghost elements of type etype are received
+    // from their owners; index(e) is the old index or ENUMUNDEF.
+    // Called once per unknown of an element if there are several.
+    // Collective, not needed on one processor
+    template<typename IndexFn>
+    void exchange(INMOST::Mesh &m, INMOST::ElementType etype, IndexFn index)
+    {
+        using namespace INMOST;
+        Tag tagNew = m.CreateTag("REORDER_UNKNOWN", DATA_INTEGER, etype, NONE, 1);
+        for(Mesh::iteratorElement it = m.BeginElement(etype); it != m.EndElement(); it++){
+            INMOST_DATA_ENUM_TYPE i = index(it->self());
+            if(it->GetStatus() != Element::Ghost && i != ENUMUNDEF)
+                it->Integer(tagNew) = static_cast<int>(newIndex(i));
+        }
+        m.ExchangeData(tagNew, etype);
+        for(Mesh::iteratorElement it = m.BeginElement(etype); it != m.EndElement(); it++){
+            INMOST_DATA_ENUM_TYPE i = index(it->self());
+            if(it->GetStatus() == Element::Ghost && i != ENUMUNDEF)
+                remote[i] = static_cast<INMOST_DATA_ENUM_TYPE>(it->Integer(tagNew));
+        }
+        m.DeleteTag(tagNew);
+    }
+
+    // B = P A P^T, columns of each row in increasing order
+    void matrix(INMOST::Sparse::Matrix &A, INMOST::Sparse::Matrix &B) const
+    {
+        using namespace INMOST;
+        B.SetInterval(first, last);
+        std::vector< std::pair<INMOST_DATA_ENUM_TYPE, INMOST_DATA_REAL_TYPE> > row;
+        for(INMOST_DATA_ENUM_TYPE i = first; i < last; i++){
+            Sparse::Row &a = A[i];
+            row.resize(a.Size());
+            for(INMOST_DATA_ENUM_TYPE k = 0; k < a.Size(); k++)
+                row[k] = std::make_pair(newIndex(a.GetIndex(k)), a.GetValue(k));
+            std::sort(row.begin(), row.end());
+            Sparse::Row &b = B[perm[i - first]];
+            b.Clear();
+            for(size_t k = 0; k < row.size(); k++)
+                b.Push(row[k].first, row[k].second);
+        }
+    }
+
+    // y = P x
+    void vector(INMOST::Sparse::Vector &x, INMOST::Sparse::Vector &y) const
+    {
+        y.SetInterval(first, last);
+        for(INMOST_DATA_ENUM_TYPE i = first; i < last; i++)
+            y[perm[i - first]] = x[i];
+    }
+
+    // x = P^T y
+    void restore(INMOST::Sparse::Vector &y, INMOST::Sparse::Vector &x) const
+    {
+        x.SetInterval(first, last);
+        for(INMOST_DATA_ENUM_TYPE i = first; i < last; i++)
+            x[i] = y[perm[i - first]];
+    }
+
+    // Give A to the solver in new order, as is if there is no permutation;
+    // flags are those of Solver::SetMatrix
+    template<typename LinearSolver>
+    void setMatrix(LinearSolver &S, INMOST::Sparse::Matrix &A,
+                   bool modifiedPattern = true, bool oldPreconditioner = false)
+    {
+        if(empty()){
+            S.SetMatrix(A, modifiedPattern, oldPreconditioner);
+            return;
+        }
+        matrix(A, permuted);
+        S.SetMatrix(permuted, modifiedPattern, oldPreconditioner);
+    }
+
+    INMOST::Sparse::Matrix &getMatrix() { return permuted; }
+
+    // Solve with matrix given by setMatrix, rhs and sol are in old order
+    template<typename LinearSolver>
+    bool solve(LinearSolver &S, INMOST::Sparse::Vector &rhs, INMOST::Sparse::Vector &sol) const
+    {
+        if(empty())
+            return S.Solve(rhs, sol);
+        INMOST::Sparse::Vector rhsP, solP;
+        vector(rhs, rhsP);
+        vector(sol, solP);
+        bool solved = S.Solve(rhsP, solP);
+        restore(solP, sol);
+        return solved;
+    }
+};
+
+// Largest distance of a nonzero from the diagonal among own rows and columns
+inline INMOST_DATA_ENUM_TYPE matrixBandwidth(INMOST::Sparse::Matrix &A)
+{
+    INMOST_DATA_ENUM_TYPE bw = 0;
+    for(INMOST_DATA_ENUM_TYPE i = A.GetFirstIndex(); i < A.GetLastIndex(); i++){
+        INMOST::Sparse::Row &r = A[i];
+        for(INMOST_DATA_ENUM_TYPE k = 0; k < r.Size(); k++){
+            INMOST_DATA_ENUM_TYPE j = r.GetIndex(k);
+            if(j < A.GetFirstIndex() || j >= A.GetLastIndex())
+                continue;
+            bw = std::max(bw, j > i ? j - i : i - j);
+        }
+    }
+    return bw;
+}
+
+#endif // REORDERING_H
@@ -0,0 +1,89 @@
+#ifndef SHAPE_CACHE_H
+#define SHAPE_CACHE_H
+
+#include "inmost.h"
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <vector>
+
+//    Cache of local matrices for cells of repeated shape.
+//
+//    On structured or extruded meshes most cells are translated copies
+//    of a few shapes. Local stiffness matrix depends only on node coordinates
+//    relative to the first node and on cell coefficients (diffusion tensor),
+//    so it can be computed once per distinct shape.
+//
+//    The key of a cell consists of relative node coordinates rounded
+//    to multiples of tolerance 'tol' and exact values of coefficients.
+//    Node order matters: the same shape with differently ordered
+//    nodes gets another key, which only reduces the number of hits.
+//
+//    With OpenMP lookups and insertions are done in a critical section.
+
+class ShapeCache
+{
+public:
+    typedef std::vector<long long> Key;
+private:
+    double tol;
+    std::map< Key, std::vector<double> > entries;
+    long long hits, misses;
+public:
+    ShapeCache(double t = 1e-10) : tol(t), hits(0), misses(0) {}
+    void setTolerance(double t) { tol = t; }
+
+    // Build key from 'nn' nodes with 'dim' coordinates and 'ncoef' coefficients
+    template<typename NodeArray>
+    void makeKey(const NodeArray &nodes, int nn, int dim, const double *coef, int ncoef, Key &key) const
+    {
+        key.resize(1 + nn*dim + ncoef);
+        key[0] = nn;
+        INMOST::Storage::real_array x0 = nodes[0].Coords();
+        for(int i = 0; i < nn; i++){
+            INMOST::Storage::real_array x = nodes[i].Coords();
+            for(int d = 0; d < dim; d++)
+                key[1 + i*dim + d] = llround((x[d] - x0[d]) / tol);
+        }
+        for(int k = 0; k < ncoef; k++){
+            long long bits;
+            memcpy(&bits, &coef[k], sizeof(bits));
+            key[1 + nn*dim + k] = bits;
+        }
+    }
+
+    // Copy cached matrix of 'size' entries to 'a', returns false if there is none
+    bool find(const Key &key, double *a, int size)
+    {
+        bool found = false;
+#if defined(USE_OMP)
+#pragma omp critical(shape_cache)
+#endif
+        {
+            std::map< Key, std::vector<double> >::const_iterator it = entries.find(key);
+            if(it != entries.end() && static_cast<int>(it->second.size()) == size){
+                memcpy(a, &it->second[0], size*sizeof(double));
+                found = true;
+                hits++;
+            }
+            else
+                misses++;
+        }
+        return found;
+    }
+
+    void insert(const Key &key, const double *a, int size)
+    {
+#if defined(USE_OMP)
+#pragma omp critical(shape_cache)
+#endif
+        entries[key].assign(a, a + size);
+    }
+
+    int numShapes() const { return static_cast<int>(entries.size()); }
+    long long numHits() const { return hits; }
+    long long numMisses() const { return misses; }
+    void clear() { entries.clear(); hits = misses = 0; }
+};
+
+#endif // SHAPE_CACHE_H
@@ -0,0 +1,153 @@
+#ifndef SOLUTION_WRITER_H
+#define SOLUTION_WRITER_H
+
+#include "inmost.h"
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//    Asynchronous output of cell fields of a transient run.
+//
+//    Mesh does not change during the run, so coordinates of nodes
+//    and connectivity of owned cells are gathered once, in constructor.
+//    write() copies values of selected cell tags to a snapshot and returns,
+//    the file is written by a background thread while the solver goes on.
+//    The next write() waits for the previous file to be finished.
+//
+//    Files are binary legacy VTK unstructured grids with cells as polygons,
+//    which is much smaller than ASCII output of Mesh::Save.
+//    In parallel runs every processor writes its owned cells to
+//    <prefix>_<rank>.vtk and processor 0 writes <prefix>.pvtk with list of pieces.
+
+class SolutionWriter
+{
+private:
+    int rank, nproc;
+    std::vector<double> coords;      // 3 per node of owned cells
+    std::vector<int> cellPtr;        // start of cell in cellNodes, size #cells+1
+    std::vector<int> cellNodes;      // numbers of nodes in coords
+    std::vector<INMOST::HandleType> cells; // owned cells
+    std::vector<INMOST::Tag> fields;
+    std::vector<double> snapshot;    // values of fields, one field after another
+    std::thread thread;
+
+    // Legacy VTK binary data is big-endian
+    template<typename T>
+    static void putBigEndian(std::ofstream &out, T v)
+    {
+        unsigned char b[sizeof(T)];
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(&v);
+        const uint16_t one = 1;
+        bool little = *reinterpret_cast<const unsigned char *>(&one) == 1;
+        for(size_t k = 0; k < sizeof(T); k++)
+            b[k] = little ? p[sizeof(T)-1-k] : p[k];
+        out.write(reinterpret_cast<const char *>(b), sizeof(T));
+    }
+
+    void writeFile(const std::string &prefix) const
+    {
+        std::string name = prefix + (nproc > 1 ? "_" + std::to_string(rank) : "") + ".vtk";
+        std::ofstream out(name.c_str(), std::ios::binary);
+        if(!out){
+            std::cout << "Can't open file " << name << std::endl;
+            return;
+        }
+        size_t nn = coords.size() / 3, nc = cells.size();
+        out << "# vtk DataFile Version 3.0\n" << prefix << "\nBINARY\nDATASET UNSTRUCTURED_GRID\n";
+        out << "POINTS " << nn << " double\n";
+        for(size_t k = 0; k < coords.size(); k++)
+            putBigEndian(out, coords[k]);
+        out << "\nCELLS " << nc << " " << nc + cellNodes.size() << "\n";
+        for(size_t c = 0; c < nc; c++){
+            putBigEndian<int32_t>(out, cellPtr[c+1] - cellPtr[c]);
+            for(int k = cellPtr[c]; k < cellPtr[c+1]; k++)
+                putBigEndian<int32_t>(out, cellNodes[k]);
+        }
+        out << "\nCELL_TYPES " << nc << "\n";
+        for(size_t c = 0; c < nc; c++)
+            putBigEndian<int32_t>(out, 7); // VTK_POLYGON
+        out << "\nCELL_DATA " << nc << "\n";
+        for(size_t f = 0; f < fields.size(); f++){
+            out << "SCALARS " << fields[f].GetTagName() << " double 1\nLOOKUP_TABLE default\n";
+            for(size_t c = 0; c < nc; c++)
+                putBigEndian(out, snapshot[f*nc+c]);
+            out << "\n";
+        }
+
+        if(nproc > 1 && rank == 0){
+            std::string base = prefix.substr(prefix.find_last_of('/') + 1);
+            std::ofstream pout((prefix + ".pvtk").c_str());
+            pout << "<File version=\"pvtk-1.0\" dataType=\"vtkUnstructuredGrid\" numberOfPieces=\"" << nproc << "\">\n";
+            for(int p = 0; p < nproc; p++)
+                pout << "  <Piece fileName=\"" << base << "_" << p << ".vtk\"/>\n";
+            pout << "</File>\n";
+        }
+    }
+
+public:
+    SolutionWriter(INMOST::Mesh &m, const std::vector<std::string> &names)
+    {
+        using namespace INMOST;
+        rank = m.GetProcessorRank();
+        nproc = m.GetProcessorsNumber();
+        for(size_t f = 0; f < names.size(); f++){
+            if(!m.HaveTag(names[f])){
+                std::cout << "No tag " << names[f] << " for output" << std::endl;
+                exit(1);
+            }
+            Tag t = m.GetTag(names[f]);
+            if(t.GetDataType() != DATA_REAL || t.GetSize() != 1 || !t.isDefined(CELL)){
+                std::cout << "Output field " << names[f] << " should be a real scalar on cells" << std::endl;
+                exit(1);
+            }
+            fields.push_back(t);
+        }
+
+        std::vector<int> nodeNum(m.NodeLastLocalID(), -1);
+        cellPtr.push_back(0);
+        for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++){
+            if(icell->GetStatus() == Element::Ghost)
+                continue;
+            cells.push_back(icell->GetHandle());
+            ElementArray<Node> nodes = icell->getNodes();
+            for(unsigned k = 0; k < nodes.size(); k++){
+                int &num = nodeNum[nodes[k].LocalID()];
+                if(num < 0){
+                    num = static_cast<int>(coords.size() / 3);
+                    double x[3] = {0., 0., 0.};
+                    nodes[k].Centroid(x);
+                    coords.insert(coords.end(), x, x+3);
+                }
+                cellNodes.push_back(num);
+            }
+            cellPtr.push_back(static_cast<int>(cellNodes.size()));
+        }
+        snapshot.resize(fields.size() * cells.size());
+    }
+
+    ~SolutionWriter() { wait(); }
+
+    // Copy fields and start writing <prefix>.vtk (or pieces and .pvtk) in background
+    void write(INMOST::Mesh &m, const std::string &prefix)
+    {
+        wait();
+        size_t nc = cells.size();
+        for(size_t f = 0; f < fields.size(); f++)
+            for(size_t c = 0; c < nc; c++)
+                snapshot[f*nc+c] = m.Real(cells[c], fields[f]);
+        thread = std::thread(&SolutionWriter::writeFile, this, prefix);
+    }
+
+    // Wait for the last file to be written
+    void wait()
+    {
+        if(thread.joinable())
+            thread.join();
+    }
+};
+
+#endif // SOLUTION_WRITER_H
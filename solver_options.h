@@ -0,0 +1,118 @@
+#ifndef SOLVER_OPTIONS_H
+#define SOLVER_OPTIONS_H
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+//    Choice of linear solver at run time.
+//
+//    Any type known to INMOST::Solver can be given with -solver, e.g.
+//      inner_ilu2, inner_mptiluc - ILU-preconditioned BiCGStab (defaults of drivers)
+//      inner_mlmptiluc           - multilevel ILU, weaker growth of iterations with refinement
+//      petsc                     - PETSc KSP with its default or database options
+//      amg                       - alias of petsc with CG and GAMG preconditioner,
+//                                  for symmetric positive definite systems
+//      trilinos_ml               - Trilinos AztecOO with ML algebraic multigrid
+//    External solvers are available if INMOST was built with them.
+//    PETSc reads options from PETSC_OPTIONS environment variable at
+//    Solver::Initialize. amg adds there options under the prefix of its solver,
+//    -<prefix>_ksp_type cg -<prefix>_pc_type gamg, so that other PETSc solvers
+//    of the same run keep their own settings; the prefix defaults to
+//    the option name without dash (solver, flow_solver). Options already
+//    in PETSC_OPTIONS follow and take precedence.
+//
+//    Solver parameters (tolerances, PETSc/Trilinos option files) are read
+//    from XML database given by -solver_db, which is passed to Solver::Initialize.
+//    Parameters set by drivers with SetParameter override the database.
+//    Section of the database is selected with -solver_prefix.
+
+class SolverOptions
+{
+private:
+    // Replace options of prefix 'from' in PETSC_OPTIONS by those of 'to',
+    // empty 'from' adds a prefix, empty 'to' removes one
+    static void setPetscAMG(const std::string &from, const std::string &to)
+    {
+        static std::vector<std::string> prefixes;
+        static std::string user; // PETSC_OPTIONS given by user
+        static bool saved = false;
+        if(!saved){
+            const char *env = getenv("PETSC_OPTIONS");
+            user = env ? env : "";
+            saved = true;
+        }
+        for(size_t k = 0; k < prefixes.size(); k++)
+            if(prefixes[k] == from){
+                prefixes.erase(prefixes.begin() + k);
+                break;
+            }
+        if(!to.empty())
+            prefixes.push_back(to);
+        std::string opt;
+        for(size_t k = 0; k < prefixes.size(); k++)
+            opt += "-" + prefixes[k] + "_ksp_type cg -" + prefixes[k] + "_pc_type gamg ";
+        setenv("PETSC_OPTIONS", (opt + user).c_str(), 1);
+    }
+
+public:
+    std::string type;     // INMOST solver type
+    std::string prefix;   // prefix of solver parameters in database
+    std::string database; // XML file with solver parameters
+    bool amg;             // petsc solver set up by amg alias
+
+    SolverOptions(const std::string &t = "inner_ilu2", const std::string &p = "", const std::string &db = "")
+        : type(t), prefix(p), database(db), amg(false) {}
+
+    // Fill fields not given by user with those of 'o'
+    void inherit(const SolverOptions &o)
+    {
+        if(database.empty())
+            database = o.database;
+        if(!type.empty())
+            return;
+        type = o.type;
+        if(prefix.empty())
+            prefix = o.prefix;
+        else if(o.amg)
+            setPetscAMG("", prefix);
+        amg = o.amg;
+    }
+
+    // Recognize options <name> <type>, <name>_prefix <prefix> and -solver_db <file>
+    // at argv[i]; on success i is moved to the value of the option
+    bool parse(int &i, int argc, char **argv, const std::string &name = "-solver")
+    {
+        std::string opt(argv[i]);
+        std::string *val;
+        if(opt == name)
+            val = &type;
+        else if(opt == name + "_prefix")
+            val = &prefix;
+        else if(opt == "-solver_db")
+            val = &database;
+        else
+            return false;
+        if(i+1 == argc){
+            std::cout << "Missing value for option " << opt << std::endl;
+            exit(1);
+        }
+        std::string oldPrefix = prefix;
+        bool wasAMG = amg;
+        *val = argv[++i];
+        if(val == &type){
+            amg = type == "amg";
+            if(amg){
+                type = "petsc";
+                if(prefix.empty())
+                    prefix = name.substr(1);
+            }
+        }
+        if(wasAMG || amg)
+            setPetscAMG(wasAMG ? oldPrefix : "", amg ? prefix : "");
+        return true;
+    }
+};
+
+#endif // SOLVER_OPTIONS_H
@@ -0,0 +1,47 @@
+#ifndef TENSOR_TAG_H
+#define TENSOR_TAG_H
+
+#include "inmost.h"
+#include <string>
+
+//    Storage of cell tensors (conductivity, diffusion).
+//
+//    Dense layout keeps a copy of the tensor on every cell. Compact layout
+//    defines the tag on the mesh and, as a sparse tag, on cells: the mesh
+//    record is the default tensor, only cells of regions with a different
+//    tensor keep their own record. A constant tensor is stored once.
+//    Readers should take the tensor of a cell with cellTensor().
+
+inline INMOST::Tag createTensorTag(INMOST::Mesh &m, const std::string &name, int size, bool compact)
+{
+    using namespace INMOST;
+    if(compact)
+        return m.CreateTag(name, DATA_REAL, MESH|CELL, CELL, size);
+    return m.CreateTag(name, DATA_REAL, CELL, NONE, size);
+}
+
+// Tensor of all cells without own record
+inline void setDefaultTensor(INMOST::Mesh &m, const INMOST::Tag &tag, const double *d)
+{
+    using namespace INMOST;
+    int size = static_cast<int>(tag.GetSize());
+    if(tag.isDefined(MESH)){
+        Storage::real_array t = m.RealArray(m.GetHandle(), tag);
+        for(int k = 0; k < size; k++)
+            t[k] = d[k];
+        return;
+    }
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
+        for(int k = 0; k < size; k++)
+            icell->RealArray(tag)[k] = d[k];
+}
+
+inline const double *cellTensor(INMOST::Mesh &m, const INMOST::Tag &tag, INMOST::HandleType cell)
+{
+    using namespace INMOST;
+    if(tag.isDefined(MESH) && !m.HaveData(cell, tag))
+        return m.RealArray(m.GetHandle(), tag).data();
+    return m.RealArray(cell, tag).data();
+}
+
+#endif // TENSOR_TAG_H